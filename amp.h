@@ -36,6 +36,20 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdbit.h>
+
+#if !defined(AMP_NO_THREADS) \
+&& (defined(__STDC_NO_THREADS__) || defined(__STDC_NO_ATOMICS__))
+#define AMP_NO_THREADS
+#endif
+
+#ifndef AMP_NO_THREADS
+#include <stdatomic.h>
+#include <threads.h>
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 ////////////////////////////////////////////////////////////////////////////////
 
 #define AMP_MAJOR_VERSION  1
@@ -47,15 +61,31 @@
 #define AMP_BUF_SIZE sizeof(size_t)
 #endif
 
+#ifndef AMP_PRINTF_BUF_SIZE
+#define AMP_PRINTF_BUF_SIZE 256
+#endif
+
 #define AMP_ESC "\x1b"
 
 struct amp_type;
+struct amp_sprite_type;
+struct amp_tilemap_type;
+struct amp_compositor_type;
+struct amp_layer_type;
+struct amp_command_buffer_type;
+struct amp_double_buffer_type;
+struct amp_band_type;
+struct amp_rich_text_type;
+struct amp_layout_cache_type;
+struct amp_text_stream_type;
+struct amp_console_type;
 
 static constexpr size_t AMP_CELL_GLYPH_SIZE = 5; // 4 bytes for UTF8 + null byte
 static constexpr size_t AMP_CELL_MODE_SIZE  = 8;
 static constexpr size_t AMP_CELL_SIZE       = (
     AMP_CELL_GLYPH_SIZE + AMP_CELL_MODE_SIZE
 );
+static constexpr size_t AMP_DAMAGE_MAX      = 8; // damaged areas per compositor
 
 typedef enum : uint8_t {
     AMP_COLOR_NONE = 0,
@@ -150,6 +180,198 @@ static inline void                      amp_clear(
     // Fills the ansmap with empty string glyphs and resets their style.
 );
 
+static inline bool                      amp_resize(
+    struct amp_type *                       ansmap,
+    uint32_t                                ansmap_width,
+    uint32_t                                ansmap_height,
+    void *                                  canvas_data,
+    size_t                                  canvas_data_size
+
+    // Changes the resolution of the ansmap while keeping the contents of its
+    // overlapping part. The canvas is relaid out in place without the need for
+    // a temporary buffer. If the canvas data pointer is a null pointer, then
+    // the current canvas buffer is reused. Otherwise, the provided buffer must
+    // begin with the contents of the current canvas buffer, like it would after
+    // the reallocation of the canvas buffer. If the canvas data array is not
+    // big enough for the new image, then the end of the image will be cut off.
+    // Views, derived ansmaps, the parents of derived ansmaps, the back buffers
+    // of double buffers and the ansmaps partitioned into bands cannot be
+    // resized. Neither can an ansmap with lazy clearing be resized to more rows
+    // than its row generation array has room for, unless lazy clearing is first
+    // turned off or given a bigger array.
+    //
+    // Returns true on success and false if the ansmap cannot be resized.
+);
+
+static inline bool                      amp_set_lazy_clear(
+    struct amp_type *                       ansmap,
+    uint32_t *                              row_generations,
+    uint32_t                                row_generation_count
+
+    // Makes the clearing of the ansmap a constant time operation. The provided
+    // array holds a generation counter for each row of the ansmap. A row with
+    // a generation older than that of the ansmap reads as empty and it gets
+    // cleared only when something is written on it. If the array pointer is a
+    // null pointer, then the ansmap is switched back to the eager clearing
+    // mode. Views and derived ansmaps do not support the lazy clearing mode.
+    //
+    // Returns true on success and false if the array has fewer elements than
+    // the ansmap has rows or if the ansmap does not support the lazy mode.
+);
+
+#ifndef AMP_NO_THREADS
+static inline size_t                    amp_calc_double_buffer_size(
+    uint32_t                                ansmap_width,
+    uint32_t                                ansmap_height
+
+    // Returns the size of the data buffer needed for the initialization of a
+    // double buffer with the given resolution.
+);
+
+static inline size_t                    amp_init_double_buffer(
+    struct amp_double_buffer_type *         double_buffer,
+    uint32_t                                ansmap_width,
+    uint32_t                                ansmap_height,
+    void *                                  canvas_data,
+    size_t                                  canvas_data_size
+
+    // Initializes a double buffer that consists of two ansmaps sharing the
+    // provided data buffer. One thread draws the next frame on the back buffer
+    // while any number of other threads read the previous frame from the front
+    // buffer. If the data buffer is not big enough, then the ends of the images
+    // will be cut off.
+    //
+    // Returns the number of bytes required for the double buffer.
+);
+
+static inline struct amp_type *         amp_get_back_buffer(
+    struct amp_double_buffer_type *         double_buffer
+
+    // Returns the back buffer for the drawing thread to draw the next frame on.
+);
+
+static inline void                      amp_swap(
+    struct amp_double_buffer_type *         double_buffer,
+    bool                                    preserve
+
+    // Publishes the back buffer as the new front buffer for the readers. The
+    // old front buffer becomes the new back buffer as soon as the readers have
+    // released it. If the preserve argument is true, then the new back buffer
+    // is brought up to date with the published frame, copying only the rows
+    // that were drawn on, so that the drawing can continue incrementally.
+);
+
+static inline const struct amp_type *   amp_acquire_front_buffer(
+    struct amp_double_buffer_type *         double_buffer
+
+    // Returns the front buffer for reading. The front buffer stays unchanged
+    // until it is released with the amp_release_front_buffer function. This
+    // function is safe to call from any thread.
+);
+
+static inline void                      amp_release_front_buffer(
+    struct amp_double_buffer_type *         double_buffer,
+    const struct amp_type *                 front_buffer
+
+    // Releases the front buffer acquired with amp_acquire_front_buffer.
+);
+
+static inline bool                      amp_set_bands(
+    struct amp_type *                       ansmap,
+    struct amp_band_type *                  bands,
+    uint32_t                                band_count
+
+    // Partitions the rows of the ansmap into the given number of bands of equal
+    // height, each guarded by its own sequence counter in the provided array.
+    // Threads that draw on disjoint bands can then work on the ansmap at the
+    // same time. If the bands argument is a null pointer, then the partitioning
+    // is removed.
+    //
+    // Returns true on success and false if the ansmap is a view or takes part
+    // in copy-on-write sharing.
+);
+
+static inline void                      amp_lock_rows(
+    struct amp_type *                       ansmap,
+    long                                    y,
+    uint32_t                                row_count
+
+    // Waits until this thread has exclusive access to the bands that contain
+    // the given rows. The rows of a view are locked in its parent ansmap. The
+    // operations that affect all of the rows, such as clearing and scrolling,
+    // require the whole ansmap to be locked.
+);
+
+static inline void                      amp_unlock_rows(
+    struct amp_type *                       ansmap,
+    long                                    y,
+    uint32_t                                row_count
+
+    // Releases the bands locked with the amp_lock_rows function.
+);
+
+static inline void                      amp_snapshot_rows(
+    struct amp_type *                       dst_ansmap,
+    const struct amp_type *                 src_ansmap,
+    long                                    y,
+    uint32_t                                row_count
+
+    // Copies the given rows of the source ansmap into the same rows of the
+    // destination ansmap. Each band is copied in a consistent state without
+    // locking it, so that the readers never delay the drawing threads.
+);
+#endif
+
+static inline size_t                    amp_calc_cow_size(
+    uint32_t                                ansmap_width,
+    uint32_t                                ansmap_height,
+    uint32_t                                private_row_count
+
+    // Returns the size of the data buffer needed for the initialization of a
+    // copy-on-write ansmap that can hold the given number of private rows.
+);
+
+static inline uint32_t                  amp_init_cow(
+    struct amp_type *                       derived_ansmap,
+    struct amp_type *                       parent_ansmap,
+    void *                                  derived_data,
+    size_t                                  derived_data_size
+
+    // Initializes the derived ansmap as a copy-on-write copy of the parent
+    // ansmap. Both of the ansmaps share their rows until a row is modified in
+    // either of them. Only then the derived ansmap gets its private copy of the
+    // modified row, which is stored in the provided data buffer. If the buffer
+    // is too small for another private row, then the rows that are still
+    // shared become read-only in both of the ansmaps, so that the derived
+    // ansmap never sees the modifications made in the parent ansmap.
+    //
+    // Returns the number of private rows the derived ansmap can hold.
+);
+
+static inline bool                      amp_init_view(
+    struct amp_type *                       view_ansmap,
+    struct amp_type *                       parent_ansmap,
+    long                                    view_x,
+    long                                    view_y,
+    uint32_t                                view_width,
+    uint32_t                                view_height
+
+    // Initializes the view ansmap as a window into a rectangular region of the
+    // parent ansmap. The view has no canvas of its own as all of its cells are
+    // read from and written to the parent ansmap. Any drawing on the view is
+    // clipped to the bounds of the view. The region itself is clipped to the
+    // bounds of the parent ansmap.
+    //
+    // Returns true if the view is not empty.
+);
+
+static inline void                      amp_deinit_cow(
+    struct amp_type *                       derived_ansmap
+    // Detaches the derived ansmap from its parent and turns it into an empty
+    // ansmap. It must be called before the memory of the derived ansmap is
+    // released and before the parent ansmap is initialized again.
+);
+
 static inline void                      amp_set_palette(
     struct amp_type *                       ansmap,
     AMP_PALETTE                             palette
@@ -158,6 +380,17 @@ static inline void                      amp_set_palette(
     // the conversion of the ansmap into ANSI escape sequences.
 );
 
+static inline void                      amp_scroll(
+    struct amp_type *                       ansmap,
+    long                                    rows
+
+    // Scrolls the contents of the ansmap vertically by the given number of
+    // rows. A positive number moves the contents up and a negative number moves
+    // them down. The rows exposed by scrolling are cleared. Scrolling a whole
+    // ansmap only rotates the order of its rows in the canvas and clears the
+    // exposed rows, while views and the other ansmaps have their rows moved.
+);
+
 static inline void                      amp_print_glyph(
     struct amp_type *                       ansmap,
     long                                    glyph_x,
@@ -165,7 +398,8 @@ static inline void                      amp_print_glyph(
     AMP_STYLE                               glyph_style,
     const char *                            glyph_str
 
-    // Prints a single glyph on the given ansmap.
+    // Prints a single glyph on the given ansmap. Wide glyphs, such as the East
+    // Asian ideographs, take two cells: the glyph itself and the tail after it.
 );
 
 static inline void                      amp_print_line(
@@ -252,7 +486,8 @@ static inline const char *              amp_get_glyph(
 
     // Returns a pointer to the null-terminated UTF-8 encoded string of the
     // glyph on the given position of the ansmap. If the specified position is
-    // not on the ansmap, then a null pointer is returned.
+    // not on the ansmap, then a null pointer is returned. The tail cell of a
+    // wide glyph holds the byte 0xFF, which is never a part of valid UTF-8.
 );
 
 static inline const char *              amp_put_glyph(
@@ -263,10 +498,20 @@ static inline const char *              amp_put_glyph(
 
     // Overwrites a single glyph in the ansmap on the given position and returns
     // a pointer to the null-terminated UTF-8 encoded string of the new glyph.
+    // If the glyph is wide, then the next cell is overwritten with its tail.
     // If the specified position is not on the ansmap, then a null pointer is
     // returned.
 );
 
+static inline int                       amp_code_point_width(
+    uint32_t                                code_point
+
+    // Returns the number of terminal columns the given Unicode code point
+    // takes: 2 for the wide and fullwidth East Asian characters and emoji, 0
+    // for the combining marks, format and control characters, and 1 for the
+    // rest. The width is looked up from a compact table in constant time.
+);
+
 static inline AMP_STYLE                 amp_get_style(
     const struct amp_type *                 ansmap,
     long                                    style_x,
@@ -326,6 +571,59 @@ static inline bool                      amp_set_fg_color(
     // Returns true on success and false if the position is not on the ansmap.
 );
 
+static inline void                      amp_fill_rect(
+    struct amp_type *                       ansmap,
+    long                                    rect_x,
+    long                                    rect_y,
+    uint32_t                                rect_width,
+    uint32_t                                rect_height,
+    AMP_STYLE                               glyph_style,
+    const char *                            glyph_str
+
+    // Fills a rectangle on the ansmap with the given glyph. The result is the
+    // same as printing the glyph with the amp_print_glyph function on every
+    // cell of the rectangle.
+);
+
+static inline void                      amp_style_rect(
+    struct amp_type *                       ansmap,
+    long                                    rect_x,
+    long                                    rect_y,
+    uint32_t                                rect_width,
+    uint32_t                                rect_height,
+    AMP_STYLE                               style,
+    AMP_STYLE                               style_mask
+
+    // Sets the style of the glyphs in a rectangle on the ansmap. Only the parts
+    // of the style selected by the mask are changed: any of the foreground
+    // color bits selects the foreground color, any of the background color bits
+    // selects the background color and the rest of the bits select themselves.
+    // With all bits of the mask set, the result is the same as calling the
+    // amp_put_style function on every cell of the rectangle.
+);
+
+static inline void                      amp_set_bg_rect(
+    struct amp_type *                       ansmap,
+    long                                    rect_x,
+    long                                    rect_y,
+    uint32_t                                rect_width,
+    uint32_t                                rect_height,
+    struct amp_rgb_type                     background_color
+
+    // Sets the background color of the glyphs in a rectangle on the ansmap.
+);
+
+static inline void                      amp_set_fg_rect(
+    struct amp_type *                       ansmap,
+    long                                    rect_x,
+    long                                    rect_y,
+    uint32_t                                rect_width,
+    uint32_t                                rect_height,
+    struct amp_rgb_type                     foreground_color
+
+    // Sets the foreground color of the glyphs in a rectangle on the ansmap.
+);
+
 static inline struct amp_rgb_type       amp_map_rgb(
     uint8_t                                 red,
     uint8_t                                 green,
@@ -465,6 +763,293 @@ static inline ssize_t                   amp_snprint_linef(
     // the underlying call to vsnprintf.
 ) __attribute__((format (printf, 8, 9)));
 
+static inline ssize_t                   amp_printf_line(
+    struct amp_type *                       ansmap,
+    long                                    text_x,
+    long                                    text_y,
+    AMP_STYLE                               text_style,
+    AMP_ALIGN                               text_alignment,
+    const char *                            text_format,
+                                            ...
+
+    // Prints the provided UTF-8 encoded formatted text on the ansmap the same
+    // way as the amp_print_line function does, without requiring a buffer from
+    // the caller. The text is formatted only once, into a buffer of
+    // AMP_PRINTF_BUF_SIZE bytes on the stack. Like with snprintf, the part of
+    // the text that does not fit into the buffer is cut off. Longer texts can
+    // be printed by defining a bigger AMP_PRINTF_BUF_SIZE.
+    //
+    // Returns the number of bytes in the formatted text (excluding the null
+    // byte), even if it was cut off. Thus, the return value is at least
+    // AMP_PRINTF_BUF_SIZE if the text was not printed in full. The return value
+    // of -1 indicates that an output error was encountered in the underlying
+    // call to vsnprintf.
+) __attribute__((format (printf, 6, 7)));
+
+static inline ssize_t                   amp_printf_text(
+    struct amp_type *                       ansmap,
+    long                                    text_x,
+    long                                    text_y,
+    AMP_STYLE                               text_style,
+    uint32_t                                text_max_width,
+    AMP_ALIGN                               text_alignment,
+    const char *                            text_format,
+                                            ...
+
+    // Prints the provided UTF-8 encoded formatted text on the ansmap the same
+    // way as the amp_print_text function does, without requiring a buffer from
+    // the caller. The text is formatted as described for amp_printf_line.
+    //
+    // Returns the number of bytes in the formatted text (excluding the null
+    // byte). The return value of -1 indicates an error, as described for
+    // amp_printf_line.
+) __attribute__((format (printf, 7, 8)));
+
+static inline ssize_t                   amp_printf_rich_text(
+    struct amp_type *                       ansmap,
+    long                                    text_x,
+    long                                    text_y,
+    AMP_STYLE                               text_style,
+    uint32_t                                text_max_width,
+    AMP_ALIGN                               text_alignment,
+    const char *                            text_format,
+                                            ...
+
+    // Prints the provided UTF-8 encoded formatted rich text on the ansmap the
+    // same way as the amp_print_rich_text function does, without requiring a
+    // buffer from the caller. The text is formatted as described for
+    // amp_printf_line.
+    //
+    // Returns the number of bytes in the formatted text (excluding the null
+    // byte). The return value of -1 indicates an error, as described for
+    // amp_printf_line.
+) __attribute__((format (printf, 7, 8)));
+
+static inline size_t                    amp_measure_text(
+    const char *                            text_str,
+    uint32_t                                text_max_width,
+    uint32_t *                              text_width,
+    size_t *                                line_offsets,
+    size_t                                  line_offset_count
+
+    // Measures the provided UTF-8 encoded text the way the amp_print_text
+    // function would print it, without printing it. If the text width pointer
+    // is not a null pointer, then the width of the widest line is stored in it.
+    // If the line offsets pointer is not a null pointer, then the byte offset
+    // of each line from the beginning of the text is stored in the array of
+    // line offsets, up to the given number of elements.
+    //
+    // Returns the number of lines the text would take.
+);
+
+static inline size_t                    amp_measure_rich_text(
+    const char *                            text_str,
+    uint32_t                                text_max_width,
+    uint32_t *                              text_width,
+    size_t *                                line_offsets,
+    size_t                                  line_offset_count
+
+    // Measures the provided UTF-8 encoded rich text the way the
+    // amp_print_rich_text function would print it, without printing it. The
+    // style markers do not count towards the width of the text. The results
+    // are stored the same way as with the amp_measure_text function.
+    //
+    // Returns the number of lines the text would take.
+);
+
+static inline size_t                    amp_rich_text_compile(
+    struct amp_rich_text_type *             rich_text,
+    uint32_t                                text_max_width,
+    AMP_ALIGN                               text_alignment,
+    const char *                            text_str,
+    void *                                  rich_text_data,
+    size_t                                  rich_text_data_size
+
+    // Compiles the provided UTF-8 encoded rich text into a list of runs of
+    // glyphs stored in the provided data buffer. The style markers are parsed
+    // and the lines are wrapped and aligned only once, so that printing the
+    // compiled text does none of that work. The compiled text does not refer to
+    // the text string. If the data buffer is too small, then the compiled text
+    // is left empty.
+    //
+    // Returns the size of the data buffer needed to compile the text.
+);
+
+static inline size_t                    amp_print_compiled(
+    struct amp_type *                       ansmap,
+    long                                    text_x,
+    long                                    text_y,
+    AMP_STYLE                               text_style,
+    const struct amp_rich_text_type *       rich_text
+
+    // Prints the compiled rich text on the ansmap. The result is the same as
+    // printing the original text with the amp_print_rich_text function.
+    //
+    // Returns the number of lines printed.
+);
+
+static inline size_t                    amp_calc_layout_cache_size(
+    uint32_t                                entry_count,
+    uint32_t                                max_lines
+
+    // Returns the size of the data buffer needed for a layout cache that can
+    // remember the given number of texts of up to the given number of lines.
+);
+
+static inline size_t                    amp_init_layout_cache(
+    struct amp_layout_cache_type *          layout_cache,
+    uint32_t                                entry_count,
+    uint32_t                                max_lines,
+    void *                                  cache_data,
+    size_t                                  cache_data_size
+
+    // Initializes a layout cache in the provided data buffer. The cache keeps
+    // the positions where the texts printed with the amp_print_text and
+    // amp_print_rich_text functions were broken into lines, so that printing
+    // the same text with the same maximum width and alignment again skips the
+    // measuring and wrapping of the text. The texts are told apart by two
+    // independent 64-bit hashes of their contents and by their size, so a text
+    // is mistaken for another only if both of the hashes collide. The entries
+    // are looked up in constant time from small buckets selected by the hash.
+    // When a bucket is full, its least recently used entries are replaced
+    // first. Texts that consist of more lines than the maximum are not cached
+    // and do not replace any entries. If the data buffer is not big enough,
+    // then fewer entries are made available.
+    //
+    // Returns the size of the data buffer needed for the layout cache.
+);
+
+static inline void                      amp_set_layout_cache(
+    struct amp_type *                       ansmap,
+    struct amp_layout_cache_type *          layout_cache
+
+    // Makes the text printing functions of the ansmap and its views use the
+    // given layout cache. If the layout cache is a null pointer, then the
+    // ansmap stops using the layout cache. A layout cache must not be used by
+    // more than one thread at a time.
+);
+
+static inline bool                      amp_init_text_stream(
+    struct amp_text_stream_type *           text_stream,
+    struct amp_type *                       ansmap,
+    AMP_STYLE                               text_style,
+    uint32_t                                text_max_width,
+    bool                                    rich,
+    char *                                  stream_data,
+    size_t                                  stream_data_size
+
+    // Initializes a text stream that prints the text given to it piece by piece
+    // on the ansmap, from its top row downwards. The ansmap is typically a view
+    // that serves as a scrolling pane. Once the bottom row has been printed,
+    // the ansmap is scrolled up to make room for the new lines, once for all
+    // of the lines that a chunk of text completes. The lines are wrapped and
+    // the style markers of rich text applied the same way as by the
+    // amp_print_text and amp_print_rich_text functions. The unfinished line is
+    // kept in the provided data buffer, which bounds the memory use. A line
+    // that does not fit into the buffer is broken where the buffer ends.
+    //
+    // Returns false if the data buffer is too small to hold any text besides
+    // its null byte, in which case the text stream must not be used.
+);
+
+static inline size_t                    amp_stream_text(
+    struct amp_text_stream_type *           text_stream,
+    const char *                            chunk,
+    size_t                                  chunk_size
+
+    // Appends the given chunk of UTF-8 encoded text to the text stream. The
+    // code points, line endings and style markers may be split between the
+    // chunks. The lines are printed as soon as their wrapping is known.
+    //
+    // Returns the number of lines printed.
+);
+
+static inline ssize_t                   amp_stream_fd(
+    struct amp_text_stream_type *           text_stream,
+    int                                     fd
+
+    // Reads the next chunk of text from the given file descriptor straight
+    // into the data buffer of the text stream, and prints it like the
+    // amp_stream_text function does.
+    //
+    // Returns the number of bytes read, 0 at the end of the file, or -1 if an
+    // error occurred in the underlying call to read or if the text stream has
+    // no data buffer to read into.
+);
+
+static inline size_t                    amp_flush_text_stream(
+    struct amp_text_stream_type *           text_stream
+
+    // Prints the unfinished line of the text stream, as at the end of a text.
+    //
+    // Returns the number of lines printed.
+);
+
+static inline size_t                    amp_calc_console_size(
+    size_t                                  text_size,
+    uint32_t                                max_lines,
+    uint32_t                                max_rows
+
+    // Returns the size of the data buffer needed for a console that keeps the
+    // given number of bytes of text, lines and wrapped rows.
+);
+
+static inline size_t                    amp_init_console(
+    struct amp_console_type *               console,
+    AMP_STYLE                               text_style,
+    bool                                    rich,
+    uint32_t                                max_lines,
+    uint32_t                                max_rows,
+    void *                                  console_data,
+    size_t                                  console_data_size
+
+    // Initializes a scrollback console in the provided data buffer. The
+    // console keeps up to the given number of the latest lines and an index
+    // of the rows they are wrapped into, together with the style in effect at
+    // the start of every row. The rest of the data buffer holds the texts of
+    // the lines. When any of it runs out, the oldest lines are forgotten. The
+    // maximum number of rows limits how far back the console can be scrolled.
+    //
+    // Returns the number of bytes of the data buffer left for the texts, or 0
+    // if the buffer is too small for the lines and rows.
+);
+
+static inline size_t                    amp_write_console(
+    struct amp_console_type *               console,
+    const char *                            text_str,
+    size_t                                  text_str_size
+
+    // Appends the given UTF-8 encoded text to the console as new lines. The
+    // text is split into lines at its line endings. If the console is rich,
+    // then the style markers of the text carry over to the following lines.
+    // Only the new lines are wrapped, so the cost does not grow with history.
+    //
+    // Returns the number of lines added.
+);
+
+static inline size_t                    amp_print_console(
+    struct amp_type *                       ansmap,
+    long                                    x,
+    long                                    y,
+    uint32_t                                width,
+    uint32_t                                height,
+    struct amp_console_type *               console,
+    size_t                                  scroll
+
+    // Clears the given rectangle of the ansmap and prints the rows of the
+    // console in it, scrolled up from the latest row by the given number of
+    // rows. If the console has fewer rows than fit, they start from the top.
+    // The lines are wrapped to the width of the rectangle the same way as the
+    // amp_print_text and amp_print_rich_text functions would wrap them. After
+    // a change of the width, the lines are wrapped again only as far back as
+    // they are scrolled to. The style markers of rich lines are looked up
+    // again in all of the lines kept, because the wrapping decides which of
+    // them take effect. Otherwise the time it takes depends only on the
+    // height of the rectangle.
+    //
+    // Returns the number of rows scrolled, limited to the rows available.
+);
+
 static inline ssize_t                   amp_encode(
     const struct amp_type *                 ansmap,
     AMP_SETTINGS                            flags,
@@ -546,41 +1131,387 @@ static inline void                      amp_draw_ansmap_region(
     // their glyphs containing either a space or an empty string, having no
     // style specified.
 );
-////////////////////////////////////////////////////////////////////////////////
 
+static inline size_t                    amp_sprite_compile(
+    struct amp_sprite_type *                sprite,
+    const struct amp_type *                 src_ansmap,
+    long                                    x_on_src_ansmap,
+    long                                    y_on_src_ansmap,
+    long                                    region_width,
+    long                                    region_height,
+    void *                                  run_data,
+    size_t                                  run_data_size
+
+    // Compiles a region of the source ansmap into a sprite, so that the region
+    // would not have to be analysed every time it is drawn. The sprite
+    // consists of a list of horizontal runs of cells stored in the provided
+    // data buffer. The part of the region outside of the source ansmap is left
+    // out like with the amp_draw_ansmap_region function. Each run
+    // is either fully opaque, shows only the background color or inherits the
+    // background color of the destination. The transparent cells are left out
+    // of the list, so that drawing the sprite skips them at no cost. The
+    // sprite refers to the cells of the source ansmap, which must not be
+    // modified for as long as the sprite is in use. If the run data buffer is
+    // too small, then the sprite is left empty.
+    //
+    // Returns the size of the run data buffer needed to compile the sprite.
+);
 
-struct amp_type {
-    uint8_t buffer[AMP_BUF_SIZE];
-    uint32_t width;
-    uint32_t height;
+static inline void                      amp_draw_sprite(
+    struct amp_type *                       dst_ansmap,
+    long                                    x_on_dst_ansmap,
+    long                                    y_on_dst_ansmap,
+    const struct amp_sprite_type *          sprite
 
-    struct {
-        size_t size;
-        uint8_t *data;
+    // Draws the compiled sprite onto the destination ansmap at the specified
+    // position. The result is the same as drawing the region of the source
+    // ansmap that the sprite was compiled from with the amp_draw_ansmap_region
+    // function.
+);
 
-        struct {
-            size_t size;
-            uint8_t *data;
-        } glyph;
+static inline void                      amp_draw_tilemap(
+    struct amp_type *                       dst_ansmap,
+    long                                    camera_x,
+    long                                    camera_y,
+    const struct amp_tilemap_type *         tilemap
+
+    // Draws the layers of the tilemap onto the destination ansmap so that the
+    // cell of the tilemap at the camera position ends up in the top left corner
+    // of the destination ansmap. The tiles are drawn the same way as with the
+    // amp_draw_ansmap_region function, but the layers below fully opaque tiles
+    // are not drawn at all.
+);
 
-        struct {
-            size_t size;
-            uint8_t *data;
-        } mode;
-    } canvas;
+static inline void                      amp_init_compositor(
+    struct amp_compositor_type *            compositor,
+    struct amp_type *                       canvas,
+    struct amp_layer_type *                 layers,
+    size_t                                  layer_count
 
-    AMP_PALETTE palette;
-};
+    // Initializes the compositor that builds the canvas out of the given stack
+    // of layers, the first of which is at the bottom. The layers are owned by
+    // the caller and each of them shows a source ansmap at its position, given
+    // that the layer is visible. Initially the whole canvas is damaged.
+);
 
-struct amp_mode_type {
-    struct amp_rgb_type fg;
-    struct amp_rgb_type bg;
+static inline void                      amp_damage_compositor(
+    struct amp_compositor_type *            compositor,
+    long                                    x,
+    long                                    y,
+    uint32_t                                width,
+    uint32_t                                height
 
-    struct {
-        bool fg:1;
-        bool bg:1;
-        bool hidden:1;
-        bool faint:1;
+    // Marks the specified area of the canvas as damaged, so that it would be
+    // redrawn by the next call to the amp_compose function.
+);
+
+static inline void                      amp_damage_layer(
+    struct amp_compositor_type *            compositor,
+    size_t                                  layer_index
+
+    // Marks the area of the canvas covered by the specified layer as damaged.
+    // This should be called whenever the contents of the layer have changed.
+);
+
+static inline void                      amp_move_layer(
+    struct amp_compositor_type *            compositor,
+    size_t                                  layer_index,
+    long                                    x,
+    long                                    y
+
+    // Moves the specified layer to the given position on the canvas, damaging
+    // both the area it was covering before and the area it covers after.
+);
+
+static inline void                      amp_show_layer(
+    struct amp_compositor_type *            compositor,
+    size_t                                  layer_index,
+    bool                                    visible
+
+    // Shows or hides the specified layer, damaging the area that it covers.
+);
+
+static inline void                      amp_compose(
+    struct amp_compositor_type *            compositor
+
+    // Redraws the damaged areas of the canvas and clears the damage. The cells
+    // are resolved from the top layer downwards, so that the layers below the
+    // first opaque cell are not drawn at all. The result is the same as
+    // clearing the canvas and drawing all of the visible layers onto it with
+    // the amp_draw_ansmap function, starting from the bottom layer.
+);
+
+static inline size_t                    amp_calc_command_buffer_size(
+    size_t                                  command_count
+
+    // Returns the size of the data buffer needed for the initialization of a
+    // command buffer that can hold the given number of commands.
+);
+
+static inline size_t                    amp_init_command_buffer(
+    struct amp_command_buffer_type *        command_buffer,
+    void *                                  command_data,
+    size_t                                  command_data_size
+
+    // Initializes an empty command buffer in the provided data buffer. The
+    // drawing commands recorded into a command buffer are applied later by the
+    // amp_apply_commands function. A command buffer is not synchronized, so it
+    // should be used by a single thread at a time, but every thread can record
+    // into a command buffer of its own without any locking.
+    //
+    // Returns the number of commands that the command buffer can hold.
+);
+
+static inline bool                      amp_record_glyph(
+    struct amp_command_buffer_type *        command_buffer,
+    long                                    glyph_x,
+    long                                    glyph_y,
+    AMP_STYLE                               glyph_style,
+    const char *                            glyph_str
+
+    // Records a command that calls the amp_print_glyph function.
+    //
+    // Returns false if the command buffer is full.
+);
+
+static inline bool                      amp_record_style(
+    struct amp_command_buffer_type *        command_buffer,
+    long                                    style_x,
+    long                                    style_y,
+    AMP_STYLE                               style
+
+    // Records a command that calls the amp_put_style function.
+    //
+    // Returns false if the command buffer is full.
+);
+
+static inline bool                      amp_record_fill(
+    struct amp_command_buffer_type *        command_buffer,
+    long                                    rect_x,
+    long                                    rect_y,
+    uint32_t                                rect_width,
+    uint32_t                                rect_height,
+    AMP_STYLE                               glyph_style,
+    const char *                            glyph_str
+
+    // Records a command that calls the amp_fill_rect function. The command
+    // takes one slot of the command buffer per row of the rectangle.
+    //
+    // Returns false if the command buffer is too full for the command.
+);
+
+static inline bool                      amp_record_ansmap_region(
+    struct amp_command_buffer_type *        command_buffer,
+    long                                    x_on_dst_ansmap,
+    long                                    y_on_dst_ansmap,
+    const struct amp_type *                 src_ansmap,
+    long                                    x_on_src_ansmap,
+    long                                    y_on_src_ansmap,
+    uint32_t                                region_width,
+    uint32_t                                region_height
+
+    // Records a command that calls the amp_draw_ansmap_region function. The
+    // source ansmap must stay intact until the command has been applied. The
+    // command takes one slot of the command buffer per row of the region.
+    //
+    // Returns false if the command buffer is too full for the command.
+);
+
+static inline void                      amp_apply_commands(
+    struct amp_type *                       ansmap,
+    struct amp_command_buffer_type *        command_buffers,
+    size_t                                  command_buffer_count
+
+    // Applies the commands of all the given command buffers to the ansmap and
+    // empties the command buffers. The commands are sorted by rows and then
+    // applied one row at a time. The result is the same as applying all the
+    // commands of each command buffer in the order of their recording, one
+    // command buffer after another. No command buffer should be recorded into
+    // while the commands are being applied.
+);
+////////////////////////////////////////////////////////////////////////////////
+
+
+struct amp_type {
+    uint8_t buffer[AMP_BUF_SIZE];
+    uint32_t width;
+    uint32_t height;
+
+    struct {
+        size_t size;
+        uint8_t *data;
+
+        struct {
+            size_t size;
+            uint8_t *data;
+        } glyph;
+
+        struct {
+            size_t size;
+            uint8_t *data;
+        } mode;
+
+        uint32_t row_offset; // canvas row index of the first row
+    } canvas;
+
+    struct {
+        struct amp_type *parent;
+        struct amp_type *child;
+        struct amp_type *sibling;
+        uint32_t *rows;     // 0 for a shared row, else private row index + 1
+        uint32_t capacity;  // number of private rows the canvas can hold
+        uint32_t used;
+        size_t refs;        // number of rows shared with the derived ansmaps
+    } cow;
+
+    struct {
+        struct amp_type *parent;
+        uint32_t x;
+        uint32_t y;
+    } view;
+
+    struct {
+        uint32_t *rows;     // generation of each row
+        uint32_t capacity;  // number of elements in the array of generations
+        uint32_t epoch;     // generation of the ansmap
+    } lazy;
+
+    struct {
+        uint8_t *rows;      // nonzero for each row written to
+    } dirty;
+
+    struct {
+        struct amp_band_type *locks;
+        uint32_t count;     // number of elements in the array of locks
+        uint32_t rows;      // number of rows in a band
+    } band;
+
+    struct {
+        struct amp_layout_cache_type *cache;
+    } layout;
+
+    AMP_PALETTE palette;
+};
+
+struct amp_sprite_type {
+    const struct amp_type *ansmap;
+    const struct amp_sprite_run_type *runs;
+    size_t run_count;
+    long x;                 // position of the region on the source ansmap
+    long y;
+};
+
+struct amp_tilemap_type {
+    const struct amp_type *tileset; // tiles in a grid, from left to right
+    uint32_t tile_width;
+    uint32_t tile_height;
+    uint32_t tile_spacing;          // gap between the tiles in the tileset
+    const uint16_t *tiles;          // layers of rows of tile numbers from 1
+    uint32_t width;                 // number of tiles on a row of a layer
+    uint32_t height;                // number of rows of tiles in a layer
+    uint32_t depth;                 // number of layers, the first at the bottom
+};
+
+struct amp_layer_type {
+    const struct amp_type *ansmap;
+    long x;
+    long y;
+    bool visible;
+};
+
+struct amp_rect_type {
+    long x;
+    long y;
+    long w;
+    long h;
+};
+
+struct amp_compositor_type {
+    struct amp_type *canvas;
+    struct amp_layer_type *layers;  // from the bottom layer to the top layer
+    size_t layer_count;
+    struct amp_rect_type damage[AMP_DAMAGE_MAX];
+    size_t damage_count;
+};
+
+#ifndef AMP_NO_THREADS
+struct amp_double_buffer_type {
+    struct amp_type canvas[2];
+    uint8_t *dirty_rows;        // rows drawn on the back buffer
+    atomic_uint front;          // index of the front buffer
+    atomic_size_t readers[2];   // number of readers of each buffer
+    bool synced;                // the back buffer holds the front frame
+};
+
+struct amp_band_type {
+    atomic_uint sequence;   // odd while the band is being drawn on
+};
+#endif
+
+struct amp_layout_cache_type {
+    struct amp_layout_entry_type *entries;
+    struct amp_layout_line_type *lines;     // max_lines for each entry + spare
+    uint32_t entry_count;
+    uint32_t max_lines;
+    uint32_t hand;      // the next entry of a bucket to consider replacing
+    uint32_t spare;     // the lines that the next new layout is written to
+    size_t hits;        // number of texts printed with a cached layout
+    size_t misses;      // number of texts that had to be laid out
+};
+
+struct amp_text_stream_type {
+    struct amp_type *ansmap;
+    char *data;             // the unfinished line, ended with a null byte
+    size_t data_size;
+    size_t size;
+    uint32_t max_width;
+    AMP_STYLE style;
+    long y;                 // the row of the next line
+    bool rich;
+};
+
+struct amp_console_type {
+    struct amp_console_line_type *lines;    // ring of the latest lines
+    struct amp_console_row_type *rows;      // ring of their wrapped rows
+    char *text;             // texts of the lines, each with a null byte
+    size_t text_size;
+    size_t text_end;        // where the text of the next line is written
+    size_t first_line;      // number of the oldest line kept
+    size_t end_line;        // number of the next line
+    size_t indexed_line;    // number of the oldest line with wrapped rows
+    size_t first_row;       // number of the oldest wrapped row kept
+    size_t end_row;         // number of the next wrapped row
+    uint32_t max_lines;
+    uint32_t max_rows;
+    uint32_t width;         // width that the rows are wrapped to
+    AMP_STYLE style;        // style in effect after the last line
+    bool rich;
+};
+
+struct amp_rich_text_type {
+    const struct amp_rich_text_run_type *runs;
+    size_t run_count;
+    const char *glyphs;     // AMP_CELL_GLYPH_SIZE bytes for each glyph
+    size_t glyph_count;
+    size_t line_count;
+};
+
+struct amp_command_buffer_type {
+    struct amp_command_type *commands;
+    size_t capacity;
+    size_t count;
+    size_t next;    // index of the next command to be applied
+};
+
+struct amp_mode_type {
+    struct amp_rgb_type fg;
+    struct amp_rgb_type bg;
+
+    struct {
+        bool fg:1;
+        bool bg:1;
+        bool hidden:1;
+        bool faint:1;
         bool italic:1;
         bool underline:1;
         bool blinking:1;
@@ -620,8 +1551,115 @@ struct amp_style_flag_type {
     AMP_STYLE   value;
 };
 
+static constexpr size_t amp_color_combo_size = 5;
+
 struct amp_color_combo_type {
-    AMP_COLOR colors[5];
+    AMP_COLOR colors[amp_color_combo_size];
+};
+
+static constexpr size_t amp_style_cache_size = 64;
+
+struct amp_style_cache_type {
+    struct {
+        uint64_t key;   // meaningful mode bytes of a cell, zero if unused
+        AMP_STYLE style;
+    } entry[amp_style_cache_size];
+};
+
+struct amp_row_type {
+    uint8_t *glyph;     // null pointer if the row consists of empty cells
+    uint8_t *mode;
+    uint32_t size;      // number of cells accessible on the row
+};
+
+typedef enum : uint8_t {
+    AMP_SPAN_TRANSPARENT = 0,   // Cells are skipped.
+    AMP_SPAN_OPAQUE,            // Cells are copied.
+    AMP_SPAN_BACKDROP,          // Only the modes are copied (empty glyphs).
+    AMP_SPAN_INHERIT            // Cells keep the background color below them.
+} AMP_SPAN;
+
+typedef enum : uint8_t {
+    AMP_COMMAND_GLYPH = 0,
+    AMP_COMMAND_STYLE,
+    AMP_COMMAND_FILL,
+    AMP_COMMAND_ANSMAP
+} AMP_COMMAND;
+
+struct amp_command_type {
+    const struct amp_type *src;
+    long x;
+    long y;
+    long src_x;
+    long src_y;
+    AMP_STYLE style;
+    size_t order;   // position among the commands in the order of recording
+    uint32_t width;
+    char glyph[AMP_CELL_GLYPH_SIZE];
+    AMP_COMMAND type;
+};
+
+struct amp_sprite_run_type {
+    uint32_t x;
+    uint32_t y;
+    uint32_t size;
+    AMP_SPAN span;
+};
+
+struct amp_rich_text_run_type {
+    size_t line;
+    long x;             // position of the first glyph relative to the text
+    size_t glyph;       // index of the first glyph of the run
+    uint32_t size;      // number of glyphs, zero at the end of a line
+    AMP_STYLE keep;     // bits of the style at the start of the line to keep
+    AMP_STYLE set;      // bits of the style to set after that
+};
+
+struct amp_layout_line_type {
+    uint32_t offset;    // position of the line in the text
+    uint32_t size;
+};
+
+static constexpr uint32_t AMP_LAYOUT_BUCKET_SIZE = 4; // entries per bucket
+
+struct amp_layout_entry_type {
+    uint64_t hash;      // FNV-1a hash of the text, selects the bucket
+    uint64_t check;     // second hash of the text to rule out collisions
+    size_t text_size;
+    uint32_t max_width;
+    uint32_t line_count;
+    uint32_t lines;     // which max_lines of the layout lines the entry uses
+    AMP_ALIGN alignment;
+    bool rich;
+    bool used;
+    bool referenced;    // used since the clock hand last passed the entry
+};
+
+struct amp_console_line_type {
+    size_t offset;      // position of the text of the line in the console
+    size_t size;
+    size_t row;         // number of the first wrapped row of the line
+    AMP_STYLE style;    // style in effect at the start of the line
+};
+
+struct amp_console_row_type {
+    size_t offset;      // position of the text of the row in the console
+    size_t size;
+    AMP_STYLE style;    // style in effect at the start of the row
+};
+
+struct amp_line_breaker_type {
+    const char *text_end;
+    const char *next_line;      // start of the next line of the text
+    const char *line;           // rest of the current line to be wrapped
+    size_t line_size;
+    size_t line_width;          // width of the whole current line
+    const char *scan;           // position of the forward scan on the line
+    size_t scan_width;          // width of the line before the scan position
+    uint32_t max_width;
+    bool rich;
+    bool scannable;             // widths can be derived from the forward scan
+    bool last_line;
 };
 
 // Private API: ////////////////////////////////////////////////////////////////
@@ -643,24 +1681,102 @@ static inline struct amp_mode_type      amp_get_mode(
     long                                    x,
     long                                    y
 );
-static inline uint8_t *                 amp_get_mode_data(
+static inline const uint8_t *           amp_get_mode_data(
     const struct amp_type *                 amp,
     long                                    x,
     long                                    y
 );
-static inline ssize_t                   amp_get_cell_index(
-    const struct amp_type *                 ansmap,
+static inline uint8_t *                 amp_get_mutable_mode_data(
+    struct amp_type *                       amp,
     long                                    x,
     long                                    y
 );
+static inline struct amp_row_type       amp_read_row(
+    const struct amp_type *                 ansmap,
+    long                                    y
+);
+static inline struct amp_row_type       amp_write_row(
+    struct amp_type *                       ansmap,
+    long                                    y
+);
+static inline struct amp_row_type       amp_canvas_row(
+    const struct amp_type *                 ansmap,
+    size_t                                  row_index
+);
+static inline size_t                    amp_canvas_row_index(
+    const struct amp_type *                 ansmap,
+    long                                    y
+);
+static inline size_t                    amp_canvas_row_size(
+    size_t                                  cell_count,
+    size_t                                  width,
+    size_t                                  row_index
+);
+static inline void                      amp_rotate_bytes(
+    uint8_t *                               data,
+    size_t                                  data_size,
+    size_t                                  shift
+);
+static inline void                      amp_reverse_bytes(
+    uint8_t *                               data,
+    size_t                                  data_size
+);
+static inline void                      amp_copy_row(
+    struct amp_type *                       dst_ansmap,
+    long                                    dst_y,
+    const struct amp_type *                 src_ansmap,
+    long                                    src_y
+);
+static inline void                      amp_mark_dirty(
+    struct amp_type *                       ansmap,
+    long                                    y,
+    uint32_t                                row_count
+);
+#ifndef AMP_NO_THREADS
+static inline uint32_t                  amp_get_bands(
+    const struct amp_type *                 ansmap,
+    long                                    y,
+    uint32_t                                row_count,
+    uint32_t *                              first_band
+);
+#endif
+static inline struct amp_row_type       amp_crop_row(
+    struct amp_row_type                     row,
+    uint32_t                                x,
+    uint32_t                                width
+);
+static inline bool                      amp_cow_detach(
+    struct amp_type *                       ansmap,
+    long                                    y
+);
+static inline bool                      amp_cow_unshare(
+    struct amp_type *                       ansmap,
+    long                                    y
+);
 static inline int                       amp_utf8_code_point_size(
     const char *                            utf8_str,
     size_t                                  utf8_str_size
 );
-static inline size_t                    amp_utf8_code_point_count(
+static inline size_t                    amp_utf8_ascii_span(
+    const char *                            utf8_str,
+    size_t                                  utf8_str_size
+);
+static inline size_t                    amp_utf8_width(
     const char *                            utf8_str,
     size_t                                  utf8_str_size
 );
+static inline int                       amp_utf8_glyph_cells(
+    const char *                            utf8_str,
+    size_t                                  utf8_str_size
+);
+static inline bool                      amp_is_glyph_tail(
+    const char *                            glyph
+);
+static inline bool                      amp_has_glyph_tail(
+    const struct amp_type *                 ansmap,
+    long                                    x,
+    long                                    y
+);
 static inline size_t                    amp_str_seg_style_sign_count(
     const char *                            str,
     size_t                                  str_size
@@ -754,6 +1870,142 @@ static inline size_t                    amp_print_rich_text_clip(
     const char *                            text_str,
     size_t                                  text_str_size
 );
+static inline void                      amp_compile_rich_text(
+    uint32_t                                text_max_width,
+    AMP_ALIGN                               text_alignment,
+    const char *                            text_str,
+    struct amp_rich_text_run_type *         runs,
+    char *                                  glyphs,
+    struct amp_rich_text_type *             rich_text
+);
+static inline void                      amp_apply_inline_style(
+    AMP_STYLE *                             keep,
+    AMP_STYLE *                             set,
+    AMP_STYLE                               inline_style
+);
+static inline size_t                    amp_measure_text_lines(
+    const char *                            text_str,
+    uint32_t                                text_max_width,
+    uint32_t *                              text_width,
+    size_t *                                line_offsets,
+    size_t                                  line_offset_count,
+    bool                                    rich
+);
+static inline size_t                    amp_process_text_stream(
+    struct amp_text_stream_type *           text_stream,
+    bool                                    flush
+);
+static inline size_t                    amp_scan_text_stream(
+    struct amp_text_stream_type *           text_stream,
+    bool                                    flush,
+    bool                                    print
+);
+static inline size_t                    amp_stream_lines(
+    struct amp_text_stream_type *           text_stream,
+    size_t *                                begin,
+    size_t                                  end,
+    bool                                    final,
+    bool                                    print
+);
+static inline void                      amp_stream_line(
+    struct amp_text_stream_type *           text_stream,
+    const char *                            line,
+    size_t                                  line_size
+);
+static inline size_t                    amp_stream_tail_size(
+    const struct amp_text_stream_type *     text_stream,
+    size_t                                  begin
+);
+static inline void                      amp_console_add_line(
+    struct amp_console_type *               console,
+    const char *                            line_str,
+    size_t                                  line_str_size
+);
+static inline void                      amp_console_drop_line(
+    struct amp_console_type *               console
+);
+static inline size_t                    amp_console_wrap_line(
+    struct amp_console_type *               console,
+    size_t                                  line_number,
+    size_t                                  row_number,
+    bool                                    store,
+    AMP_STYLE *                             end_style
+);
+static inline void                      amp_console_style_lines(
+    struct amp_console_type *               console
+);
+static inline void                      amp_console_index_rows(
+    struct amp_console_type *               console,
+    size_t                                  row_count
+);
+static inline struct amp_console_line_type *amp_console_line(
+    const struct amp_console_type *         console,
+    size_t                                  line_number
+);
+static inline struct amp_console_row_type *amp_console_row(
+    const struct amp_console_type *         console,
+    size_t                                  row_number
+);
+static inline AMP_STYLE                 amp_rich_str_seg_style(
+    const char *                            rich_str,
+    size_t                                  rich_str_size,
+    AMP_STYLE                               style
+);
+static inline ssize_t                   amp_vprintf(
+    struct amp_type *                       ansmap,
+    long                                    text_x,
+    long                                    text_y,
+    AMP_STYLE                               text_style,
+    uint32_t                                text_max_width,
+    AMP_ALIGN                               text_alignment,
+    bool                                    line,
+    bool                                    rich,
+    const char *                            text_format,
+    va_list                                 args
+);
+static inline size_t                    amp_print_text_lines(
+    struct amp_type *                       ansmap,
+    long                                    text_x,
+    long                                    text_y,
+    AMP_STYLE *                             text_style,
+    uint32_t                                text_max_width,
+    AMP_ALIGN                               text_alignment,
+    const char *                            text_str,
+    size_t                                  text_str_size,
+    bool                                    rich
+);
+static inline struct amp_layout_entry_type *amp_find_layout(
+    struct amp_layout_cache_type *          layout_cache,
+    const struct amp_layout_entry_type *    key
+);
+static inline struct amp_layout_entry_type *amp_evict_layout(
+    struct amp_layout_cache_type *          layout_cache,
+    uint64_t                                hash
+);
+static inline struct amp_layout_entry_type *amp_layout_bucket(
+    const struct amp_layout_cache_type *    layout_cache,
+    uint64_t                                hash,
+    uint32_t *                              bucket_size
+);
+static inline uint64_t                  amp_hash_text(
+    const char *                            text_str,
+    size_t                                  text_str_size,
+    uint64_t *                              check
+);
+static inline struct amp_line_breaker_type amp_init_line_breaker(
+    const char *                            text_str,
+    size_t                                  text_str_size,
+    uint32_t                                text_max_width,
+    bool                                    rich
+);
+static inline bool                      amp_break_line(
+    struct amp_line_breaker_type *          line_breaker,
+    const char **                           line_str,
+    size_t *                                line_size
+);
+static inline size_t                    amp_line_breaker_width(
+    struct amp_line_breaker_type *          line_breaker
+);
 static inline const char *              amp_str_seg_skip_spaces(
     const char *                            str,
     size_t                                  str_size
@@ -811,6 +2063,7 @@ struct amp_color_combo_type             amp_lookup_color_combo(
 );
 static inline ssize_t                   amp_encode_layer(
     const struct amp_type *                 ansmap,
+    struct amp_style_cache_type *           style_cache,
     AMP_SETTINGS                            settings,
     AMP_STYLE                               style,
     char *                                  buffer,
@@ -818,6 +2071,7 @@ static inline ssize_t                   amp_encode_layer(
 );
 static inline ssize_t                   amp_encode_layer_row(
     const struct amp_type *                 ansmap,
+    struct amp_style_cache_type *           style_cache,
     long                                    row_y,
     AMP_STYLE                               style,
     char *                                  buffer,
@@ -825,6 +2079,7 @@ static inline ssize_t                   amp_encode_layer_row(
 );
 static inline ssize_t                   amp_encode_layer_cell(
     const struct amp_type *                 ansmap,
+    struct amp_style_cache_type *           style_cache,
     long                                    x,
     long                                    y,
     AMP_STYLE                               style,
@@ -833,13 +2088,23 @@ static inline ssize_t                   amp_encode_layer_cell(
 );
 static inline AMP_STYLE                 amp_styles_to_layer(
     const struct amp_type *                 ansmap,
+    struct amp_style_cache_type *           style_cache,
     AMP_STYLE                               whitelist
 );
-static inline uint32_t                  amp_doc_seg_parse_width(
-    const char *                            str,
-    size_t                                  str_sz
+static inline AMP_STYLE                 amp_mode_style(
+    const uint8_t *                         mode_data
 );
-static inline size_t                    amp_decode_glyphs(
+static inline AMP_STYLE                 amp_get_cached_style(
+    const struct amp_type *                 ansmap,
+    struct amp_style_cache_type *           style_cache,
+    long                                    x,
+    long                                    y
+);
+static inline uint32_t                  amp_doc_seg_parse_width(
+    const char *                            str,
+    size_t                                  str_sz
+);
+static inline size_t                    amp_decode_glyphs(
     struct amp_type *                       amp,
     const char *                            str,
     size_t                                  str_sz
@@ -849,6 +2114,122 @@ static inline size_t                    amp_decode_styles(
     const char *                            str,
     size_t                                  str_sz
 );
+static inline AMP_SPAN                  amp_get_span(
+    struct amp_row_type                     row,
+    size_t                                  x
+);
+static inline size_t                    amp_get_span_size(
+    struct amp_row_type                     row,
+    size_t                                  x,
+    size_t                                  max_size
+);
+static inline void                      amp_blit_row(
+    struct amp_type *                       dst_ansmap,
+    long                                    dst_y,
+    struct amp_row_type *                   dst_row,
+    size_t                                  dst_x,
+    struct amp_row_type                     src_row,
+    size_t                                  src_x,
+    size_t                                  size
+);
+static inline struct amp_row_type       amp_get_tile_row(
+    const struct amp_tilemap_type *         tilemap,
+    uint32_t                                layer,
+    uint32_t                                x,
+    uint32_t                                y,
+    uint32_t                                row,
+    uint32_t *                              x_on_tileset
+);
+static inline struct amp_rgb_type       amp_mix_colors(
+    uint32_t                                colors
+);
+static inline void                      amp_style_mode_mask(
+    AMP_STYLE                               style,
+    AMP_STYLE                               style_mask,
+    uint8_t *                               mode_set,
+    uint8_t *                               mode_keep
+);
+static inline void                      amp_fill_mode_rect(
+    struct amp_type *                       ansmap,
+    long                                    x,
+    long                                    y,
+    uint32_t                                width,
+    uint32_t                                height,
+    const char *                            glyph,
+    const uint8_t *                         mode_set,
+    const uint8_t *                         mode_keep
+);
+static inline bool                      amp_prepare_glyph(
+    const char *                            glyph_str,
+    char *                                  glyph
+);
+static inline void                      amp_glyph_mode_mask(
+    AMP_STYLE                               style,
+    uint8_t *                               mode_set,
+    uint8_t *                               mode_keep
+);
+static inline size_t                    amp_print_masked_glyph(
+    struct amp_type *                       ansmap,
+    long                                    x,
+    long                                    y,
+    const char *                            glyph_str,
+    const uint8_t *                         mode_set,
+    const uint8_t *                         mode_keep
+);
+static inline size_t                    amp_print_ascii_run(
+    struct amp_type *                       ansmap,
+    long                                    x,
+    long                                    y,
+    const char *                            str,
+    size_t                                  str_size,
+    char                                    stop,
+    const uint8_t *                         mode_set,
+    const uint8_t *                         mode_keep
+);
+static inline void                      amp_print_cell_run(
+    struct amp_type *                       ansmap,
+    long                                    x,
+    long                                    y,
+    const char *                            glyphs,
+    size_t                                  glyph_count,
+    const uint8_t *                         mode_set,
+    const uint8_t *                         mode_keep
+);
+static inline struct amp_command_type *amp_record_command(
+    struct amp_command_buffer_type *        command_buffer,
+    size_t                                  row_count
+);
+static inline int                       amp_compare_commands(
+    const void *                            a,
+    const void *                            b
+);
+static inline void                      amp_apply_command(
+    struct amp_type *                       ansmap,
+    const struct amp_command_type *         command
+);
+static inline void                      amp_damage_rect(
+    struct amp_compositor_type *            compositor,
+    struct amp_rect_type                    rect
+);
+static inline void                      amp_compose_rect(
+    struct amp_compositor_type *            compositor,
+    struct amp_rect_type                    rect
+);
+static inline void                      amp_blit_span(
+    struct amp_row_type                     dst_row,
+    size_t                                  dst_x,
+    struct amp_row_type                     src_row,
+    size_t                                  src_x,
+    size_t                                  size,
+    AMP_SPAN                                span
+);
+static inline bool                      amp_clip_span(
+    long *                                  dst_pos,
+    uint32_t                                dst_size,
+    long *                                  src_pos,
+    uint32_t                                src_size,
+    long *                                  length
+);
 ////////////////////////////////////////////////////////////////////////////////
 
 
@@ -2186,6 +3567,207 @@ static constexpr AMP_STYLE amp_bg_color_styles = (
     AMP_BG_AQUA         | AMP_BG_WHITE
 );
 
+static constexpr AMP_STYLE amp_all_styles = (AMP_STYLE) ~0ULL;
+
+// The color bits of a style, shifted down to start with the bit of AMP_DARK.
+static constexpr uint32_t amp_color_bits = (1U << (AMP_MAX_COLOR - 1)) - 1;
+
+static constexpr uint32_t amp_cow_row_empty = UINT32_MAX;
+
+// The second cell of a wide glyph is marked with a byte that is never valid in
+// UTF-8, so that it cannot be mistaken for a glyph of its own.
+static const char amp_glyph_tail[AMP_CELL_GLYPH_SIZE] = "\xff";
+
+// The terminal column widths of the code points below U+20000 are looked up
+// in three stages: the block of 256 code points, the chunk of 16 code points
+// and the 2-bit width of the code point within its chunk (Unicode 14.0).
+static const uint8_t amp_width_block_table[] = {
+      0,   1,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,
+     14,  15,  16,   1,  17,   1,   1,   1,  18,  19,  20,  21,  22,  23,  24,
+      1,   1,  25,   1,   1,  26,   1,  27,  28,  29,   1,   1,   1,  30,  31,
+     32,  33,  34,  35,  36,  37,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  39,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  40,
+      1,  41,   1,  42,  43,  44,  45,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  46,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,  38,  38,  47,   1,   1,  48,
+     49,   1,  50,  51,  52,   1,   1,   1,   1,   1,   1,  53,   1,   1,  54,
+     55,  56,  57,  58,  59,  60,  61,  62,  63,  64,  65,  66,  67,   1,  68,
+     69,  70,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,  71,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,  72,  73,   1,   1,   1,  74,  38,  38,  38,  38,  38,  38,  38,
+     38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,  38,
+     38,  75,  38,  38,  38,  38,  76,  77,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  78,  38,  79,  80,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,  81,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  82,   1,
+     83,  84,   1,   1,   1,   1,   1,   1,   1,  85,   1,   1,   1,   1,   1,
+     86,  73,  87,   1,   1,   1,   1,   1,  88,  89,   1,   1,   1,   1,   1,
+      1,  90,  91,  92,  93,  94,  95,  96,  97,   1,  98,  99,   1,   1,   1,
+      1,   1
+};
+
+static const uint8_t amp_width_chunk_table[] = {
+      0,   0,   1,   1,   1,   1,   1,   2,   0,   0,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   0,   0,   0,   0,   0,   0,   0,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   3,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   4,   0,
+      5,   6,   1,   1,   1,   7,   8,   1,   1,   9,   0,   1,  10,   1,   1,
+      1,   1,   1,  11,  12,   1,   2,  13,   1,   0,  14,   1,   1,   1,   1,
+      1,  15,  10,   1,   1,   9,  16,   1,  17,  18,   1,   1,  19,   1,   1,
+      1,  20,   1,   1,  21,   0,   0,   0,  22,   1,   1,  23,  24,  25,  26,
+      1,  13,   1,   1,  27,  28,   1,  26,  29,  30,   1,   1,  27,  31,  13,
+      1,  32,  30,   1,   1,  27,  33,   1,  26,  21,  13,   1,   1,  34,  28,
+     35,  26,   1,  36,   1,   1,   1,  37,   1,   1,   1,  38,   1,   1,  39,
+     40,  35,  26,   1,  13,   1,   1,  34,  41,   1,  26,   1,  42,   1,   1,
+     43,  28,   1,  26,   1,  13,   1,   1,   1,  44,  45,   1,   1,   1,   1,
+      1,  46,  47,   1,   1,   1,   1,   1,   1,  48,  49,   1,   1,   1,   1,
+     50,   1,  51,   1,   1,   1,  52,  53,  54,   0,  55,  56,   1,   1,   1,
+      1,   1,  57,  58,   1,  59,  10,  60,  61,  62,   1,   1,   1,   1,   1,
+      1,  63,  63,  63,  63,  63,  63,   0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   1,   1,   1,   1,   1,  57,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,  64,   1,  26,   1,  26,   1,  26,   1,   1,   1,  65,
+     66,  16,   1,   1,   9,   1,   1,   1,   1,   1,   1,   1,  35,   1,  67,
+      1,   1,   1,   1,   1,   1,   1,  68,  69,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,  70,   1,   1,   1,  71,  72,  73,   1,
+      1,   1,   0,  74,   1,   1,   1,  75,   1,   1,  76,  36,   1,   9,  75,
+     42,   1,  77,   1,   1,   1,  78,  42,   1,   1,  79,  80,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,  81,  82,  83,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   0,   0,   0,   0,   9,   1,  84,   1,   1,
+      1,  85,   1,   1,   1,   1,   1,   1,   0,   0,  10,   1,  86,  87,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  88,  89,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  90,   1,  91,
+      1,   1,  92,  93,   1,  94,   1,  95,  96,  90,  97,  98,  99, 100, 101,
+      1, 102,   1, 103, 104,   1,   1,   1, 105,   1, 106,   1,   1,   1,   1,
+      1, 107,   1,   1,   1, 108,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      2,  42,   1,   1,   1,   1,   1,   1,   1,   2,   1,   1,   1,   1,   1,
+      1,   0,   0,   1,   1,   1,   1,   1,   1,   1,   1,  63, 109,  63,  63,
+     63,  63,  63,  93,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,
+     63,  63, 110,   1, 111,  63,  63, 112, 113, 114,  63,  63,  63,  63, 115,
+     63,  63,  63,  63,  63,  63, 116,  63,  63, 114,  63,  63,  63,  63, 113,
+     63,  63,  63,  63,  63,  93,  63,  63, 113,  63,  63, 117,  63,  63,  63,
+     63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,
+     63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,
+     63,  63,  63,  63,  63,  63,   1,   1,   1,   1,  63,  63,  63,  63,  63,
+     63,  63,  63, 118,  63,  63,  63, 119,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   2, 120,   1, 121,   1,   1,   1,   1,   1,  42, 122,   1, 123,
+      1,   1,   1,   1,   1,   1,   1,   1,   1, 124,   1,   0, 125,   1,   1,
+    126,   1, 127,  42,  63, 118,  22,   1,   1, 128,   1,   1, 129,   1,   1,
+      1, 130, 131, 132,   1,   1,  27,   1,   1,   1, 133,  13,   1, 134,  56,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1, 135,
+      1,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  93,   0,   0,   0,
+      0,   0,   1,  29,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   0, 136,   0,  63,  63, 137, 138,   1,   1,   1,   1,   1,
+      1,   1,   1,   2, 114,  63,  63,  63,  63,  63, 139,   1,   1,   1,   1,
+      1,   1,   1, 119,  19,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,  62,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,  10,   1,   1,   1,   1,   1,   1,   1,   1, 140,
+      1,   1,   1,   1,   1,   1,   1,   1, 141,   1,   1, 142,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,  35,   1,   1,   1, 143,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,  43,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+     15,  10,   1,   1, 144,   1,   1,   1,   1,   1,   1,   1,  13,   1,   1,
+    145, 146,   1,   1, 147,  42,   1,   1, 148, 149,   1,   1,   1,  22,   1,
+    150, 151,   1,   1,   1, 152,  42,   1,   1, 153, 154,   1,   1,   1,   1,
+      1,   2, 155,   1,   1,   1,   1,   1,   1,   1,   1,   1,   2, 156,   1,
+     42,   1,   1,  43,  10,   1, 157, 151,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1, 145,  45,  29,   1,   1,   1,   1,   1, 158, 159,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1, 160,  10,
+    134,   1,   1,   1,   1,   1, 161,  10,   1,   1,   1,   1,   1, 162, 163,
+      1,   1,   1,   1,   1,  57, 164,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   2, 165,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1, 166, 152,   1,   1,   1,   1,
+      1,   1,   1,   1, 167,  10,   1, 168,   1,   1, 169, 170, 171,   1,   1,
+     21, 172,   1,   1,   1,   1,   1,   1,   1,   1,   1, 173,   1,   1,   1,
+      1,   1, 174, 175, 176,   1,   1,   1,   1,   1,   1,   1, 177, 163,   1,
+      1,   1,   1, 178,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1, 179,   1,   1,   1, 180,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1, 151,   1,   1,
+      1, 146,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   2,   1,   1,   1,   2,  22,   1,   1,   1,   1, 181, 182,
+     63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,
+    117,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63, 110,
+      1,   1, 183,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1, 184,  63,  63, 185,   1,   1, 185, 186,  63,  63,  63,  63,
+     63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,  63,
+     63,  63,  63,  63,  63, 111,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+    187,  75,   1,   1,   1,   1,   1,   0,   0, 188,   0, 146,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1, 189,
+    190, 191,   1, 192,   1,   1,   1,   1,   1,   1,   1,   1,   1,  64,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   0,   0,   0, 193,   0,
+      0,  55, 129, 194,   9,   4,   1,   1,   1,   1,   1, 195, 196, 197,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,  29,   1,   1,   1,  79,   1,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1, 146,   1,   1,   1,
+      1,   1,   1, 198,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+     98,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,  94,   1,   1,
+      1,   1,   1,   1,   1,   1,   1,   1,   1, 199, 200,   1,   1,   1,   1,
+      1,   1, 185,  63,  63, 111, 183, 182, 110,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,  63,  63, 201, 202,  63,  63,  63, 203,  63,  93,  63,  63,
+    204,  93,  63, 205,  63,  63,  63, 113, 206,  63,  63,  63,  63,  63,  63,
+     63,  63,  63,  63, 207,  63,  63,  63, 208, 209,  63, 117,  99,   1, 210,
+     98,   1,   1,   1,   1, 211,  63,  63,  63,  63,  63,   1,   1,   1,  63,
+     63,  63,  63, 212, 213, 107, 214,   1,   1,   1,   1,   1,   1,   1,   1,
+      1,   1,   1,   1,   1,   1, 111, 139, 215,  63,  63, 216, 202,  63,  63,
+     63,  63,  63,  63,  63,  63,  63,  63,  63,   1,   1,   1,   1,   1,   1,
+      1, 217, 119,  63, 118, 218, 110, 136, 117, 119
+};
+
+static const uint32_t amp_width_bits_table[] = {
+    0x00000000, 0x55555555, 0x15555555, 0x55500015, 0x00000001, 0x10000000,
+    0x55551041, 0x55555000, 0x54400000, 0x00155555, 0x55555554, 0x10000555,
+    0x50041400, 0x55555551, 0x55400000, 0x00000555, 0x51555500, 0x00100555,
+    0x50010100, 0x55015555, 0x00005550, 0x00055555, 0x55555540, 0x54455555,
+    0x51540001, 0x55550001, 0x55555505, 0x54555555, 0x51555401, 0x45555555,
+    0x55555541, 0x50141541, 0x55555150, 0x51541001, 0x14555555, 0x55554155,
+    0x55555545, 0x51555554, 0x55555454, 0x04555555, 0x50040554, 0x50554555,
+    0x55555550, 0x54155555, 0x55455555, 0x55554405, 0x55400051, 0x40001555,
+    0x54000051, 0x50005555, 0x55505555, 0x55511155, 0x40000001, 0x01550400,
+    0x00010000, 0x54000000, 0x55554555, 0x01555555, 0x41410004, 0x05505555,
+    0x55555401, 0x51554145, 0x51555555, 0xaaaaaaaa, 0x55555405, 0x50001055,
+    0x00014555, 0x55515555, 0x55541540, 0x55015545, 0x55141555, 0x40004555,
+    0x54000144, 0x14000015, 0x40000000, 0x55555500, 0x54400455, 0x50105005,
+    0x11504555, 0x00555555, 0x55550500, 0x00000040, 0x51540004, 0x55505455,
+    0x40055555, 0x00000400, 0x55a55555, 0x55695555, 0x56a95555, 0x55555596,
+    0x69555555, 0x55555a55, 0xaaaa5555, 0x555555aa, 0x95555555, 0x55555595,
+    0x55a55559, 0x65555a55, 0x55555655, 0x55655555, 0x596559a5, 0x55a55955,
+    0x55565555, 0x66555555, 0x55559a95, 0x5555a955, 0x95555556, 0x56955555,
+    0x55555956, 0xaa9aaaaa, 0x55555aaa, 0x55aaaaaa, 0xa00aaaaa, 0x6aaaaaaa,
+    0xaaaaaaa9, 0xaa816aaa, 0xaaaaa955, 0x5555aaaa, 0x56aaaaaa, 0x55556aaa,
+    0x50000040, 0x05555555, 0x55154545, 0x54554155, 0x55555055, 0x15555550,
+    0x50000555, 0x00001555, 0x50500515, 0x55555155, 0x40015555, 0x55554141,
+    0x54555515, 0x05541404, 0x50555555, 0x51545155, 0x555aaaaa, 0xaaaaaa6a,
+    0x55aa6aaa, 0x55555556, 0x55400555, 0x00554101, 0x15405555, 0x55550055,
+    0x55555005, 0x00005555, 0x55554000, 0x15555414, 0x51414015, 0x51555545,
+    0x01001555, 0x55555400, 0x55555515, 0x40000555, 0x14015555, 0x45550450,
+    0x55400015, 0x54000555, 0x15440015, 0x55555504, 0x10555005, 0x11400015,
+    0x51155555, 0x55551000, 0x55001005, 0x55410000, 0x44155555, 0x55050055,
+    0x55400001, 0x40140015, 0x55551555, 0x55014001, 0x55504000, 0x10004000,
+    0x00000005, 0x00050000, 0x55554104, 0x10454001, 0x55551150, 0x55555415,
+    0x55540000, 0x555554aa, 0x5555555a, 0x5556aaaa, 0x69aaa9aa, 0x5555556a,
+    0x5555aa55, 0x41555555, 0x50000000, 0x55501555, 0x00000015, 0x55000140,
+    0x50055555, 0x00154000, 0x55555455, 0x00004000, 0x00140000, 0x55400410,
+    0x55400055, 0x65555555, 0x556aaaa9, 0xa9555556, 0xaaaa9aaa, 0xa6aaaaaa,
+    0x956aaaaa, 0xaaaa5656, 0xaaaaaaa6, 0x96aaaaaa, 0x5aaaaaaa, 0x6a955555,
+    0x55556955, 0xaa955555, 0x56555aaa, 0xa955a96a, 0x56aaaa55, 0xaa555555,
+    0xaa6aaaaa, 0x56aa56aa, 0x556aaaaa
+};
 
 static inline size_t amp_calc_size(uint32_t w, uint32_t h) {
     return AMP_CELL_SIZE * w * h;
@@ -2216,9 +3798,18 @@ static inline size_t amp_init(
     amp->canvas.mode.data = (uint8_t *) data + amp->canvas.glyph.size;
     amp->canvas.mode.size = mode_size;
 
+    amp->canvas.row_offset = 0;
+
     amp->width = w;
     amp->height = h;
 
+    memset(&amp->cow, 0, sizeof(amp->cow));
+    memset(&amp->view, 0, sizeof(amp->view));
+    memset(&amp->lazy, 0, sizeof(amp->lazy));
+    memset(&amp->dirty, 0, sizeof(amp->dirty));
+    memset(&amp->band, 0, sizeof(amp->band));
+    memset(&amp->layout, 0, sizeof(amp->layout));
+
     amp_clear(amp);
 
     return bytes_required;
@@ -2229,2853 +3820,6471 @@ static inline void amp_clear(struct amp_type *amp) {
         return;
     }
 
-    memset(amp->canvas.glyph.data, 0, amp->canvas.glyph.size);
-    memset(amp->canvas.mode.data, 0, amp->canvas.mode.size);
-}
-
-static inline uint32_t amp_get_width(const struct amp_type *amp) {
-    return amp->width;
-}
-
-static inline uint32_t amp_get_height(const struct amp_type *amp) {
-    return amp->height;
-}
-
-static inline AMP_PALETTE amp_get_palette(const struct amp_type *amp) {
-    return amp->palette;
-}
+    amp_mark_dirty(amp, 0, amp->height);
 
-static inline void amp_set_palette(struct amp_type *amp, AMP_PALETTE palette) {
-    amp->palette = palette;
-}
+    // Rows that a derived ansmap has no room to copy are kept unmodified.
+    bool kept = false;
 
-static inline ssize_t amp_get_cell_index(
-    const struct amp_type *amp, long x, long y
-) {
-    if (x < 0 || y < 0 || x >= amp->width || y >= amp->height) {
-        return -1;
+    if (amp->cow.refs) {
+        for (long y = 0; y < amp->height; ++y) {
+            kept = !amp_cow_unshare(amp, y) || kept;
+        }
     }
 
-    return (y * amp->width + x);
-}
-
-static inline int amp_utf8_code_point_size(const char *str, size_t n) {
-    uint8_t *s = (uint8_t *) str;
+    if (amp->cow.parent) {
+        for (uint32_t y = 0; y < amp->height; ++y) {
+            if (kept && !amp_cow_unshare(amp, y)) {
+                continue;
+            }
 
-    if (n > 0) {
-        uint8_t c = *s;
+            if (amp->cow.rows[y] == 0) {
+                --amp->cow.parent->cow.refs;
+            }
 
-        if (c < 0x80) {
-            return (c != 0 ? 1 : 0);
+            amp->cow.rows[y] = amp_cow_row_empty;
         }
 
-        if (c >= 0xc2) {
-            if (c < 0xe0) {
-                if (n >= 2 && (s[1] ^ 0x80) < 0x40) {
-                    return 2;
-                }
-            }
-            else if (c < 0xf0) {
-                if (n >= 3
-                && (s[1] ^ 0x80) < 0x40
-                && (s[2] ^ 0x80) < 0x40
-                && (c >= 0xe1 || s[1] >= 0xa0)
-                && (c != 0xed || s[1] < 0xa0)) {
-                    return 3;
-                }
-            }
-            else if (c < 0xf8) {
-                if (n >= 4
-                && (s[1] ^ 0x80) < 0x40
-                && (s[2] ^ 0x80) < 0x40
-                && (s[3] ^ 0x80) < 0x40
-                && (c >= 0xf1 || s[1] >= 0x90)
-                && (c < 0xf4 || (c == 0xf4 && s[1] < 0x90))) {
-                    return 4;
-                }
-            }
+        if (!kept) {
+            amp->cow.used = 0;
         }
+
+        return;
     }
 
-    return -1; // invalid or incomplete multibyte character
-}
+    if (amp->view.parent || kept) {
+        for (long y = 0; y < amp->height; ++y) {
+            const struct amp_row_type row = amp_write_row(amp, y);
 
-static inline size_t amp_utf8_code_point_count(
-    const char *utf8_str, size_t utf8_str_size
-) {
-    size_t code_point_count = 0;
+            if (!row.size) {
+                continue;
+            }
 
-    for (const char *s = utf8_str; *s;) {
-        int cpsz = amp_utf8_code_point_size(
-            s, amp_sub_size(utf8_str_size, (size_t) (s - utf8_str))
-        );
+            memset(row.glyph, 0, row.size * AMP_CELL_GLYPH_SIZE);
+            memset(row.mode, 0, row.size * AMP_CELL_MODE_SIZE);
+        }
 
-        if (cpsz < 0) {
-            break;
+        return;
+    }
+
+    if (amp->lazy.rows) {
+        if (++amp->lazy.epoch == 0) {
+            memset(amp->lazy.rows, 0, sizeof(uint32_t) * amp->height);
+            amp->lazy.epoch = 1;
         }
 
-        ++code_point_count;
-        s += cpsz;
+        return;
     }
 
-    return code_point_count;
+    memset(amp->canvas.glyph.data, 0, amp->canvas.glyph.size);
+    memset(amp->canvas.mode.data, 0, amp->canvas.mode.size);
 }
 
-static inline const char *amp_get_glyph(
-    const struct amp_type *amp, long x, long y
+static inline bool amp_resize(
+    struct amp_type *amp, uint32_t w, uint32_t h, void *data, size_t data_size
 ) {
-    ssize_t cell_index = amp_get_cell_index(amp, x, y);
-
-    if (cell_index < 0) {
-        return nullptr;
+    if (amp->view.parent || amp->cow.parent || amp->cow.child
+    || amp->dirty.rows || amp->band.locks
+    || (amp->lazy.rows && h > amp->lazy.capacity)) {
+        return false;
     }
 
-    if ((size_t) cell_index * AMP_CELL_GLYPH_SIZE >= amp->canvas.glyph.size) {
-        return nullptr;
+    if (data == nullptr) {
+        data = amp->canvas.data;
+        data_size = amp->canvas.size;
     }
 
-    return (
-        (const char *) amp->canvas.glyph.data +
-        (size_t) cell_index * AMP_CELL_GLYPH_SIZE
-    );
-}
+    // The provided buffer begins with the old canvas.
+    amp->canvas.glyph.data = (uint8_t *) data;
+    amp->canvas.mode.data = amp->canvas.glyph.data + amp->canvas.glyph.size;
 
-static inline ssize_t amp_copy_glyph(
-    const struct amp_type *amp, long x, long y,
-    uint8_t *glyph_dst, size_t glyph_dst_size
-) {
-    const char *glyph = amp_get_glyph(amp, x, y);
+    for (size_t i = 0; amp->lazy.rows && i < amp->height; ++i) {
+        // Let's clear the stale rows for real as they are about to be moved.
+        const struct amp_row_type row = amp_canvas_row(amp, i);
 
-    if (!glyph) {
-        if (glyph_dst_size) {
-            *glyph_dst = 0;
+        if (row.size && amp->lazy.rows[i] != amp->lazy.epoch) {
+            memset(row.glyph, 0, row.size * AMP_CELL_GLYPH_SIZE);
+            memset(row.mode, 0, row.size * AMP_CELL_MODE_SIZE);
         }
-
-        return -1;
     }
 
-    const size_t glyph_length = strlen(glyph);
+    if (amp->canvas.row_offset) {
+        // Let's put the rows of the ring buffer back into their natural order.
+        const size_t offset = (size_t) amp->canvas.row_offset * amp->width;
 
-    if (glyph_length >= glyph_dst_size || !glyph_length) {
-        if (glyph_dst_size) {
-            *glyph_dst = 0;
-        }
-    }
-    else {
-        memcpy(glyph_dst, glyph, glyph_length + 1);
+        amp_rotate_bytes(
+            amp->canvas.glyph.data, amp->canvas.glyph.size,
+            offset * AMP_CELL_GLYPH_SIZE
+        );
+        amp_rotate_bytes(
+            amp->canvas.mode.data, amp->canvas.mode.size,
+            offset * AMP_CELL_MODE_SIZE
+        );
+
+        amp->canvas.row_offset = 0;
     }
 
-    return (
-        // The number of characters that would have been written if
-        // glyph_dst_size had been sufficiently large, not counting the
-        // terminating null character.
-        (ssize_t) glyph_length
+    const size_t bytes_required = amp_calc_size(w, h);
+    const size_t old_w = amp->width;
+    const size_t old_cells = amp->canvas.glyph.size / AMP_CELL_GLYPH_SIZE;
+    const size_t new_cells = (
+        (data_size < bytes_required ? data_size : bytes_required) /
+        AMP_CELL_SIZE
     );
-}
+    const size_t rows = amp->height < h ? amp->height : h;
+
+    uint8_t *glyph_data = (uint8_t *) data;
+    uint8_t *old_mode_data = glyph_data + old_cells * AMP_CELL_GLYPH_SIZE;
+    uint8_t *new_mode_data = glyph_data + new_cells * AMP_CELL_GLYPH_SIZE;
+
+    // Every row of both of the planes keeps its position relative to the other
+    // rows. Thus, the rows moving towards the start of the buffer can be moved
+    // in ascending order and the rest of the rows in descending order without
+    // overwriting the rows that are yet to be moved.
+    for (size_t pass = 0; pass < 2; ++pass) {
+        for (size_t i = 0; i < 2 * rows; ++i) {
+            const size_t k = pass ? 2 * rows - 1 - i : i;
+            const size_t y = k % rows;
+            const bool mode = k >= rows;
+            const size_t cell_size = (
+                mode ? AMP_CELL_MODE_SIZE : AMP_CELL_GLYPH_SIZE
+            );
+            const size_t old_size = amp_canvas_row_size(old_cells, old_w, y);
+            const size_t new_size = amp_canvas_row_size(new_cells, w, y);
+            const size_t count = old_size < new_size ? old_size : new_size;
 
-static inline const char *amp_put_glyph(
-    struct amp_type *amp, long x, long y, const char *glyph
-) {
-    // If glyph contains multiple UTF8 code points, then use only the first one.
+            if (!count) {
+                continue;
+            }
 
-    ssize_t cell_index = amp_get_cell_index(amp, x, y);
+            uint8_t *src = (mode ? old_mode_data : glyph_data) + (
+                y * old_w * cell_size
+            );
+            uint8_t *dst = (mode ? new_mode_data : glyph_data) + (
+                y * w * cell_size
+            );
 
-    if (cell_index < 0) {
-        return nullptr;
+            if ((pass == 0 && dst < src) || (pass == 1 && dst > src)) {
+                memmove(dst, src, count * cell_size);
+            }
+        }
     }
 
-    if ((size_t) cell_index * AMP_CELL_GLYPH_SIZE >= amp->canvas.glyph.size) {
-        return nullptr;
-    }
+    for (size_t y = 0; y < h; ++y) {
+        const size_t new_size = amp_canvas_row_size(new_cells, w, y);
+        const size_t old_size = (
+            y < rows ? amp_canvas_row_size(old_cells, old_w, y) : 0
+        );
+        const size_t count = old_size < new_size ? old_size : new_size;
 
-    uint8_t glyph_data[AMP_CELL_GLYPH_SIZE];
-    uint8_t glyph_data_size = 0;
+        if (count == new_size) {
+            continue;
+        }
 
-    for (; glyph_data_size < sizeof(glyph_data); ++glyph_data_size) {
-        glyph_data[glyph_data_size] = (uint8_t) glyph[glyph_data_size];
+        uint8_t *glyph = glyph_data + (y * w + count) * AMP_CELL_GLYPH_SIZE;
+        uint8_t *mode = new_mode_data + (y * w + count) * AMP_CELL_MODE_SIZE;
 
-        if (glyph_data[glyph_data_size] == 0) {
-            break;
-        }
+        memset(glyph, 0, (new_size - count) * AMP_CELL_GLYPH_SIZE);
+        memset(mode, 0, (new_size - count) * AMP_CELL_MODE_SIZE);
     }
 
-    int code_point_size = amp_utf8_code_point_size(
-        (const char *) glyph_data, glyph_data_size
-    );
+    amp->canvas.data = data;
+    amp->canvas.size = data_size;
 
-    if (code_point_size < 0 || (size_t) code_point_size >= sizeof(glyph_data)) {
-        return nullptr;
-    }
+    amp->canvas.glyph.data = glyph_data;
+    amp->canvas.glyph.size = new_cells * AMP_CELL_GLYPH_SIZE;
 
-    glyph_data[code_point_size] = 0;
-    glyph_data_size = (uint8_t) code_point_size;
+    amp->canvas.mode.data = new_mode_data;
+    amp->canvas.mode.size = new_cells * AMP_CELL_MODE_SIZE;
 
-    char *dst = (char *) (
-        amp->canvas.glyph.data + (size_t) cell_index * AMP_CELL_GLYPH_SIZE
-    );
+    amp->width = w;
+    amp->height = h;
 
-    memcpy(dst, glyph_data, glyph_data_size + 1);
+    for (size_t i = 0; amp->lazy.rows && i < h; ++i) {
+        amp->lazy.rows[i] = amp->lazy.epoch;
+    }
 
-    return dst;
+    return true;
 }
 
-static inline bool amp_set_mode(
-    struct amp_type *amp, long x, long y, struct amp_mode_type mode
+static inline size_t amp_canvas_row_size(
+    size_t cell_count, size_t width, size_t y
 ) {
-    uint8_t *mode_data = amp_get_mode_data(amp, x, y);
+    const size_t first_cell = y * width;
 
-    if (!mode_data) {
-        return false;
+    if (first_cell >= cell_count) {
+        return 0;
     }
 
-    return amp_mode_cell_serialize(mode, mode_data, AMP_CELL_MODE_SIZE);
+    return cell_count - first_cell < width ? cell_count - first_cell : width;
 }
 
-static inline struct amp_mode_type amp_get_mode(
-    const struct amp_type *amp, long x, long y
-) {
-    static const struct amp_mode_type broken_cell = {
-        .bitset = { .broken = true }
-    };
+static inline void amp_rotate_bytes(uint8_t *data, size_t size, size_t shift) {
+    // Rotates the array to the left by the given number of bytes.
+    amp_reverse_bytes(data, shift);
+    amp_reverse_bytes(data + shift, size - shift);
+    amp_reverse_bytes(data, size);
+}
 
-    uint8_t *mode_data = amp_get_mode_data(amp, x, y);
+static inline void amp_reverse_bytes(uint8_t *data, size_t size) {
+    for (size_t i = 0; i < size / 2; ++i) {
+        const uint8_t byte = data[i];
 
-    if (!mode_data) {
-        return broken_cell;
+        data[i] = data[size - 1 - i];
+        data[size - 1 - i] = byte;
     }
-
-    return amp_mode_cell_deserialize(mode_data, AMP_CELL_MODE_SIZE);
 }
 
-static inline uint8_t *amp_get_mode_data(
-    const struct amp_type *amp, long x, long y
+static inline bool amp_set_lazy_clear(
+    struct amp_type *amp, uint32_t *generations, uint32_t generation_count
 ) {
-    ssize_t cell_index = amp_get_cell_index(amp, x, y);
-
-    if (cell_index < 0) {
-        return nullptr;
+    if (amp->view.parent || amp->cow.parent) {
+        return false;
     }
 
-    if ((size_t) cell_index * AMP_CELL_MODE_SIZE >= amp->canvas.mode.size) {
-        return nullptr;
-    }
+    if (generations == nullptr) {
+        for (size_t i = 0; amp->lazy.rows && i < amp->height; ++i) {
+            const struct amp_row_type row = amp_canvas_row(amp, i);
 
-    return amp->canvas.mode.data + (size_t) cell_index * AMP_CELL_MODE_SIZE;
-}
+            if (row.size && amp->lazy.rows[i] != amp->lazy.epoch) {
+                memset(row.glyph, 0, row.size * AMP_CELL_GLYPH_SIZE);
+                memset(row.mode, 0, row.size * AMP_CELL_MODE_SIZE);
+            }
+        }
 
-static inline AMP_STYLE amp_get_style(
-    const struct amp_type *amp, long x, long y
-) {
-    AMP_STYLE style = AMP_STYLE_NONE;
-    auto mode = amp_get_mode(amp, x, y);
+        amp->lazy.rows = nullptr;
 
-    if (mode.bitset.broken) {
-        return AMP_STYLE_NONE;
+        return true;
     }
 
-    if (mode.bitset.bg) {
-        auto const combo = amp_lookup_color_combo(mode.bg);
+    if (generation_count < amp->height) {
+        return false;
+    }
 
-        for (size_t i=0; combo.colors[i] != AMP_COLOR_NONE; ++i) {
-            style |= amp_lookup_color(combo.colors[i]).style.bg;
+    if (amp->lazy.rows) {
+        // Let's carry over the state of the rows from the previous array.
+        for (uint32_t y = 0; y < amp->height; ++y) {
+            generations[y] = amp->lazy.rows[y] == amp->lazy.epoch ? 1 : 0;
+        }
+    }
+    else {
+        for (uint32_t y = 0; y < amp->height; ++y) {
+            generations[y] = 1;
         }
     }
 
-    if (mode.bitset.fg) {
-        auto const combo = amp_lookup_color_combo(mode.fg);
+    amp->lazy.rows = generations;
+    amp->lazy.capacity = generation_count;
+    amp->lazy.epoch = 1;
 
-        for (size_t i=0; combo.colors[i] != AMP_COLOR_NONE; ++i) {
-            style |= amp_lookup_color(combo.colors[i]).style.fg;
-        }
-    }
+    return true;
+}
 
-    return (
-        (mode.bitset.hidden         ? AMP_HIDDEN        : 0) |
-        (mode.bitset.faint          ? AMP_FAINT         : 0) |
-        (mode.bitset.italic         ? AMP_ITALIC        : 0) |
-        (mode.bitset.underline      ? AMP_UNDERLINE     : 0) |
-        (mode.bitset.blinking       ? AMP_BLINKING      : 0) |
-        (mode.bitset.strikethrough  ? AMP_STRIKETHROUGH : 0) | style
-    );
+#ifndef AMP_NO_THREADS
+static inline size_t amp_calc_double_buffer_size(uint32_t w, uint32_t h) {
+    return 2 * amp_calc_size(w, h) + h;
 }
 
-static inline bool amp_put_style(
-    struct amp_type *amp, long x, long y, AMP_STYLE style
+static inline size_t amp_init_double_buffer(
+    struct amp_double_buffer_type *db, uint32_t w, uint32_t h, void *data,
+    size_t data_size
 ) {
-    auto mode = amp_get_mode(amp, x, y);
-
-    constexpr AMP_STYLE bg_colors = amp_bg_color_styles;
-    constexpr AMP_STYLE fg_colors = amp_fg_color_styles;
-
-    if (style & bg_colors) {
-        if (style & AMP_BG_NONE) {
-            mode.bitset.bg = false;
-        }
-        else {
-            unsigned bg_r = 0;
-            unsigned bg_g = 0;
-            unsigned bg_b = 0;
-            unsigned bg_colors = 0;
+    const size_t canvas_size = amp_calc_size(w, h);
+    const size_t bytes_required = amp_calc_double_buffer_size(w, h);
+    const size_t dirty_size = data_size < h ? data_size : h;
+    const size_t canvas_data_size = (data_size - dirty_size) / 2;
+    uint8_t *bytes = (uint8_t *) data;
+
+    // The dirty rows take precedence over the canvases as without them the
+    // back buffer could not be preserved.
+    db->dirty_rows = (
+        bytes && dirty_size == h ? bytes + 2 * canvas_data_size : nullptr
+    );
 
-            mode.bitset.bg = true;
+    for (size_t i = 0; i < 2; ++i) {
+        uint8_t *canvas_data = bytes ? bytes + i * canvas_data_size : nullptr;
 
-            for (AMP_COLOR i = AMP_COLOR_NONE + 1; i < AMP_MAX_COLOR; ++i) {
-                auto row = amp_color_table[i];
+        amp_init(
+            &db->canvas[i], w, h, canvas_data,
+            canvas_data_size < canvas_size ? canvas_data_size : canvas_size
+        );
+    }
 
-                if (row.style.bg & style) {
-                    bg_r += row.rgb.r;
-                    bg_g += row.rgb.g;
-                    bg_b += row.rgb.b;
+    if (db->dirty_rows) {
+        memset(db->dirty_rows, 0, h);
+    }
 
-                    ++bg_colors;
-                }
-            }
+    db->canvas[1].dirty.rows = db->dirty_rows;
+    db->synced = true;
 
-            bg_r /= bg_colors;
-            bg_g /= bg_colors;
-            bg_b /= bg_colors;
+    atomic_init(&db->front, 0);
+    atomic_init(&db->readers[0], 0);
+    atomic_init(&db->readers[1], 0);
 
-            mode.bg = amp_map_rgb(
-                (uint8_t) bg_r, (uint8_t) bg_g, (uint8_t) bg_b
-            );
-        }
-    }
-    else mode.bitset.bg = false;
+    return bytes_required;
+}
 
-    if (style & fg_colors) {
-        if (style & AMP_FG_NONE) {
-            mode.bitset.fg = false;
-        }
-        else {
-            unsigned fg_r = 0;
-            unsigned fg_g = 0;
-            unsigned fg_b = 0;
-            unsigned fg_colors = 0;
+static inline struct amp_type *amp_get_back_buffer(
+    struct amp_double_buffer_type *db
+) {
+    return &db->canvas[1 - atomic_load(&db->front)];
+}
 
-            mode.bitset.fg = true;
+static inline void amp_swap(struct amp_double_buffer_type *db, bool preserve) {
+    const unsigned back = 1 - atomic_load(&db->front);
+    struct amp_type *front = &db->canvas[back];
+    struct amp_type *next_back = &db->canvas[1 - back];
 
-            for (AMP_COLOR i = AMP_COLOR_NONE + 1; i < AMP_MAX_COLOR; ++i) {
-                auto row = amp_color_table[i];
+    front->dirty.rows = nullptr;
+    atomic_store(&db->front, back);
 
-                if (row.style.fg & style) {
-                    fg_r += row.rgb.r;
-                    fg_g += row.rgb.g;
-                    fg_b += row.rgb.b;
+    while (atomic_load(&db->readers[1 - back])) {
+        thrd_yield(); // The readers of the old front buffer are still at it.
+    }
 
-                    ++fg_colors;
-                }
+    if (preserve) {
+        for (uint32_t y = 0; y < front->height; ++y) {
+            if (!db->synced || !db->dirty_rows || db->dirty_rows[y]) {
+                amp_copy_row(next_back, y, front, y);
             }
-
-            fg_r /= fg_colors;
-            fg_g /= fg_colors;
-            fg_b /= fg_colors;
-
-            mode.fg = amp_map_rgb(
-                (uint8_t) fg_r, (uint8_t) fg_g, (uint8_t) fg_b
-            );
         }
     }
-    else mode.bitset.fg = false;
 
-    mode.bitset.hidden          = style & AMP_HIDDEN;
-    mode.bitset.faint           = style & AMP_FAINT;
-    mode.bitset.italic          = style & AMP_ITALIC;
-    mode.bitset.underline       = style & AMP_UNDERLINE;
-    mode.bitset.blinking        = style & AMP_BLINKING;
-    mode.bitset.strikethrough   = style & AMP_STRIKETHROUGH;
+    if (db->dirty_rows) {
+        memset(db->dirty_rows, 0, front->height);
+    }
 
-    return amp_set_mode(amp, x, y, mode);
+    next_back->dirty.rows = db->dirty_rows;
+    db->synced = preserve;
 }
 
-static inline bool amp_set_bg_color(
-    struct amp_type *amp, long x, long y, struct amp_rgb_type bg_color
+static inline const struct amp_type *amp_acquire_front_buffer(
+    struct amp_double_buffer_type *db
 ) {
-    auto mode = amp_get_mode(amp, x, y);
+    for (;;) {
+        const unsigned front = atomic_load(&db->front);
 
-    mode.bg = bg_color;
-    mode.bitset.bg = true;
+        atomic_fetch_add(&db->readers[front], 1);
 
-    return amp_set_mode(amp, x, y, mode);
+        if (atomic_load(&db->front) == front) {
+            return &db->canvas[front];
+        }
+
+        // The buffers were swapped in the meantime.
+        atomic_fetch_sub(&db->readers[front], 1);
+    }
 }
 
-static inline struct amp_rgb_type amp_get_bg_color(
-    struct amp_type *amp, long x, long y
+static inline void amp_release_front_buffer(
+    struct amp_double_buffer_type *db, const struct amp_type *front
 ) {
-    return amp_get_mode(amp, x, y).bg;
+    atomic_fetch_sub(&db->readers[front == &db->canvas[0] ? 0 : 1], 1);
 }
 
-static inline bool amp_set_fg_color(
-    struct amp_type *amp, long x, long y, struct amp_rgb_type fg_color
+static inline bool amp_set_bands(
+    struct amp_type *amp, struct amp_band_type *bands, uint32_t band_count
 ) {
-    auto mode = amp_get_mode(amp, x, y);
+    if (amp->view.parent || amp->cow.parent || amp->cow.child) {
+        return false;
+    }
 
-    mode.fg = fg_color;
-    mode.bitset.fg = true;
+    if (bands == nullptr || band_count == 0) {
+        memset(&amp->band, 0, sizeof(amp->band));
 
-    return amp_set_mode(amp, x, y, mode);
-}
+        return true;
+    }
 
-static inline struct amp_rgb_type amp_get_fg_color(
-    struct amp_type *amp, long x, long y
-) {
-    return amp_get_mode(amp, x, y).fg;
+    for (uint32_t i = 0; i < band_count; ++i) {
+        atomic_init(&bands[i].sequence, 0);
+    }
+
+    amp->band.locks = bands;
+    amp->band.count = band_count;
+    amp->band.rows = amp->height / band_count + !!(amp->height % band_count);
+
+    return true;
 }
 
-static inline void amp_print_glyph(
-    struct amp_type *amp, long x, long y, AMP_STYLE style, const char *glyph_str
+static inline void amp_lock_rows(
+    struct amp_type *amp, long y, uint32_t row_count
 ) {
-    if (x < 0 || x >= amp->width || y < 0 || y >= amp->height
-    ||  x > UINT32_MAX || y > UINT32_MAX) {
+    if (amp->view.parent) {
+        amp_lock_rows(amp->view.parent, y + amp->view.y, row_count);
         return;
     }
 
-    char glyph[AMP_CELL_GLYPH_SIZE] = {};
-    size_t glyph_size = 0;
+    uint32_t first = 0;
+    uint32_t count = amp_get_bands(amp, y, row_count, &first);
 
-    for (const char *c = glyph_str; *c; ++c) {
-        if (++glyph_size >= sizeof(glyph)) {
-            break;
+    // The bands are always locked in ascending order to avoid deadlocks.
+    for (uint32_t i = first; i < first + count; ++i) {
+        atomic_uint *sequence = &amp->band.locks[i].sequence;
+        unsigned value = atomic_load(sequence);
+
+        while ((value & 1) || !atomic_compare_exchange_weak(
+            sequence, &value, value + 1
+        )) {
+            if (value & 1) {
+                thrd_yield(); // Another thread is drawing on this band.
+                value = atomic_load(sequence);
+            }
         }
     }
 
-    int cpsz = amp_utf8_code_point_size(glyph_str, glyph_size);
+    atomic_thread_fence(memory_order_release);
+}
 
-    if (cpsz < 0 || cpsz >= (int) sizeof(glyph)) {
+static inline void amp_unlock_rows(
+    struct amp_type *amp, long y, uint32_t row_count
+) {
+    if (amp->view.parent) {
+        amp_unlock_rows(amp->view.parent, y + amp->view.y, row_count);
         return;
     }
 
-    memcpy(glyph, glyph_str, (size_t) cpsz);
-
-    if (cpsz == 1 && !isprint(glyph[0])) {
-        glyph[0] = '?';
-    }
-
-    amp_put_glyph(amp, x, y, glyph);
-
-    if ((style & amp_bg_color_styles) == false) {
-        // If the new style does not include any background colors, then the
-        // existing background color should remain in effect.
-
-        auto old_mode = amp_get_mode(amp, x, y);
-
-        amp_put_style(amp, x, y, style);
+    uint32_t first = 0;
+    uint32_t count = amp_get_bands(amp, y, row_count, &first);
 
-        auto new_mode = amp_get_mode(amp, x, y);
-
-        new_mode.bg = old_mode.bg;
-        new_mode.bitset.bg = old_mode.bitset.bg;
-
-        amp_set_mode(amp, x, y, new_mode);
-    }
-    else {
-        amp_put_style(amp, x, y, style);
+    for (uint32_t i = first; i < first + count; ++i) {
+        atomic_fetch_add(&amp->band.locks[i].sequence, 1);
     }
 }
 
-static inline void amp_print_line_clip(
-    struct amp_type *amp, long x, long y, AMP_STYLE style, AMP_ALIGN align,
-    const char *text, size_t text_size
+static inline void amp_snapshot_rows(
+    struct amp_type *dst, const struct amp_type *src, long y,
+    uint32_t row_count
 ) {
-    if (y < 0 || y >= amp->height || y > UINT32_MAX) {
-        return;
+    const struct amp_type *banded = src;
+    long banded_y = y;
+
+    while (banded->view.parent) {
+        banded_y += banded->view.y;
+        banded = banded->view.parent;
     }
 
-    uint32_t text_width = (uint32_t) amp_utf8_code_point_count(text, text_size);
+    long length = row_count;
 
-    if (align == AMP_ALIGN_RIGHT) {
-        x = (x - text_width) + 1;
-    }
-    else if (align == AMP_ALIGN_CENTER) {
-        x -= text_width / 2;
+    if (!amp_clip_span(&y, src->height, &banded_y, banded->height, &length)) {
+        return;
     }
 
-    for (const char *s = text; *s;) {
-        int cpsz = amp_utf8_code_point_size(
-            s, amp_sub_size(text_size, (size_t) (s - text))
-        );
+    while (length > 0) {
+        const struct amp_band_type *band = nullptr;
+        long rows = length;
 
-        if (cpsz < 0) {
-            break;
+        if (banded->band.locks) {
+            const uint32_t index = (uint32_t) banded_y / banded->band.rows;
+            const long band_end = (long) (index + 1) * banded->band.rows;
+
+            band = &banded->band.locks[index];
+            rows = band_end - banded_y < rows ? band_end - banded_y : rows;
         }
 
-        amp_print_glyph(amp, x, y, style, s);
+        for (;;) {
+            const unsigned sequence = band ? atomic_load(&band->sequence) : 0;
 
-        if (++x >= amp->width) {
-            break;
+            if (sequence & 1) {
+                thrd_yield(); // The band is being drawn on.
+                continue;
+            }
+
+            for (long i = 0; i < rows; ++i) {
+                amp_copy_row(dst, y + i, src, y + i);
+            }
+
+            atomic_thread_fence(memory_order_acquire);
+
+            if (!band || atomic_load(&band->sequence) == sequence) {
+                break;
+            }
         }
 
-        s += cpsz;
+        y += rows;
+        banded_y += rows;
+        length -= rows;
     }
 }
+#endif
 
-static inline void amp_print_rich_line_clip(
-    struct amp_type *amp, long x, long y, AMP_STYLE *text_style,
-    AMP_ALIGN align, const char *text, size_t text_size
-) {
-    if (y < 0 || y >= amp->height || y > UINT32_MAX) {
+static inline void amp_scroll(struct amp_type *amp, long rows) {
+    const uint32_t h = amp->height;
+    const unsigned long distance = (
+        rows > 0 ? (unsigned long) rows : 0UL - (unsigned long) rows
+    );
+    const uint32_t moved = distance < h ? (uint32_t) (h - distance) : 0;
+
+    if (!rows || !h) {
         return;
     }
 
-    uint32_t text_width = (uint32_t) (
-        amp_utf8_code_point_count(text, text_size) -
-        amp_str_seg_style_sign_count(text, text_size)
+    amp_mark_dirty(amp, 0, h);
+
+    const size_t cell_count = (size_t) amp->width * h;
+
+    bool rotate = (
+        !amp->view.parent && !amp->cow.parent &&
+        amp->canvas.glyph.size == cell_count * AMP_CELL_GLYPH_SIZE
     );
 
-    if (align == AMP_ALIGN_RIGHT) {
-        x = (x - text_width) + 1;
-    }
-    else if (align == AMP_ALIGN_CENTER) {
-        x -= text_width / 2;
+    if (rotate && amp->cow.refs) {
+        // Rows that a derived ansmap has no room to copy must stay in place.
+        for (long y = 0; y < h; ++y) {
+            rotate = amp_cow_unshare(amp, y) && rotate;
+        }
     }
 
-    const char *s = text;
-    size_t count = 0;
-
-    while (*s && s < text + text_size) {
-        const char *next = amp_str_seg_skip_style_sign(
-            s, text_size - (size_t) (s - text)
-        );
+    if (rotate) {
+        // The canvas holds all of the rows, so they can be rotated in place.
+        const uint32_t shift = h - moved;
 
-        if (next > text + text_size) {
-            break;
-        }
+        amp->canvas.row_offset = (
+            rows > 0 ? amp->canvas.row_offset + shift :
+            amp->canvas.row_offset + (h - shift)
+        ) % h;
 
-        if (s == next) { // no style sign detected
-            next = amp_str_seg_skip_any_utf8_symbol(
-                s, text_size - (size_t) (s - text)
+        for (uint32_t i = 0; i < shift; ++i) {
+            const size_t index = amp_canvas_row_index(
+                amp, rows > 0 ? moved + i : i
             );
 
-            if (s == next) {
-                break;
+            if (amp->lazy.rows) {
+                amp->lazy.rows[index] = amp->lazy.epoch - 1;
+                continue;
             }
 
-            {
-                int cpsz = amp_utf8_code_point_size(
-                    s, amp_sub_size(text_size, (size_t) (s - text))
-                );
-
-                if (cpsz < 0) {
-                    break;
-                }
+            const struct amp_row_type row = amp_canvas_row(amp, index);
 
-                amp_print_glyph(amp, x++, y, *text_style, s);
+            if (row.size) {
+                memset(row.glyph, 0, row.size * AMP_CELL_GLYPH_SIZE);
+                memset(row.mode, 0, row.size * AMP_CELL_MODE_SIZE);
             }
-
-            s = next;
-            continue;
         }
-        else if (next - s == 1) { // double brace detected
-            ++count; // double braces '{{' count for one style sign
-
-            if (*next != '{') {
-                abort();
-            }
 
-            amp_print_glyph(amp, x++, y, *text_style, "{");
+        return;
+    }
 
-            s = next + 1;
-            continue;
+    for (uint32_t i = 0; i < moved; ++i) {
+        if (rows > 0) {
+            amp_copy_row(amp, i, amp, (long) (i + (h - moved)));
         }
+        else {
+            amp_copy_row(
+                amp, (long) (h - 1 - i), amp, (long) (moved - 1 - i)
+            );
+        }
+    }
 
-        auto const row = amp_lookup_inline_style(s+1);
-        AMP_STYLE new_style = row.style;
-
-        if (new_style) {
-            if (new_style & AMP_HARD_RESET) {
-                *text_style = 0; // Reset foreground, background and decoration.
-                new_style &= ~AMP_HARD_RESET;
-            }
+    for (uint32_t i = moved; i < h; ++i) {
+        const struct amp_row_type row = amp_write_row(
+            amp, rows > 0 ? (long) i : (long) (h - 1 - i)
+        );
 
-            if (new_style & AMP_SOFT_RESET) {
-                // Reset foreground and decoration. Leave background as is.
-                *text_style &= amp_bg_color_styles;
-                new_style &= ~AMP_SOFT_RESET;
-            }
+        if (row.size) {
+            memset(row.glyph, 0, row.size * AMP_CELL_GLYPH_SIZE);
+            memset(row.mode, 0, row.size * AMP_CELL_MODE_SIZE);
+        }
+    }
+}
 
-            if (new_style & amp_fg_color_styles) {
-                // New style includes foreground color. Clear the old color.
-                *text_style &= ~amp_fg_color_styles;
-            }
+static inline void amp_copy_row(
+    struct amp_type *dst_amp, long dst_y, const struct amp_type *src_amp,
+    long src_y
+) {
+    const struct amp_row_type dst = amp_write_row(dst_amp, dst_y);
+    const struct amp_row_type src = amp_read_row(src_amp, src_y);
+    size_t count = src.size < dst.size ? src.size : dst.size;
 
-            if (new_style & amp_bg_color_styles) {
-                // New style includes background color. Clear the old color.
-                *text_style &= ~amp_bg_color_styles;
-            }
+    if (!dst.size) {
+        return;
+    }
 
-            *text_style |= new_style;
-        }
+    if (!src.glyph) {
+        count = 0; // The source row is empty.
+    }
 
-        s = next;
+    if (count) {
+        memmove(dst.glyph, src.glyph, count * AMP_CELL_GLYPH_SIZE);
+        memmove(dst.mode, src.mode, count * AMP_CELL_MODE_SIZE);
     }
+
+    memset(
+        dst.glyph + count * AMP_CELL_GLYPH_SIZE, 0,
+        (dst.size - count) * AMP_CELL_GLYPH_SIZE
+    );
+    memset(
+        dst.mode + count * AMP_CELL_MODE_SIZE, 0,
+        (dst.size - count) * AMP_CELL_MODE_SIZE
+    );
 }
 
-static inline void amp_print_line(
-    struct amp_type *amp, long x, long y, AMP_STYLE style, AMP_ALIGN align,
-    const char *text
+static inline size_t amp_calc_cow_size(
+    uint32_t w, uint32_t h, uint32_t private_rows
 ) {
-    amp_print_line_clip(amp, x, y, style, align, text, strlen(text));
+    return (
+        alignof(uint32_t) - 1 + sizeof(uint32_t) * h +
+        AMP_CELL_SIZE * w * private_rows
+    );
 }
 
-static inline size_t amp_print_rich_text_clip(
-    struct amp_type *amp, long text_x, long text_y, AMP_STYLE *text_style,
-    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str,
-    size_t text_str_size
+static inline uint32_t amp_init_cow(
+    struct amp_type *amp, struct amp_type *parent, void *data, size_t data_size
 ) {
-    if (!text_max_width) {
-        text_max_width = UINT32_MAX;
+    const size_t table_size = amp_calc_cow_size(0, parent->height, 0);
+    const size_t row_size = amp_calc_size(parent->width, 1);
+
+    amp_init(amp, 0, 0, nullptr, 0);
+
+    if (data == nullptr || data_size < table_size) {
+        return 0;
     }
 
-    size_t line_count = 0;
-    const char *line = text_str;
-    long y = 0;
+    uint8_t *table = (uint8_t *) data + (
+        (alignof(uint32_t) - (uintptr_t) data % alignof(uint32_t)) %
+        alignof(uint32_t)
+    );
 
-    while (*line && line < text_str + text_str_size) {
-        size_t line_size;
-        const char *next_line = amp_str_seg_first_line_size(
-            line, amp_sub_size(text_str_size, (size_t) (line - text_str)),
-            &line_size
-        );
+    size_t capacity = row_size ? (data_size - table_size) / row_size : 0;
 
-        const size_t line_width = amp_rich_str_seg_width(line, line_size);
+    capacity = capacity < parent->height ? capacity : parent->height;
 
-        if (line_width > text_max_width) {
-            const char *clip_end = amp_rich_str_seg_skip_wrap(
-                line, line_size, text_max_width
-            );
+    amp->canvas.data = data;
+    amp->canvas.size = data_size;
 
-            const size_t clip_size = (size_t) (clip_end - line);
+    amp->canvas.glyph.data = table + sizeof(uint32_t) * parent->height;
+    amp->canvas.glyph.size = capacity * parent->width * AMP_CELL_GLYPH_SIZE;
 
-            amp_print_rich_line_clip(
-                amp, text_x, text_y + y, text_style, text_alignment,
-                line, clip_size
-            );
+    amp->canvas.mode.data = amp->canvas.glyph.data + amp->canvas.glyph.size;
+    amp->canvas.mode.size = capacity * parent->width * AMP_CELL_MODE_SIZE;
 
-            ++y;
-            ++line_count;
+    amp->width = parent->width;
+    amp->height = parent->height;
+    amp->palette = parent->palette;
 
-            if (clip_size < line_size) {
-                const char *space_end = amp_str_seg_skip_spaces(
-                    clip_end, amp_sub_size(line_size, clip_size)
-                );
+    amp->cow.parent = parent;
+    amp->cow.sibling = parent->cow.child;
+    amp->cow.rows = (uint32_t *) table;
+    amp->cow.capacity = (uint32_t) capacity;
 
-                const size_t space_size = (size_t) (space_end - clip_end);
-                const size_t trail_size = amp_sub_size(
-                    line_size, clip_size + space_size
-                );
+    memset(amp->cow.rows, 0, sizeof(uint32_t) * amp->height);
 
-                if (trail_size) {
-                    size_t extra_lines = amp_print_rich_text_clip(
-                        amp, text_x, text_y + y, text_style, text_max_width,
-                        text_alignment, space_end, trail_size
-                    );
+    parent->cow.child = amp;
+    parent->cow.refs += amp->height;
 
-                    y += (long) extra_lines;
-                    line_count += extra_lines;
-                }
-            }
-        }
-        else {
-            amp_print_rich_line_clip(
-                amp, text_x, text_y + y, text_style, text_alignment,
-                line, line_size
-            );
+    return amp->cow.capacity;
+}
 
-            ++y;
-            ++line_count;
-        }
+static inline void amp_deinit_cow(struct amp_type *amp) {
+    struct amp_type *parent = amp->cow.parent;
+
+    if (!parent) {
+        return;
+    }
 
-        if (next_line <= line) {
+    for (struct amp_type **c = &parent->cow.child; *c; c = &(*c)->cow.sibling) {
+        if (*c == amp) {
+            *c = amp->cow.sibling;
             break;
         }
+    }
 
-        line = next_line;
+    for (uint32_t y = 0; y < amp->height; ++y) {
+        if (amp->cow.rows[y] == 0) {
+            --parent->cow.refs;
+        }
     }
 
-    return line_count;
+    amp_init(amp, 0, 0, nullptr, 0);
 }
 
-static inline size_t amp_print_text_clip(
-    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
-    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str,
-    size_t text_str_size
+static inline bool amp_init_view(
+    struct amp_type *amp, struct amp_type *parent, long x, long y,
+    uint32_t w, uint32_t h
 ) {
-    if (!text_max_width) {
-        text_max_width = UINT32_MAX;
+    amp_init(amp, 0, 0, nullptr, 0);
+
+    if (x >= parent->width || y >= parent->height) {
+        return false;
     }
 
-    size_t line_count = 0;
-    const char *line = text_str;
-    long y = 0;
+    long x_end = x + (long) w;
+    long y_end = y + (long) h;
 
-    while (*line && line < text_str + text_str_size) {
-        size_t line_size;
-        const char *next_line = amp_str_seg_first_line_size(
-            line, amp_sub_size(text_str_size, (size_t) (line - text_str)),
-            &line_size
-        );
+    x = x < 0 ? 0 : x;
+    y = y < 0 ? 0 : y;
+    x_end = x_end > parent->width ? parent->width : x_end;
+    y_end = y_end > parent->height ? parent->height : y_end;
 
-        const size_t line_width = amp_str_seg_width(line, line_size);
+    if (x >= x_end || y >= y_end) {
+        return false;
+    }
 
-        if (line_width > text_max_width) {
-            const char *clip_end = amp_str_seg_skip_wrap(
-                line, line_size, text_max_width
-            );
+    // The view inherits the canvas so that the checks against writing the
+    // output of the conversion functions onto the canvas keep working.
+    amp->canvas = parent->canvas;
+    amp->width = (uint32_t) (x_end - x);
+    amp->height = (uint32_t) (y_end - y);
+    amp->palette = parent->palette;
 
-            const size_t clip_size = (size_t) (clip_end - line);
+    amp->view.parent = parent;
+    amp->view.x = (uint32_t) x;
+    amp->view.y = (uint32_t) y;
 
-            amp_print_line_clip(
-                amp, text_x, text_y + y, text_style, text_alignment,
-                line, clip_size
-            );
+    return true;
+}
 
-            ++y;
-            ++line_count;
+static inline struct amp_row_type amp_read_row(
+    const struct amp_type *amp, long y
+) {
+    struct amp_row_type row = {};
 
-            if (clip_size < line_size) {
-                const char *space_end = amp_str_seg_skip_spaces(
-                    clip_end, amp_sub_size(line_size, clip_size)
-                );
+    if (y < 0 || y >= amp->height) {
+        return row;
+    }
 
-                const size_t space_size = (size_t) (space_end - clip_end);
-                const size_t trail_size = amp_sub_size(
-                    line_size, clip_size + space_size
-                );
+    if (amp->view.parent) {
+        return amp_crop_row(
+            amp_read_row(amp->view.parent, y + amp->view.y), amp->view.x,
+            amp->width
+        );
+    }
 
-                if (trail_size) {
-                    size_t extra_lines = amp_print_text_clip(
-                        amp, text_x, text_y + y, text_style, text_max_width,
-                        text_alignment, space_end, trail_size
-                    );
+    if (amp->cow.parent) {
+        const uint32_t slot = amp->cow.rows[y];
 
-                    y += (long) extra_lines;
-                    line_count += extra_lines;
-                }
-            }
+        if (slot == 0) {
+            return amp_read_row(amp->cow.parent, y);
         }
-        else {
-            amp_print_line_clip(
-                amp, text_x, text_y + y, text_style, text_alignment,
-                line, line_size
-            );
 
-            ++y;
-            ++line_count;
-        }
+        row.size = amp->width;
 
-        if (next_line <= line) {
-            break;
+        if (slot != amp_cow_row_empty) {
+            const size_t first_cell = (size_t) (slot - 1) * amp->width;
+
+            row.glyph = (
+                amp->canvas.glyph.data + first_cell * AMP_CELL_GLYPH_SIZE
+            );
+            row.mode = amp->canvas.mode.data + first_cell * AMP_CELL_MODE_SIZE;
         }
 
-        line = next_line;
+        return row;
     }
 
-    return line_count;
-}
+    const size_t index = amp_canvas_row_index(amp, y);
 
-static inline size_t amp_print_text(
-    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
-    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str
-) {
-    return amp_print_text_clip(
-        amp, text_x, text_y, text_style, text_max_width, text_alignment,
-        text_str, strlen(text_str)
-    );
+    row = amp_canvas_row(amp, index);
+
+    if (amp->lazy.rows && amp->lazy.rows[index] != amp->lazy.epoch) {
+        row.glyph = nullptr; // The row has been cleared lazily.
+        row.mode = nullptr;
+    }
+
+    return row;
 }
 
-static inline ssize_t amp_snprint_linef(
-    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
-    AMP_ALIGN text_alignment, char *buf, size_t buf_size, const char *fmt, ...
+static inline struct amp_row_type amp_write_row(
+    struct amp_type *amp, long y
 ) {
-    va_list args;
-    va_start(args, fmt);
-    int ret = vsnprintf(buf, buf_size, fmt, args);
-    va_end(args);
+    if (y < 0 || y >= amp->height) {
+        return (struct amp_row_type) {};
+    }
 
-    if (ret < 0) {
-        return -1;
+    amp_mark_dirty(amp, y, 1);
+
+    if (amp->cow.refs && !amp_cow_unshare(amp, y)) {
+        // The derived ansmaps must not see the changes made to this row.
+        return (struct amp_row_type) {};
     }
 
-    if ((size_t) ret >= buf_size) {
-        return (ssize_t) ret;
+    if (amp->view.parent) {
+        return amp_crop_row(
+            amp_write_row(amp->view.parent, y + amp->view.y), amp->view.x,
+            amp->width
+        );
     }
 
-    amp_print_line(amp, text_x, text_y, text_style, text_alignment, buf);
+    if (amp->cow.parent && !amp_cow_detach(amp, y)) {
+        return (struct amp_row_type) {};
+    }
 
-    return (ssize_t) ret;
-}
+    const size_t index = amp_canvas_row_index(amp, y);
 
-static inline ssize_t amp_snprint_textf(
-    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
-    uint32_t text_max_width, AMP_ALIGN text_alignment,
-    char *buf, size_t buf_size, const char *fmt, ...
-) {
-    va_list args;
-    va_start(args, fmt);
-    int ret = vsnprintf(buf, buf_size, fmt, args);
-    va_end(args);
+    if (amp->lazy.rows && amp->lazy.rows[index] != amp->lazy.epoch) {
+        amp->lazy.rows[index] = amp->lazy.epoch;
 
-    if (ret < 0) {
-        return -1;
-    }
+        const struct amp_row_type row = amp_canvas_row(amp, index);
 
-    if ((size_t) ret >= buf_size) {
-        return (ssize_t) ret;
+        if (row.size) {
+            memset(row.glyph, 0, row.size * AMP_CELL_GLYPH_SIZE);
+            memset(row.mode, 0, row.size * AMP_CELL_MODE_SIZE);
+        }
+
+        return row;
     }
 
-    amp_print_text(
-        amp, text_x, text_y, text_style, text_max_width, text_alignment, buf
-    );
+    return amp_read_row(amp, y);
+}
 
-    return (ssize_t) ret;
+static inline size_t amp_canvas_row_index(const struct amp_type *amp, long y) {
+    const size_t index = (size_t) y + amp->canvas.row_offset;
+
+    return index >= amp->height ? index - amp->height : index;
 }
 
-static inline ssize_t amp_snprint_rich_textf(
-    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
-    uint32_t text_max_width, AMP_ALIGN text_alignment,
-    char *buf, size_t buf_size, const char *fmt, ...
+static inline void amp_mark_dirty(
+    struct amp_type *amp, long y, uint32_t row_count
 ) {
-    va_list args;
-    va_start(args, fmt);
-    int ret = vsnprintf(buf, buf_size, fmt, args);
-    va_end(args);
-
-    if (ret < 0) {
-        return -1;
+    if (amp->dirty.rows) {
+        memset(amp->dirty.rows + y, 1, row_count);
     }
+}
 
-    if ((size_t) ret >= buf_size) {
-        return (ssize_t) ret;
+#ifndef AMP_NO_THREADS
+static inline uint32_t amp_get_bands(
+    const struct amp_type *amp, long y, uint32_t row_count, uint32_t *first
+) {
+    long src_y = y;
+    long length = row_count;
+
+    if (!amp->band.locks
+    || !amp_clip_span(&y, amp->height, &src_y, amp->height, &length)) {
+        return 0;
     }
 
-    amp_print_rich_text(
-        amp, text_x, text_y, text_style, text_max_width, text_alignment, buf
-    );
+    const uint32_t last = (uint32_t) (y + length - 1) / amp->band.rows;
 
-    return (ssize_t) ret;
+    *first = (uint32_t) y / amp->band.rows;
+
+    return last - *first + 1;
 }
+#endif
 
-static inline size_t amp_print_rich_text(
-    struct amp_type *amp, long text_x, long text_y, AMP_STYLE style,
-    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str
+static inline struct amp_row_type amp_canvas_row(
+    const struct amp_type *amp, size_t index
 ) {
-    return amp_print_rich_text_clip(
-        amp, text_x, text_y, &style, text_max_width, text_alignment,
-        text_str, strlen(text_str)
-    );
+    const size_t first_cell = index * amp->width;
+    const size_t cell_count = amp->canvas.glyph.size / AMP_CELL_GLYPH_SIZE;
+
+    if (first_cell >= cell_count) {
+        return (struct amp_row_type) {}; // The row is cut off from the canvas.
+    }
+
+    return (struct amp_row_type) {
+        .glyph = amp->canvas.glyph.data + first_cell * AMP_CELL_GLYPH_SIZE,
+        .mode = amp->canvas.mode.data + first_cell * AMP_CELL_MODE_SIZE,
+        .size = (
+            cell_count - first_cell < amp->width ?
+            (uint32_t) (cell_count - first_cell) : amp->width
+        )
+    };
 }
 
-static inline size_t amp_str_append(
-    char *str_dst, size_t str_dst_size, const char *str_src
+static inline struct amp_row_type amp_crop_row(
+    struct amp_row_type row, uint32_t x, uint32_t width
 ) {
-    const size_t str_src_size = strlen(str_src);
+    if (row.size <= x) {
+        return (struct amp_row_type) {};
+    }
 
-    if (str_src_size >= str_dst_size) {
-        // No space for the terminating zero.
+    row.size -= x;
+    row.size = row.size < width ? row.size : width;
 
-        if (str_dst_size) {
-            *str_dst = '\0';
-        }
-    }
-    else {
-        memcpy(str_dst, str_src, str_src_size + 1);
+    if (row.glyph) {
+        row.glyph += (size_t) x * AMP_CELL_GLYPH_SIZE;
+        row.mode += (size_t) x * AMP_CELL_MODE_SIZE;
     }
 
-    return (
-        // The number of characters that would have been written if
-        // str_dst_size had been sufficiently large, not counting the
-        // terminating null character.
-        str_src_size
-    );
+    return row;
 }
 
-static inline struct amp_mode_code_type amp_mode_to_codes(
-    struct amp_mode_type mode, AMP_PALETTE pal
-) {
-    const struct {
-        uint8_t code;
-        bool    enabled;
-    } styles[] = {
-        { 8, mode.bitset.hidden        },
-        { 2, mode.bitset.faint         },
-        { 3, mode.bitset.italic        },
-        { 4, mode.bitset.underline     },
-        { 5, mode.bitset.blinking      },
-        { 9, mode.bitset.strikethrough }
-    };
+static inline bool amp_cow_detach(struct amp_type *amp, long y) {
+    const uint32_t slot = amp->cow.rows[y];
 
-    struct amp_mode_code_type codes = {};
+    if (slot != 0 && slot != amp_cow_row_empty) {
+        return true;
+    }
 
-    for (size_t i=0; i<sizeof(styles)/sizeof(styles[0]); ++i) {
-        auto const value = styles[i];
+    if (amp->cow.used >= amp->cow.capacity) {
+        return false;
+    }
 
-        if (!value.enabled) {
-            continue;
-        }
+    const size_t first_cell = (size_t) amp->cow.used * amp->width;
+    uint8_t *glyph = amp->canvas.glyph.data + first_cell * AMP_CELL_GLYPH_SIZE;
+    uint8_t *mode = amp->canvas.mode.data + first_cell * AMP_CELL_MODE_SIZE;
+    size_t copied = 0;
 
-        codes.style.data[codes.style.size++] = value.code;
-    }
+    if (slot == 0) {
+        const struct amp_row_type src = amp_read_row(amp->cow.parent, y);
 
-    if (pal == AMP_PAL_24BIT) {
-        if (mode.bitset.fg) {
-            codes.color.fg.data[codes.color.fg.size++] = 38;
-            codes.color.fg.data[codes.color.fg.size++] = 2;
-            codes.color.fg.data[codes.color.fg.size++] = mode.fg.r;
-            codes.color.fg.data[codes.color.fg.size++] = mode.fg.g;
-            codes.color.fg.data[codes.color.fg.size++] = mode.fg.b;
+        if (src.glyph) {
+            copied = src.size < amp->width ? src.size : amp->width;
+            memcpy(glyph, src.glyph, copied * AMP_CELL_GLYPH_SIZE);
+            memcpy(mode, src.mode, copied * AMP_CELL_MODE_SIZE);
         }
 
-        if (mode.bitset.bg) {
-            codes.color.bg.data[codes.color.bg.size++] = 48;
-            codes.color.bg.data[codes.color.bg.size++] = 2;
-            codes.color.bg.data[codes.color.bg.size++] = mode.bg.r;
-            codes.color.bg.data[codes.color.bg.size++] = mode.bg.g;
-            codes.color.bg.data[codes.color.bg.size++] = mode.bg.b;
-        }
+        --amp->cow.parent->cow.refs;
     }
-    else {
-        if (mode.bitset.bg) {
-            struct amp_color_type bg_color_row = amp_find_color(mode.bg);
-
-            if (bg_color_row.bitset.bright) {
-                struct amp_rgb_type buf = mode.bg;
-                mode.bg = mode.fg;
-                mode.fg = buf;
-                mode.bitset.bg = mode.bitset.fg;
-                mode.bitset.fg = true;
 
-                codes.style.data[codes.style.size++] = 7; // inverse video
-            }
-        }
+    memset(
+        glyph + copied * AMP_CELL_GLYPH_SIZE, 0,
+        (amp->width - copied) * AMP_CELL_GLYPH_SIZE
+    );
+    memset(
+        mode + copied * AMP_CELL_MODE_SIZE, 0,
+        (amp->width - copied) * AMP_CELL_MODE_SIZE
+    );
 
-        if (mode.bitset.fg) {
-            auto fg_color_row = amp_find_color(mode.fg);
+    amp->cow.rows[y] = ++amp->cow.used;
 
-            if (fg_color_row.bitset.bright) {
-                codes.style.data[codes.style.size++] = 1; // bold foreground
-            }
+    return true;
+}
 
-            codes.color.fg.data[codes.color.fg.size++] = fg_color_row.code.fg;
+static inline bool amp_cow_unshare(struct amp_type *amp, long y) {
+    // The row is given away only if every derived ansmap that shares it has
+    // room for a private copy. Otherwise the row must be left unmodified.
+    for (struct amp_type *c = amp->cow.child; c; c = c->cow.sibling) {
+        if (c->cow.rows[y] == 0 && c->cow.used >= c->cow.capacity) {
+            return false;
         }
+    }
 
-        if (mode.bitset.bg) {
-            struct amp_color_type bg_color_row = amp_find_color(mode.bg);
-
-            codes.color.bg.data[codes.color.bg.size++] = bg_color_row.code.bg;
+    for (struct amp_type *c = amp->cow.child; c; c = c->cow.sibling) {
+        if (c->cow.rows[y] == 0) {
+            amp_cow_detach(c, y);
         }
     }
 
-    return codes;
+    return true;
 }
 
-static inline struct amp_mode_code_type amp_mode_code_update(
-    struct amp_mode_code_type next_codes, struct amp_mode_code_type prev_codes
-) {
-    struct amp_mode_code_type codes = {};
+static inline uint32_t amp_get_width(const struct amp_type *amp) {
+    return amp->width;
+}
 
-    do {
-        const uint8_t n_fg = next_codes.color.fg.size;
-        const uint8_t n_bg = next_codes.color.bg.size;
+static inline uint32_t amp_get_height(const struct amp_type *amp) {
+    return amp->height;
+}
 
-        if (n_fg) {
-            uint8_t *prev_fg_data = prev_codes.color.fg.data;
-            uint8_t *next_fg_data = next_codes.color.fg.data;
+static inline AMP_PALETTE amp_get_palette(const struct amp_type *amp) {
+    return amp->palette;
+}
 
-            if (prev_codes.color.fg.size && n_fg != prev_codes.color.fg.size) {
-                // Color palette has changed. Full reset is needed.
-                break;
-            }
+static inline void amp_set_palette(struct amp_type *amp, AMP_PALETTE palette) {
+    amp->palette = palette;
+}
 
-            if (n_fg != prev_codes.color.fg.size
-            || memcmp(next_fg_data, prev_fg_data, n_fg)) {
-                memcpy(codes.color.fg.data, next_fg_data, n_fg);
-                codes.color.fg.size = n_fg;
-            }
-        }
-        else if (prev_codes.color.fg.size) {
-            // Foreground color is no longer set. Full reset is needed.
-            break;
-        }
+static inline int amp_utf8_code_point_size(const char *str, size_t n) {
+    uint8_t *s = (uint8_t *) str;
 
-        if (n_bg) {
-            uint8_t *prev_bg_data = prev_codes.color.bg.data;
-            uint8_t *next_bg_data = next_codes.color.bg.data;
+    if (n > 0) {
+        uint8_t c = *s;
 
-            if (prev_codes.color.bg.size && n_bg != prev_codes.color.bg.size) {
-                // Color palette has changed. Full reset is needed.
-                break;
-            }
+        if (c < 0x80) {
+            return (c != 0 ? 1 : 0);
+        }
 
-            if (n_bg != prev_codes.color.bg.size
-            || memcmp(next_bg_data, prev_bg_data, n_bg)) {
-                memcpy(codes.color.bg.data, next_bg_data, n_bg);
-                codes.color.bg.size = n_bg;
+        if (c >= 0xc2) {
+            if (c < 0xe0) {
+                if (n >= 2 && (s[1] ^ 0x80) < 0x40) {
+                    return 2;
+                }
+            }
+            else if (c < 0xf0) {
+                if (n >= 3
+                && (s[1] ^ 0x80) < 0x40
+                && (s[2] ^ 0x80) < 0x40
+                && (c >= 0xe1 || s[1] >= 0xa0)
+                && (c != 0xed || s[1] < 0xa0)) {
+                    return 3;
+                }
+            }
+            else if (c < 0xf8) {
+                if (n >= 4
+                && (s[1] ^ 0x80) < 0x40
+                && (s[2] ^ 0x80) < 0x40
+                && (s[3] ^ 0x80) < 0x40
+                && (c >= 0xf1 || s[1] >= 0x90)
+                && (c < 0xf4 || (c == 0xf4 && s[1] < 0x90))) {
+                    return 4;
+                }
             }
         }
-        else if (prev_codes.color.bg.size) {
-            // Background color is no longer set. Full reset is needed.
+    }
+
+    return -1; // invalid or incomplete multibyte character
+}
+
+static inline size_t amp_utf8_ascii_span(
+    const char *utf8_str, size_t utf8_str_size
+) {
+    // Returns the length of the leading run of whole blocks that consist only
+    // of non-zero ASCII characters. Each of them is a valid code point of its
+    // own, so they can be counted without decoding. The rest of the string is
+    // left for the scalar decoder.
+    size_t span = 0;
+
+#if defined(__AVX2__)
+    for (; utf8_str_size - span >= 32; span += 32) {
+        const __m256i block = _mm256_loadu_si256(
+            (const __m256i *) (const void *) (utf8_str + span)
+        );
+
+        const __m256i zero = _mm256_cmpeq_epi8(block, _mm256_setzero_si256());
+
+        if (_mm256_movemask_epi8(_mm256_or_si256(block, zero))) {
             break;
         }
+    }
+#endif
 
-        // First, let's see if any of the style codes has gone missing.
-        bool missing = false;
-
-        for (size_t i=0; i<prev_codes.style.size; ++i) {
-            bool found = false;
+#if defined(__SSE2__)
+    for (; utf8_str_size - span >= 16; span += 16) {
+        const __m128i block = _mm_loadu_si128(
+            (const __m128i *) (const void *) (utf8_str + span)
+        );
 
-            for (size_t j=0; j<next_codes.style.size; ++j) {
-                if (next_codes.style.data[j] == prev_codes.style.data[i]) {
-                    found = true;
-                    break;
-                }
-            }
+        const __m128i zero = _mm_cmpeq_epi8(block, _mm_setzero_si128());
 
-            if (!found) {
-                missing = true;
-                break;
-            }
+        if (_mm_movemask_epi8(_mm_or_si128(block, zero))) {
+            break;
         }
+    }
+#endif
 
-        if (missing) {
-            // A style code is no longer present. Full reset is needed.
+    for (; utf8_str_size - span >= sizeof(uint64_t); span += sizeof(uint64_t)) {
+        uint64_t block;
+
+        memcpy(&block, utf8_str + span, sizeof(block));
+
+        // Adding 0x7f to the low 7 bits of a byte leaves its high bit clear
+        // only for zero and 0x80, without carrying over to the next byte. The
+        // bytes from 0x80 upwards are caught by their own high bit.
+        const uint64_t low = 0x7f7f7f7f7f7f7f7full;
+        const uint64_t invalid = (~((block & low) + low) | block) & ~low;
+
+        if (invalid) {
             break;
         }
+    }
 
-        for (size_t i=0; i<next_codes.style.size; ++i) {
-            bool found = false;
+    return span;
+}
 
-            for (size_t j=0; j<prev_codes.style.size; ++j) {
-                if (prev_codes.style.data[j] == next_codes.style.data[i]) {
-                    found = true;
-                    break;
-                }
-            }
+static inline size_t amp_utf8_width(
+    const char *utf8_str, size_t utf8_str_size
+) {
+    // Counts the terminal columns that the code points take up. The leading
+    // runs of ASCII characters are measured a block at a time with the
+    // amp_utf8_ascii_span function, one column for each of their bytes.
+    size_t width = 0;
 
-            if (!found) {
-                codes.style.data[codes.style.size++] = next_codes.style.data[i];
+    for (const char *s = utf8_str; *s;) {
+        const size_t n = amp_sub_size(utf8_str_size, (size_t) (s - utf8_str));
+
+        if ((uint8_t) *s < 0x80) {
+            size_t span = amp_utf8_ascii_span(s, n);
+
+            if (span) {
+                width += span;
+                s += span;
+                continue;
             }
         }
 
-        return codes;
-    } while (false);
+        int cpsz = amp_utf8_code_point_size(s, n);
 
-    codes = next_codes;
-    codes.bitset.reset = true;
+        if (cpsz < 0) {
+            break;
+        }
 
-    return codes;
+        width += (size_t) amp_utf8_glyph_cells(s, (size_t) cpsz);
+        s += cpsz;
+    }
+
+    return width;
 }
 
-static inline size_t amp_mode_codes_to_ans(
-    struct amp_mode_code_type codes, char *ans_dst, size_t ans_dst_size
+static inline int amp_utf8_glyph_cells(
+    const char *utf8_str, size_t utf8_str_size
 ) {
-    char ans[256];
-    size_t ans_size = 0;
-
-    if (codes.bitset.reset) {
-        ans_size += (
-            ans_size ? amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-            ) : 0
+    // The glyphs that the terminals draw narrower than a cell still take one.
+    const uint8_t *s = (const uint8_t *) utf8_str;
+    const int cpsz = amp_utf8_code_point_size(utf8_str, utf8_str_size);
+    uint32_t code_point = 0;
+
+    if (cpsz == 3) {
+        code_point = (
+            (uint32_t) (s[0] & 0x0f) << 12 |
+            (uint32_t) (s[1] & 0x3f) << 6 |
+            (uint32_t) (s[2] & 0x3f)
         );
-
-        ans_size += amp_str_append(
-            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-            amp_number_table[0]
+    }
+    else if (cpsz == 4) {
+        code_point = (
+            (uint32_t) (s[0] & 0x07) << 18 |
+            (uint32_t) (s[1] & 0x3f) << 12 |
+            (uint32_t) (s[2] & 0x3f) << 6 |
+            (uint32_t) (s[3] & 0x3f)
         );
     }
+    else {
+        return 1; // No code point below U+0800 is wide.
+    }
 
-    for (size_t i=0; i<codes.style.size; ++i) {
-        ans_size += (
-            ans_size ? amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-            ) : 0
-        );
+    return amp_code_point_width(code_point) == 2 ? 2 : 1;
+}
 
-        ans_size += amp_str_append(
-            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-            amp_number_table[codes.style.data[i]]
+static inline int amp_code_point_width(uint32_t code_point) {
+    if (code_point < 0x20000) {
+        const uint8_t chunk = amp_width_chunk_table[
+            amp_width_block_table[code_point >> 8] * 16 +
+            ((code_point >> 4) & 0xf)
+        ];
+
+        return (int) (
+            (amp_width_bits_table[chunk] >> ((code_point & 0xf) * 2)) & 3
         );
     }
 
-    for (size_t i=0; i<codes.color.fg.size; ++i) {
-        ans_size += (
-            ans_size ? amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-            ) : 0
-        );
+    if (code_point <= 0x3fffd) {
+        return 2; // The supplementary and tertiary ideographic planes.
+    }
 
-        ans_size += amp_str_append(
-            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-            amp_number_table[codes.color.fg.data[i]]
-        );
+    if (code_point == 0xe0001
+    || (code_point >= 0xe0020 && code_point <= 0xe007f)
+    || (code_point >= 0xe0100 && code_point <= 0xe01ef)) {
+        return 0; // The tags and the variation selectors supplement.
     }
 
-    for (size_t i=0; i<codes.color.bg.size; ++i) {
-        ans_size += (
-            ans_size ? amp_str_append(
-                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
-            ) : 0
-        );
+    return 1;
+}
 
-        ans_size += amp_str_append(
-            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
-            amp_number_table[codes.color.bg.data[i]]
-        );
-    }
+static inline bool amp_is_glyph_tail(const char *glyph) {
+    return glyph && *glyph == *amp_glyph_tail;
+}
 
-    size_t written = 0;
+static inline bool amp_has_glyph_tail(
+    const struct amp_type *amp, long x, long y
+) {
+    const char *glyph = amp_get_glyph(amp, x, y);
 
-    if (ans_size) {
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), AMP_ESC "["
-        );
+    return (
+        glyph && amp_utf8_glyph_cells(glyph, AMP_CELL_GLYPH_SIZE) > 1 &&
+        amp_is_glyph_tail(amp_get_glyph(amp, x + 1, y))
+    );
+}
 
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), ans
-        );
+static inline const char *amp_get_glyph(
+    const struct amp_type *amp, long x, long y
+) {
+    const struct amp_row_type row = amp_read_row(amp, y);
 
-        written += amp_str_append(
-            ans_dst + written, amp_sub_size(ans_dst_size, written), "m"
-        );
+    if (x < 0 || x >= row.size) {
+        return nullptr;
     }
 
-    if (written >= ans_dst_size || !written) {
-        if (ans_dst_size) {
-            *ans_dst = '\0';
-        }
+    if (!row.glyph) {
+        return "";
     }
 
-    return written;
+    return (const char *) row.glyph + (size_t) x * AMP_CELL_GLYPH_SIZE;
 }
 
-static inline ssize_t amp_stdout(const char *str_src, size_t str_src_size) {
-    size_t n = 0;
-
-    for (; n < str_src_size;) {
-        ssize_t written = write(STDOUT_FILENO, str_src + n, str_src_size - n);
+static inline ssize_t amp_copy_glyph(
+    const struct amp_type *amp, long x, long y,
+    uint8_t *glyph_dst, size_t glyph_dst_size
+) {
+    const char *glyph = amp_get_glyph(amp, x, y);
 
-        if (written <= 0) {
-            break;
+    if (!glyph) {
+        if (glyph_dst_size) {
+            *glyph_dst = 0;
         }
 
-        n += (size_t) written;
+        return -1;
     }
 
-    return n == str_src_size ? (ssize_t) n : -1;
-}
+    const size_t glyph_length = strlen(glyph);
 
-static inline ssize_t amp_clip_to_ans(
-    const struct amp_type *amp, long x, long y, uint32_t width,
-    char *ans_dst, size_t ans_dst_size
-) {
-    if ((ans_dst >= (char *) amp->canvas.glyph.data
-      && ans_dst <  (char *) amp->canvas.glyph.data + amp->canvas.glyph.size)
-    ||  (ans_dst >= (char *) amp->canvas.mode.data
-      && ans_dst <  (char *) amp->canvas.mode.data + amp->canvas.mode.size)) {
-        abort(); // Overwriting its own memory is a fatal error.
+    if (glyph_length >= glyph_dst_size || !glyph_length) {
+        if (glyph_dst_size) {
+            *glyph_dst = 0;
+        }
+    }
+    else {
+        memcpy(glyph_dst, glyph, glyph_length + 1);
     }
 
-    const bool ans_to_stdout = (
-        ans_dst == (char *) amp->buffer + sizeof(amp->buffer)
-    );
-
-    const uint32_t amp_width = amp->width;
-    const long end_x = (
-        width ? (x + width > amp_width ? amp_width : x + width) : amp_width
+    return (
+        // The number of characters that would have been written if
+        // glyph_dst_size had been sufficiently large, not counting the
+        // terminating null character.
+        (ssize_t) glyph_length
     );
+}
 
-    char glyph_data[AMP_CELL_GLYPH_SIZE];
-    char mode_ans[256];
-    struct amp_mode_code_type prev_mode_codes = {};
-    size_t ans_size = 0;
+static inline const char *amp_put_glyph(
+    struct amp_type *amp, long x, long y, const char *glyph
+) {
+    // If glyph contains multiple UTF8 code points, then use only the first one.
 
-    for (; x < end_x; ++x) {
-        auto next_mode_codes = amp_mode_to_codes(
-            amp_get_mode(amp, x, y), amp->palette
-        );
+    if (x < 0 || x >= amp->width) {
+        return nullptr;
+    }
 
-        auto add_mode_codes = amp_mode_code_update(
-            next_mode_codes, prev_mode_codes
-        );
+    uint8_t glyph_data[AMP_CELL_GLYPH_SIZE];
+    uint8_t glyph_data_size = 0;
 
-        prev_mode_codes = next_mode_codes;
+    for (; glyph_data_size < sizeof(glyph_data); ++glyph_data_size) {
+        glyph_data[glyph_data_size] = (uint8_t) glyph[glyph_data_size];
 
-        const size_t mode_ans_size = amp_mode_codes_to_ans(
-            add_mode_codes, mode_ans, sizeof(mode_ans)
-        );
-
-        if (mode_ans_size >= sizeof(mode_ans)) {
-            abort(); // The mode_ans buffer should fit any mode.
+        if (glyph_data[glyph_data_size] == 0) {
+            break;
         }
-        else if (mode_ans_size) {
-            if (ans_to_stdout) {
-                if (amp_stdout(mode_ans, mode_ans_size) < 0) {
-                    return -1;
-                }
+    }
 
-                ans_size += mode_ans_size;
-            }
-            else {
-                ans_size += amp_str_append(
-                    ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
-                    mode_ans
-                );
-            }
-        }
+    int code_point_size = amp_utf8_code_point_size(
+        (const char *) glyph_data, glyph_data_size
+    );
 
-        const ssize_t glyph_size = amp_copy_glyph(
-            amp, x, y, (uint8_t *) glyph_data, sizeof(glyph_data)
-        );
+    if (code_point_size < 0 || (size_t) code_point_size >= sizeof(glyph_data)) {
+        return nullptr;
+    }
 
-        if (glyph_size <= 0
-        ||  glyph_size >= (ssize_t) sizeof(glyph_data)
-        || (glyph_size == 1 && !isprint(*glyph_data))) {
-            const char *space = " ";
-            const size_t space_size = strlen(space);
+    glyph_data[code_point_size] = 0;
+    glyph_data_size = (uint8_t) code_point_size;
 
-            if (ans_to_stdout) {
-                if (amp_stdout(space, space_size) < 0) {
-                    return -1;
-                }
+    const struct amp_row_type row = amp_write_row(amp, y);
 
-                ans_size += space_size;
-            }
-            else {
-                ans_size += amp_str_append(
-                    ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
-                    space
-                );
-            }
+    if (x >= row.size) {
+        return nullptr;
+    }
 
-            continue;
-        }
+    char *dst = (char *) row.glyph + (size_t) x * AMP_CELL_GLYPH_SIZE;
 
-        if (ans_to_stdout) {
-            if (amp_stdout(glyph_data, (size_t) glyph_size) < 0) {
-                return -1;
-            }
+    memcpy(dst, glyph_data, glyph_data_size + 1);
 
-            ans_size += (size_t) glyph_size;
-        }
-        else {
-            ans_size += amp_str_append(
-                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
-                glyph_data
-            );
-        }
+    if (x + 1 < row.size
+    && amp_utf8_glyph_cells(dst, glyph_data_size) > 1) {
+        memcpy(dst + AMP_CELL_GLYPH_SIZE, amp_glyph_tail, AMP_CELL_GLYPH_SIZE);
     }
 
-    if (prev_mode_codes.style.size
-    ||  prev_mode_codes.color.bg.size
-    ||  prev_mode_codes.color.fg.size) {
-        const char *esc_reset = AMP_ESC "[0m";
-        const size_t esc_reset_size = strlen(esc_reset);
-
-        if (ans_to_stdout) {
-            if (amp_stdout(esc_reset, strlen(esc_reset)) < 0) {
-                return -1;
-            }
+    return dst;
+}
 
-            ans_size += esc_reset_size;
-        }
-        else {
-            ans_size += amp_str_append(
-                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
-                esc_reset
-            );
+static inline bool amp_set_mode(
+    struct amp_type *amp, long x, long y, struct amp_mode_type mode
+) {
+    uint8_t *mode_data = amp_get_mutable_mode_data(amp, x, y);
 
-            if (ans_size >= ans_dst_size || !ans_size) {
-                if (ans_dst_size) {
-                    *ans_dst = '\0';
-                }
-            }
-        }
+    if (!mode_data) {
+        return false;
     }
 
-    return (
-        // The number of characters that would have been written if
-        // ans_dst_size had been sufficiently large, not counting the
-        // terminating null character.
-        ans_size > SSIZE_MAX ? -1 : (ssize_t) ans_size
-    );
+    return amp_mode_cell_serialize(mode, mode_data, AMP_CELL_MODE_SIZE);
 }
 
-static inline ssize_t amp_row_to_ans(
-    const struct amp_type *amp, long y, char *ans_dst, size_t ans_dst_size
+static inline struct amp_mode_type amp_get_mode(
+    const struct amp_type *amp, long x, long y
 ) {
-    return (
-        // The number of characters that would have been written if
-        // ans_dst_size had been sufficiently large, not counting the
-        // terminating null character. Returns -1 on error.
-        amp_clip_to_ans(amp, 0, y, amp->width, ans_dst, ans_dst_size)
-    );
-}
+    static const struct amp_mode_type broken_cell = {
+        .bitset = { .broken = true }
+    };
 
-static inline size_t amp_sub_size(size_t a, size_t b) {
-    size_t result;
-    return ckd_sub(&result, a, b) ? 0 : result;
+    const uint8_t *mode_data = amp_get_mode_data(amp, x, y);
+
+    if (!mode_data) {
+        return broken_cell;
+    }
+
+    return amp_mode_cell_deserialize(mode_data, AMP_CELL_MODE_SIZE);
 }
 
-static inline ssize_t amp_to_ans(
-    const struct amp_type *amp, char *ans_dst, size_t ans_dst_size
+static inline const uint8_t *amp_get_mode_data(
+    const struct amp_type *amp, long x, long y
 ) {
-    if (ans_dst == nullptr) {
-        ans_dst = (char *) amp->buffer + sizeof(amp->buffer);
-        ans_dst_size = 0;
+    static const uint8_t empty_mode[AMP_CELL_MODE_SIZE];
+    const struct amp_row_type row = amp_read_row(amp, y);
+
+    if (x < 0 || x >= row.size) {
+        return nullptr;
     }
-    else {
-        uint8_t *dst = (uint8_t *) ans_dst;
 
-        if ((dst >= amp->canvas.glyph.data
-          && dst <  amp->canvas.glyph.data + amp->canvas.glyph.size)
-        ||  (dst >= amp->canvas.mode.data
-          && dst <  amp->canvas.mode.data + amp->canvas.mode.size)) {
-            abort(); // Overwriting its own memory is a fatal error.
-        }
+    if (!row.mode) {
+        return empty_mode;
     }
 
-    const bool ans_to_stdout = (
-        ans_dst == (char *) amp->buffer + sizeof(amp->buffer)
-    );
+    return row.mode + (size_t) x * AMP_CELL_MODE_SIZE;
+}
 
-    size_t ans_size = 0;
+static inline uint8_t *amp_get_mutable_mode_data(
+    struct amp_type *amp, long x, long y
+) {
+    if (x < 0 || x >= amp->width) {
+        return nullptr;
+    }
 
-    for (uint32_t y = 0; y < amp->height; ++y) {
-        ssize_t size = amp_row_to_ans(
-            amp, y, ans_to_stdout ? ans_dst : ans_dst + ans_size,
-            amp_sub_size(ans_dst_size, ans_size)
-        );
+    const struct amp_row_type row = amp_write_row(amp, y);
 
-        if (size < 0) {
-            return -1;
-        }
+    if (x >= row.size) {
+        return nullptr;
+    }
 
-        ans_size += (size_t) size;
+    return row.mode + (size_t) x * AMP_CELL_MODE_SIZE;
+}
 
-        if (y + 1 < amp->height) {
-            const char *crlf = "\r\n";
-            const size_t crlf_size = strlen(crlf);
+static inline AMP_STYLE amp_get_style(
+    const struct amp_type *amp, long x, long y
+) {
+    const uint8_t *mode_data = amp_get_mode_data(amp, x, y);
 
-            if (ans_to_stdout) {
-                if (amp_stdout(crlf, crlf_size) < 0) {
-                    return -1;
-                }
+    if (!mode_data) {
+        return AMP_STYLE_NONE;
+    }
 
-                ans_size += crlf_size;
-            }
-            else {
-                ans_size += amp_str_append(
-                    ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
-                    crlf
-                );
-            }
+    return amp_mode_style(mode_data);
+}
+
+static inline AMP_STYLE amp_mode_style(const uint8_t *mode_data) {
+    AMP_STYLE style = AMP_STYLE_NONE;
+    auto mode = amp_mode_cell_deserialize(mode_data, AMP_CELL_MODE_SIZE);
+
+    if (mode.bitset.bg) {
+        auto const combo = amp_lookup_color_combo(mode.bg);
+
+        for (size_t i=0; i<amp_color_combo_size && combo.colors[i]; ++i) {
+            style |= amp_lookup_color(combo.colors[i]).style.bg;
         }
     }
 
-    if (!ans_to_stdout) {
-        if (ans_size >= ans_dst_size || !ans_size) {
-            if (ans_dst_size) {
-                *ans_dst = '\0';
-            }
+    if (mode.bitset.fg) {
+        auto const combo = amp_lookup_color_combo(mode.fg);
+
+        for (size_t i=0; i<amp_color_combo_size && combo.colors[i]; ++i) {
+            style |= amp_lookup_color(combo.colors[i]).style.fg;
         }
     }
 
-    return ans_size > SSIZE_MAX ? -1 : (ssize_t) ans_size;
+    return (
+        (mode.bitset.hidden         ? AMP_HIDDEN        : 0) |
+        (mode.bitset.faint          ? AMP_FAINT         : 0) |
+        (mode.bitset.italic         ? AMP_ITALIC        : 0) |
+        (mode.bitset.underline      ? AMP_UNDERLINE     : 0) |
+        (mode.bitset.blinking       ? AMP_BLINKING      : 0) |
+        (mode.bitset.strikethrough  ? AMP_STRIKETHROUGH : 0) | style
+    );
 }
 
-static inline struct amp_mode_type amp_mode_cell_deserialize(
-    const uint8_t *data, size_t data_size
+static inline AMP_STYLE amp_get_cached_style(
+    const struct amp_type *amp, struct amp_style_cache_type *cache, long x,
+    long y
 ) {
-    return (struct amp_mode_type) {
-        .fg = {
-            .r = data_size > 0 ? data[0] : 0,
-            .g = data_size > 1 ? data[1] : 0,
-            .b = data_size > 2 ? data[2] : 0
-        },
-        .bg = {
-            .r = data_size > 3 ? data[3] : 0,
-            .g = data_size > 4 ? data[4] : 0,
-            .b = data_size > 5 ? data[5] : 0
-        },
-        .bitset = {
-            .fg             = data_size > 6 ? data[6] & (1 << 0) : 0,
-            .bg             = data_size > 6 ? data[6] & (1 << 1) : 0,
-            .hidden         = data_size > 6 ? data[6] & (1 << 2) : 0,
-            .faint          = data_size > 6 ? data[6] & (1 << 3) : 0,
-            .italic         = data_size > 6 ? data[6] & (1 << 4) : 0,
-            .underline      = data_size > 6 ? data[6] & (1 << 5) : 0,
-            .blinking       = data_size > 6 ? data[6] & (1 << 6) : 0,
-            .strikethrough  = data_size > 6 ? data[6] & (1 << 7) : 0,
-            .broken         = data_size < AMP_CELL_MODE_SIZE
-        }
-    };
+    const uint8_t *mode_data = amp_get_mode_data(amp, x, y);
+    uint64_t key = 0;
+
+    if (!mode_data) {
+        return AMP_STYLE_NONE;
+    }
+
+    // The last byte of the mode is not a part of the style, so it is replaced
+    // by a marker that keeps the keys of the used cache entries nonzero.
+    for (size_t i = 0; i < AMP_CELL_MODE_SIZE - 1; ++i) {
+        key = (key << 8) | mode_data[i];
+    }
+
+    key = (key << 8) | 1;
+
+    auto const entry = &cache->entry[
+        (key * 0x9E3779B97F4A7C15ULL) >> (
+            64 - stdc_trailing_zeros_ull(amp_style_cache_size)
+        )
+    ];
+
+    if (entry->key != key) {
+        entry->key = key;
+        entry->style = amp_mode_style(mode_data);
+    }
+
+    return entry->style;
 }
 
-static inline bool amp_mode_cell_serialize(
-    struct amp_mode_type cell, uint8_t *dst, size_t dst_size
+static inline bool amp_put_style(
+    struct amp_type *amp, long x, long y, AMP_STYLE style
 ) {
-    if (dst_size < AMP_CELL_MODE_SIZE) {
+    uint8_t *mode = amp_get_mutable_mode_data(amp, x, y);
+    uint8_t set[AMP_CELL_MODE_SIZE];
+    uint8_t keep[AMP_CELL_MODE_SIZE];
+
+    if (!mode) {
         return false;
     }
 
-    dst[0] = cell.fg.r;
-    dst[1] = cell.fg.g;
-    dst[2] = cell.fg.b;
-    dst[3] = cell.bg.r;
-    dst[4] = cell.bg.g;
-    dst[5] = cell.bg.b;
-    dst[6] = (
-        (cell.bitset.fg             ? (1 << 0) : 0) |
-        (cell.bitset.bg             ? (1 << 1) : 0) |
-        (cell.bitset.hidden         ? (1 << 2) : 0) |
-        (cell.bitset.faint          ? (1 << 3) : 0) |
-        (cell.bitset.italic         ? (1 << 4) : 0) |
-        (cell.bitset.underline      ? (1 << 5) : 0) |
-        (cell.bitset.blinking       ? (1 << 6) : 0) |
-        (cell.bitset.strikethrough  ? (1 << 7) : 0)
-    );
-    dst[7] = 0; // temporarily used when decoding style layers
+    amp_style_mode_mask(style, amp_all_styles, set, keep);
+
+    for (size_t i = 0; i < AMP_CELL_MODE_SIZE; ++i) {
+        mode[i] = (uint8_t) ((mode[i] & keep[i]) | set[i]);
+    }
 
     return true;
 }
 
-static inline struct amp_color_type amp_find_color(struct amp_rgb_type rgb) {
-    long best_d = LONG_MAX;
-    size_t best_row = 0;
+static inline bool amp_set_bg_color(
+    struct amp_type *amp, long x, long y, struct amp_rgb_type bg_color
+) {
+    auto mode = amp_get_mode(amp, x, y);
 
-    for (size_t i=0; i<AMP_MAX_COLOR; ++i) {
-        auto const row = amp_color_table[i];
+    mode.bg = bg_color;
+    mode.bitset.bg = true;
 
-        if (row.index == AMP_COLOR_NONE) {
-            continue;
-        }
+    return amp_set_mode(amp, x, y, mode);
+}
 
-        long dr = rgb.r - row.rgb.r;
-        long dg = rgb.g - row.rgb.g;
-        long db = rgb.b - row.rgb.b;
-        long d = 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+static inline struct amp_rgb_type amp_get_bg_color(
+    struct amp_type *amp, long x, long y
+) {
+    return amp_get_mode(amp, x, y).bg;
+}
 
-        if (d < best_d) {
-            best_d = d;
-            best_row = i;
-        }
+static inline bool amp_set_fg_color(
+    struct amp_type *amp, long x, long y, struct amp_rgb_type fg_color
+) {
+    auto mode = amp_get_mode(amp, x, y);
+
+    mode.fg = fg_color;
+    mode.bitset.fg = true;
+
+    return amp_set_mode(amp, x, y, mode);
+}
+
+static inline struct amp_rgb_type amp_get_fg_color(
+    struct amp_type *amp, long x, long y
+) {
+    return amp_get_mode(amp, x, y).fg;
+}
+
+static inline void amp_fill_rect(
+    struct amp_type *amp, long x, long y, uint32_t w, uint32_t h,
+    AMP_STYLE style, const char *glyph_str
+) {
+    char glyph[AMP_CELL_GLYPH_SIZE] = {};
+    uint8_t set[AMP_CELL_MODE_SIZE];
+    uint8_t keep[AMP_CELL_MODE_SIZE];
+
+    if (!amp_prepare_glyph(glyph_str, glyph)) {
+        return;
     }
 
-    return amp_color_table[best_row];
+    amp_glyph_mode_mask(style, set, keep);
+    amp_fill_mode_rect(amp, x, y, w, h, glyph, set, keep);
 }
 
-static inline struct amp_color_type amp_lookup_color(AMP_COLOR index) {
-    return (
-        index < AMP_MAX_COLOR ? (
-            amp_color_table[index]
-        ) : amp_color_table[AMP_COLOR_NONE]
+static inline void amp_glyph_mode_mask(
+    AMP_STYLE style, uint8_t *set, uint8_t *keep
+) {
+    // If the new style does not include any background colors, then the
+    // existing background color should remain in effect.
+    AMP_STYLE mask = ~amp_bg_color_styles;
+
+    if (style & amp_bg_color_styles) {
+        mask |= amp_bg_color_styles;
+    }
+
+    amp_style_mode_mask(style, mask, set, keep);
+}
+
+static inline void amp_style_rect(
+    struct amp_type *amp, long x, long y, uint32_t w, uint32_t h,
+    AMP_STYLE style, AMP_STYLE mask
+) {
+    uint8_t set[AMP_CELL_MODE_SIZE];
+    uint8_t keep[AMP_CELL_MODE_SIZE];
+
+    amp_style_mode_mask(style, mask, set, keep);
+    amp_fill_mode_rect(amp, x, y, w, h, nullptr, set, keep);
+}
+
+static inline void amp_set_bg_rect(
+    struct amp_type *amp, long x, long y, uint32_t w, uint32_t h,
+    struct amp_rgb_type bg_color
+) {
+    const uint8_t set[AMP_CELL_MODE_SIZE] = {
+        0, 0, 0, bg_color.r, bg_color.g, bg_color.b, 1 << 1, 0
+    };
+    const uint8_t keep[AMP_CELL_MODE_SIZE] = {
+        0xff, 0xff, 0xff, 0, 0, 0, (uint8_t) ~(1 << 1), 0
+    };
+
+    amp_fill_mode_rect(amp, x, y, w, h, nullptr, set, keep);
+}
+
+static inline void amp_set_fg_rect(
+    struct amp_type *amp, long x, long y, uint32_t w, uint32_t h,
+    struct amp_rgb_type fg_color
+) {
+    const uint8_t set[AMP_CELL_MODE_SIZE] = {
+        fg_color.r, fg_color.g, fg_color.b, 0, 0, 0, 1 << 0, 0
+    };
+    const uint8_t keep[AMP_CELL_MODE_SIZE] = {
+        0, 0, 0, 0xff, 0xff, 0xff, (uint8_t) ~(1 << 0), 0
+    };
+
+    amp_fill_mode_rect(amp, x, y, w, h, nullptr, set, keep);
+}
+
+static inline struct amp_rgb_type amp_mix_colors(uint32_t colors) {
+    // The usual case of a single color is looked up from the color table
+    // directly, without having to average anything.
+    if (!(colors & (colors - 1))) {
+        return amp_color_table[
+            AMP_DARK + stdc_trailing_zeros_ui(colors)
+        ].rgb;
+    }
+
+    unsigned r = 0;
+    unsigned g = 0;
+    unsigned b = 0;
+    unsigned count = 0;
+
+    for (; colors; colors &= colors - 1) {
+        const struct amp_rgb_type rgb = amp_color_table[
+            AMP_DARK + stdc_trailing_zeros_ui(colors)
+        ].rgb;
+
+        r += rgb.r;
+        g += rgb.g;
+        b += rgb.b;
+
+        ++count;
+    }
+
+    return amp_map_rgb(
+        (uint8_t) (r / count), (uint8_t) (g / count), (uint8_t) (b / count)
     );
 }
 
-static inline struct amp_inline_style_type amp_lookup_inline_style(
-    const char *glyph
+static inline void amp_style_mode_mask(
+    AMP_STYLE style, AMP_STYLE mask, uint8_t *set, uint8_t *keep
 ) {
-    uint8_t glyph_data[AMP_CELL_GLYPH_SIZE];
-    uint8_t glyph_data_size = 0;
+    // The decorations map to the flags of the mode bit for bit, right after
+    // the flags of the foreground and background colors.
+    const AMP_STYLE decorations = (
+        AMP_HIDDEN | AMP_FAINT | AMP_ITALIC | AMP_UNDERLINE | AMP_BLINKING |
+        AMP_STRIKETHROUGH
+    );
+    const uint8_t mask_bits = (uint8_t) (
+        (mask & amp_fg_color_styles ? (1 << 0) : 0) |
+        (mask & amp_bg_color_styles ? (1 << 1) : 0) |
+        ((mask & decorations) << 2)
+    );
 
-    for (; glyph_data_size < sizeof(glyph_data); ++glyph_data_size) {
-        glyph_data[glyph_data_size] = (uint8_t) glyph[glyph_data_size];
+    memset(set, 0, AMP_CELL_MODE_SIZE);
+    memset(keep, 0xff, AMP_CELL_MODE_SIZE);
 
-        if (glyph_data[glyph_data_size] == 0) {
+    set[6] = (uint8_t) ((style & decorations) << 2) & mask_bits;
+    keep[6] = (uint8_t) ~mask_bits;
+    keep[7] = 0;
+
+    for (size_t channel = 0; channel < 2; ++channel) {
+        const AMP_STYLE none = channel ? AMP_BG_NONE : AMP_FG_NONE;
+        const uint32_t colors = (uint32_t) (
+            style >> (stdc_trailing_zeros_ull(none) + 1)
+        ) & amp_color_bits;
+
+        // The color channels are only overwritten when the color gets enabled.
+        if (!(mask_bits & (1 << channel)) || (style & none) || !colors) {
+            continue;
+        }
+
+        memset(keep + channel * 3, 0, 3);
+
+        // A single color takes its RGB straight from the color table, so that
+        // the table stays the only place where the colors are defined.
+        const struct amp_rgb_type rgb = amp_mix_colors(colors);
+
+        set[channel * 3 + 0] = rgb.r;
+        set[channel * 3 + 1] = rgb.g;
+        set[channel * 3 + 2] = rgb.b;
+        set[6] |= (uint8_t) (1 << channel);
+    }
+}
+
+static inline void amp_fill_mode_rect(
+    struct amp_type *amp, long x, long y, uint32_t w, uint32_t h,
+    const char *glyph, const uint8_t *set, const uint8_t *keep
+) {
+    long x_on_amp = x;
+    long y_on_amp = y;
+    long width = w;
+    long height = h;
+    uint64_t set_bits = 0;  // the mode of a cell fits in 64 bits
+    uint64_t keep_bits = 0;
+
+    // Let's clip the rectangle against the edges of the ansmap only once.
+    if (!amp_clip_span(&x_on_amp, amp->width, &x, amp->width, &width)
+    ||  !amp_clip_span(&y_on_amp, amp->height, &y, amp->height, &height)) {
+        return;
+    }
+
+    memcpy(&set_bits, set, sizeof(set_bits));
+    memcpy(&keep_bits, keep, sizeof(keep_bits));
+
+    for (long j = 0; j < height; ++j) {
+        const struct amp_row_type row = amp_write_row(amp, y + j);
+        const size_t end = (
+            (size_t) (x + width) < row.size ? (size_t) (x + width) : row.size
+        );
+
+        for (size_t i = (size_t) x; i < end; ++i) {
+            uint8_t *mode = row.mode + i * AMP_CELL_MODE_SIZE;
+            uint64_t mode_bits;
+
+            memcpy(&mode_bits, mode, sizeof(mode_bits));
+            mode_bits = (mode_bits & keep_bits) | set_bits;
+            memcpy(mode, &mode_bits, sizeof(mode_bits));
+
+            if (glyph) {
+                memcpy(
+                    row.glyph + i * AMP_CELL_GLYPH_SIZE, glyph,
+                    AMP_CELL_GLYPH_SIZE
+                );
+            }
+        }
+    }
+}
+
+static inline bool amp_prepare_glyph(const char *glyph_str, char *glyph) {
+    size_t glyph_size = 0;
+
+    for (const char *c = glyph_str; *c; ++c) {
+        if (++glyph_size >= AMP_CELL_GLYPH_SIZE) {
             break;
         }
     }
 
-    int code_point_size = amp_utf8_code_point_size(
-        (const char *) glyph_data, glyph_data_size
-    );
+    int cpsz = amp_utf8_code_point_size(glyph_str, glyph_size);
 
-    if (code_point_size < 0 || (size_t) code_point_size >= sizeof(glyph_data)) {
-        return amp_inline_style_table[0];
+    if (cpsz < 0 || cpsz >= (int) AMP_CELL_GLYPH_SIZE) {
+        return false;
     }
 
-    constexpr size_t table_size = (
-        sizeof(amp_inline_style_table)/sizeof(amp_inline_style_table[0])
-    );
+    memcpy(glyph, glyph_str, (size_t) cpsz);
 
-    glyph_data[code_point_size] = 0;
-    glyph_data_size = (uint8_t) code_point_size;
+    if (cpsz == 1 && !isprint(glyph[0])) {
+        glyph[0] = '?';
+    }
 
-    if (glyph_data_size == 1) {
-        char index = (char) glyph_data[0];
+    return true;
+}
 
-        if (index < 0 || (size_t) index >= table_size) {
-            return amp_inline_style_table[0];
+static inline size_t amp_print_ascii_run(
+    struct amp_type *amp, long x, long y, const char *str, size_t str_size,
+    char stop, const uint8_t *set, const uint8_t *keep
+) {
+    // Prints the leading run of ASCII characters up to the stop character,
+    // returning its length. Such characters are glyphs of their own, so they
+    // can be written straight into the glyph slots with a single mode.
+    size_t run = amp_utf8_ascii_span(str, str_size);
+
+    while (run < str_size && str[run] && (uint8_t) str[run] < 0x80) {
+        ++run;
+    }
+
+    if (stop) {
+        const char *stop_at = memchr(str, stop, run);
+
+        if (stop_at) {
+            run = (size_t) (stop_at - str);
         }
+    }
 
-        return amp_inline_style_table[(size_t) index];
+    long src_x = 0;
+    long length = run > LONG_MAX ? LONG_MAX : (long) run;
+
+    if (!amp_clip_span(&x, amp->width, &src_x, UINT32_MAX, &length)) {
+        return run;
     }
 
-    return amp_inline_style_table[0];
+    const struct amp_row_type row = amp_write_row(amp, y);
+    uint64_t set_bits = 0;
+    uint64_t keep_bits = 0;
+
+    if (x >= row.size) {
+        return run;
+    }
+
+    if (length > row.size - x) {
+        length = row.size - x;
+    }
+
+    memcpy(&set_bits, set, sizeof(set_bits));
+    memcpy(&keep_bits, keep, sizeof(keep_bits));
+
+    uint8_t *glyph = row.glyph + (size_t) x * AMP_CELL_GLYPH_SIZE;
+    uint8_t *mode = row.mode + (size_t) x * AMP_CELL_MODE_SIZE;
+
+    for (long i = 0; i < length; ++i) {
+        const char c = str[src_x + i];
+        uint64_t mode_bits;
+
+        memset(glyph, 0, AMP_CELL_GLYPH_SIZE);
+        glyph[0] = (uint8_t) (isprint(c) ? c : '?');
+        glyph += AMP_CELL_GLYPH_SIZE;
+
+        memcpy(&mode_bits, mode, sizeof(mode_bits));
+        mode_bits = (mode_bits & keep_bits) | set_bits;
+        memcpy(mode, &mode_bits, sizeof(mode_bits));
+        mode += AMP_CELL_MODE_SIZE;
+    }
+
+    return run;
 }
 
-static inline struct amp_color_combo_type amp_lookup_color_combo(
-    struct amp_rgb_type rgb
+static inline void amp_print_glyph(
+    struct amp_type *amp, long x, long y, AMP_STYLE style, const char *glyph_str
 ) {
-    constexpr size_t cube_w = 8;
-    constexpr size_t cluster_w = cube_w;
-    constexpr size_t cluster_h = cube_w;
-    constexpr size_t table_size = (
-        sizeof(amp_color_combo_table)/sizeof(amp_color_combo_table[0])
-    );
+    uint8_t set[AMP_CELL_MODE_SIZE];
+    uint8_t keep[AMP_CELL_MODE_SIZE];
 
-    size_t cluster_x = rgb.r / (256 / cube_w);
-    size_t cluster_y = rgb.g / (256 / cube_w);
-    size_t cluster_z = rgb.b / (256 / cube_w);
+    amp_glyph_mode_mask(style, set, keep);
+    amp_print_masked_glyph(amp, x, y, glyph_str, set, keep);
+}
 
-    const size_t cluster_i = (
-        (cluster_z * cluster_h + cluster_y) * cluster_w + cluster_x
-    );
+static inline void amp_print_cell_run(
+    struct amp_type *amp, long x, long y, const char *glyphs, size_t count,
+    const uint8_t *set, const uint8_t *keep
+) {
+    // Prints a run of prepared glyph cells of AMP_CELL_GLYPH_SIZE bytes each,
+    // clipping the run only once and giving all of its cells the same mode.
+    long src_x = 0;
+    long length = count > LONG_MAX ? LONG_MAX : (long) count;
 
-    return (
-        cluster_i >= table_size ? (
-            (struct amp_color_combo_type) {}
-        ) : amp_color_combo_table[cluster_i]
+    if (!amp_clip_span(&x, amp->width, &src_x, UINT32_MAX, &length)) {
+        return;
+    }
+
+    const struct amp_row_type row = amp_write_row(amp, y);
+    uint64_t set_bits = 0;
+    uint64_t keep_bits = 0;
+
+    if (x >= row.size) {
+        return;
+    }
+
+    if (length > row.size - x) {
+        length = row.size - x;
+    }
+
+    memcpy(
+        row.glyph + (size_t) x * AMP_CELL_GLYPH_SIZE,
+        glyphs + (size_t) src_x * AMP_CELL_GLYPH_SIZE,
+        (size_t) length * AMP_CELL_GLYPH_SIZE
     );
-}
 
-static inline struct amp_rgb_type amp_map_rgb(
-    uint8_t r, uint8_t g, uint8_t b
-) {
-    return (struct amp_rgb_type) { .r = r, .g = g, .b = b };
+    memcpy(&set_bits, set, sizeof(set_bits));
+    memcpy(&keep_bits, keep, sizeof(keep_bits));
+
+    uint8_t *mode = row.mode + (size_t) x * AMP_CELL_MODE_SIZE;
+
+    for (long i = 0; i < length; ++i) {
+        uint64_t mode_bits;
+
+        memcpy(&mode_bits, mode, sizeof(mode_bits));
+        mode_bits = (mode_bits & keep_bits) | set_bits;
+        memcpy(mode, &mode_bits, sizeof(mode_bits));
+        mode += AMP_CELL_MODE_SIZE;
+    }
 }
 
-static inline void amp_unmap_rgb(
-    struct amp_rgb_type color, uint8_t * r, uint8_t * g, uint8_t * b
+static inline size_t amp_print_masked_glyph(
+    struct amp_type *amp, long x, long y, const char *glyph_str,
+    const uint8_t *set, const uint8_t *keep
 ) {
-    *r = color.r;
-    *g = color.g;
-    *b = color.b;
+    // Returns the number of cells that the printed glyph takes up, so that the
+    // callers would not have to measure the glyph again.
+    char glyph[AMP_CELL_GLYPH_SIZE] = {};
+
+    if (!amp_prepare_glyph(glyph_str, glyph)) {
+        return 0;
+    }
+
+    // The glyph and its mode are written in one step, along with the tail cell
+    // of a wide glyph.
+    const size_t cells = (size_t) amp_utf8_glyph_cells(glyph, sizeof(glyph));
+
+    amp_fill_mode_rect(amp, x, y, 1, 1, glyph, set, keep);
+
+    if (cells > 1) {
+        amp_fill_mode_rect(amp, x + 1, y, 1, 1, amp_glyph_tail, set, keep);
+    }
+
+    return cells;
 }
 
-static inline const char *amp_str_seg_first_line_size(
-    const char *str, size_t str_sz, size_t *line_size
+static inline void amp_print_line_clip(
+    struct amp_type *amp, long x, long y, AMP_STYLE style, AMP_ALIGN align,
+    const char *text, size_t text_size
 ) {
-    const char *begin = str;
-    const char *found = nullptr;
-    char after_found;
+    if (y < 0 || y >= amp->height || y > UINT32_MAX) {
+        return;
+    }
+
+    uint32_t text_width = (uint32_t) amp_utf8_width(text, text_size);
+
+    if (align == AMP_ALIGN_RIGHT) {
+        x = (x - text_width) + 1;
+    }
+    else if (align == AMP_ALIGN_CENTER) {
+        x -= text_width / 2;
+    }
+
+    uint8_t set[AMP_CELL_MODE_SIZE];
+    uint8_t keep[AMP_CELL_MODE_SIZE];
+
+    amp_glyph_mode_mask(style, set, keep);
+
+    for (const char *s = text; *s && x < amp->width;) {
+        const size_t n = amp_sub_size(text_size, (size_t) (s - text));
+
+        if ((uint8_t) *s < 0x80) {
+            const size_t run = amp_print_ascii_run(
+                amp, x, y, s, n, 0, set, keep
+            );
+
+            if (run) {
+                x += (long) run;
+                s += run;
+                continue;
+            }
+        }
+
+        int cpsz = amp_utf8_code_point_size(s, n);
+
+        if (cpsz < 0) {
+            break;
+        }
+
+        x += (long) amp_print_masked_glyph(amp, x, y, s, set, keep);
+        s += cpsz;
+    }
+}
+
+static inline void amp_print_rich_line_clip(
+    struct amp_type *amp, long x, long y, AMP_STYLE *text_style,
+    AMP_ALIGN align, const char *text, size_t text_size
+) {
+    if (y < 0 || y >= amp->height || y > UINT32_MAX) {
+        return;
+    }
+
+    uint32_t text_width = (uint32_t) (
+        amp_utf8_width(text, text_size) -
+        amp_str_seg_style_sign_count(text, text_size)
+    );
+
+    if (align == AMP_ALIGN_RIGHT) {
+        x = (x - text_width) + 1;
+    }
+    else if (align == AMP_ALIGN_CENTER) {
+        x -= text_width / 2;
+    }
+
+    const char *s = text;
+    size_t count = 0;
+
+    while (*s && s < text + text_size) {
+        if ((uint8_t) *s < 0x80 && *s != '{') {
+            uint8_t set[AMP_CELL_MODE_SIZE];
+            uint8_t keep[AMP_CELL_MODE_SIZE];
+
+            amp_glyph_mode_mask(*text_style, set, keep);
+
+            const size_t run = amp_print_ascii_run(
+                amp, x, y, s, text_size - (size_t) (s - text), '{', set, keep
+            );
+
+            x += (long) run;
+            s += run;
+            continue;
+        }
+
+        const char *next = amp_str_seg_skip_style_sign(
+            s, text_size - (size_t) (s - text)
+        );
+
+        if (next > text + text_size) {
+            break;
+        }
+
+        if (s == next) { // no style sign detected
+            next = amp_str_seg_skip_any_utf8_symbol(
+                s, text_size - (size_t) (s - text)
+            );
+
+            if (s == next) {
+                break;
+            }
+
+            {
+                int cpsz = amp_utf8_code_point_size(
+                    s, amp_sub_size(text_size, (size_t) (s - text))
+                );
+
+                if (cpsz < 0) {
+                    break;
+                }
+
+                uint8_t set[AMP_CELL_MODE_SIZE];
+                uint8_t keep[AMP_CELL_MODE_SIZE];
+
+                amp_glyph_mode_mask(*text_style, set, keep);
+                x += (long) amp_print_masked_glyph(amp, x, y, s, set, keep);
+            }
+
+            s = next;
+            continue;
+        }
+        else if (next - s == 1) { // double brace detected
+            ++count; // double braces '{{' count for one style sign
+
+            if (*next != '{') {
+                abort();
+            }
+
+            amp_print_glyph(amp, x++, y, *text_style, "{");
+
+            s = next + 1;
+            continue;
+        }
+
+        auto const row = amp_lookup_inline_style(s+1);
+        AMP_STYLE new_style = row.style;
+
+        if (new_style) {
+            if (new_style & AMP_HARD_RESET) {
+                *text_style = 0; // Reset foreground, background and decoration.
+                new_style &= ~AMP_HARD_RESET;
+            }
+
+            if (new_style & AMP_SOFT_RESET) {
+                // Reset foreground and decoration. Leave background as is.
+                *text_style &= amp_bg_color_styles;
+                new_style &= ~AMP_SOFT_RESET;
+            }
+
+            if (new_style & amp_fg_color_styles) {
+                // New style includes foreground color. Clear the old color.
+                *text_style &= ~amp_fg_color_styles;
+            }
+
+            if (new_style & amp_bg_color_styles) {
+                // New style includes background color. Clear the old color.
+                *text_style &= ~amp_bg_color_styles;
+            }
+
+            *text_style |= new_style;
+        }
+
+        s = next;
+    }
+}
+
+static inline void amp_print_line(
+    struct amp_type *amp, long x, long y, AMP_STYLE style, AMP_ALIGN align,
+    const char *text
+) {
+    amp_print_line_clip(amp, x, y, style, align, text, strlen(text));
+}
+
+static inline size_t amp_print_rich_text_clip(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE *text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str,
+    size_t text_str_size
+) {
+    return amp_print_text_lines(
+        amp, text_x, text_y, text_style, text_max_width, text_alignment,
+        text_str, text_str_size, true
+    );
+}
+
+static inline size_t amp_print_text_clip(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str,
+    size_t text_str_size
+) {
+    return amp_print_text_lines(
+        amp, text_x, text_y, &text_style, text_max_width, text_alignment,
+        text_str, text_str_size, false
+    );
+}
+
+static inline size_t amp_print_text_lines(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE *text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str,
+    size_t text_str_size, bool rich
+) {
+    struct amp_layout_cache_type *cache = amp->layout.cache;
+    struct amp_layout_entry_type *entry = nullptr;
+    struct amp_layout_line_type *lines = nullptr;
+    size_t line_count = 0;
+
+    for (const struct amp_type *a = amp; !cache && a->view.parent;) {
+        a = a->view.parent;
+        cache = a->layout.cache;
+    }
+
+    struct amp_layout_entry_type key = {};
+
+    if (cache && cache->entry_count && text_str_size <= UINT32_MAX) {
+        uint64_t check;
+        const uint64_t hash = amp_hash_text(text_str, text_str_size, &check);
+
+        key = (struct amp_layout_entry_type) {
+            .hash = hash,
+            .check = check,
+            .text_size = text_str_size,
+            .max_width = text_max_width,
+            .alignment = text_alignment,
+            .rich = rich
+        };
+
+        entry = amp_find_layout(cache, &key);
+
+        if (entry) {
+            ++cache->hits;
+            lines = cache->lines + (size_t) entry->lines * cache->max_lines;
+
+            for (; line_count < entry->line_count; ++line_count) {
+                const char *line = text_str + lines[line_count].offset;
+                const long y = text_y + (long) line_count;
+
+                if (rich) {
+                    amp_print_rich_line_clip(
+                        amp, text_x, y, text_style, text_alignment, line,
+                        lines[line_count].size
+                    );
+                }
+                else {
+                    amp_print_line_clip(
+                        amp, text_x, y, *text_style, text_alignment, line,
+                        lines[line_count].size
+                    );
+                }
+            }
+
+            return line_count;
+        }
+
+        // The new layout goes to the spare lines, so that no entry has to be
+        // replaced before it is known whether the layout fits.
+        ++cache->misses;
+        lines = cache->lines + (size_t) cache->spare * cache->max_lines;
+    }
+
+    struct amp_line_breaker_type breaker = amp_init_line_breaker(
+        text_str, text_str_size, text_max_width, rich
+    );
+
+    const char *line;
+    size_t line_size;
+
+    for (; amp_break_line(&breaker, &line, &line_size); ++line_count) {
+        const long y = text_y + (long) line_count;
+
+        if (rich) {
+            amp_print_rich_line_clip(
+                amp, text_x, y, text_style, text_alignment, line, line_size
+            );
+        }
+        else {
+            amp_print_line_clip(
+                amp, text_x, y, *text_style, text_alignment, line, line_size
+            );
+        }
+
+        if (lines && line_count < cache->max_lines) {
+            lines[line_count] = (struct amp_layout_line_type) {
+                .offset = (uint32_t) (line - text_str),
+                .size = (uint32_t) line_size
+            };
+        }
+    }
+
+    if (lines && line_count <= cache->max_lines) {
+        entry = amp_evict_layout(cache, key.hash);
+        key.lines = cache->spare;
+        key.line_count = (uint32_t) line_count;
+        key.used = true;
+        key.referenced = true;
+
+        // The lines of the replaced entry become the new spare lines.
+        cache->spare = entry->lines;
+        *entry = key;
+    }
+
+    return line_count;
+}
+
+static inline bool amp_init_text_stream(
+    struct amp_text_stream_type *stream, struct amp_type *amp, AMP_STYLE style,
+    uint32_t max_width, bool rich, char *data, size_t data_size
+) {
+    // One byte of the buffer is reserved for the null byte after the text.
+    if (!data || data_size < 2) {
+        *stream = (struct amp_text_stream_type) {};
+
+        return false;
+    }
+
+    *stream = (struct amp_text_stream_type) {
+        .ansmap = amp,
+        .data = data,
+        .data_size = data_size,
+        .max_width = max_width,
+        .style = style,
+        .rich = rich
+    };
+
+    *data = '\0';
+
+    return true;
+}
+
+static inline size_t amp_stream_text(
+    struct amp_text_stream_type *stream, const char *chunk, size_t chunk_size
+) {
+    // One byte of the buffer is reserved for the null byte after the text.
+    const size_t capacity = amp_sub_size(stream->data_size, 1);
+    size_t line_count = 0;
+
+    while (chunk_size && capacity) {
+        const size_t free_size = capacity - stream->size;
+        const size_t size = chunk_size < free_size ? chunk_size : free_size;
+
+        memcpy(stream->data + stream->size, chunk, size);
+        stream->size += size;
+        stream->data[stream->size] = '\0';
+        chunk += size;
+        chunk_size -= size;
+
+        line_count += amp_process_text_stream(stream, false);
+    }
+
+    return line_count;
+}
+
+static inline ssize_t amp_stream_fd(
+    struct amp_text_stream_type *stream, int fd
+) {
+    const size_t capacity = amp_sub_size(stream->data_size, 1);
+
+    if (stream->size >= capacity) {
+        return -1; // There is no buffer to read into.
+    }
+
+    const ssize_t size = read(
+        fd, stream->data + stream->size, capacity - stream->size
+    );
+
+    if (size > 0) {
+        stream->size += (size_t) size;
+        stream->data[stream->size] = '\0';
+        amp_process_text_stream(stream, false);
+    }
+
+    return size;
+}
+
+static inline size_t amp_flush_text_stream(
+    struct amp_text_stream_type *stream
+) {
+    return amp_process_text_stream(stream, true);
+}
+
+static inline size_t amp_process_text_stream(
+    struct amp_text_stream_type *stream, bool flush
+) {
+    // The lines are counted before they are printed, so that the ansmap can be
+    // scrolled only once to make room for all of them.
+    const size_t line_count = amp_scan_text_stream(stream, flush, false);
+
+    if (!line_count) {
+        return 0;
+    }
+
+    struct amp_type *amp = stream->ansmap;
+    const long overflow = stream->y + (long) line_count - (long) amp->height;
+
+    if (overflow > 0) {
+        amp_scroll(amp, overflow);
+        stream->y -= overflow;
+    }
+
+    amp_scan_text_stream(stream, flush, true);
+
+    return line_count;
+}
+
+static inline size_t amp_scan_text_stream(
+    struct amp_text_stream_type *stream, bool flush, bool print
+) {
+    // Goes through the lines of the buffer that are ready to be printed and
+    // returns their number. If they are printed, then their text is removed
+    // from the buffer in one go at the end.
+    const size_t capacity = amp_sub_size(stream->data_size, 1);
+    size_t begin = 0;
+    size_t line_count = 0;
+
+    while (begin < stream->size) {
+        size_t line_size;
+        const char *next_line = amp_str_seg_first_line_size(
+            stream->data + begin, stream->size - begin, &line_size
+        );
+        const size_t size = (size_t) (next_line - (stream->data + begin));
+
+        // A line ending at the end of the buffer could still be the first half
+        // of a two character line ending that continues in the next chunk.
+        if (line_size == size || (
+            size - line_size == 1 && begin + size == stream->size &&
+            !flush && stream->size - begin < capacity
+        )) {
+            break;
+        }
+
+        line_count += amp_stream_lines(
+            stream, &begin, begin + size, true, print
+        );
+    }
+
+    if (begin < stream->size && flush) {
+        line_count += amp_stream_lines(
+            stream, &begin, stream->size, true, print
+        );
+    }
+    else if (begin < stream->size) {
+        // Only the last of the wrapped lines can still change with more text.
+        // An incomplete code point or style marker at the end is left out,
+        // because it could change the width of the text before it.
+        const size_t tail_size = amp_stream_tail_size(stream, begin);
+
+        if (begin + tail_size < stream->size) {
+            line_count += amp_stream_lines(
+                stream, &begin, stream->size - tail_size, false, print
+            );
+        }
+
+        if (stream->size - begin >= capacity) {
+            // A full buffer is printed even if it is nothing but the tail.
+            const size_t full_tail_size = amp_stream_tail_size(stream, begin);
+
+            line_count += amp_stream_lines(
+                stream, &begin, begin + full_tail_size < stream->size ? (
+                    stream->size - full_tail_size
+                ) : stream->size, true, print
+            );
+        }
+    }
+
+    if (print && begin) {
+        stream->size -= begin;
+        memmove(stream->data, stream->data + begin, stream->size);
+        stream->data[stream->size] = '\0';
+    }
+
+    return line_count;
+}
+
+static inline size_t amp_stream_lines(
+    struct amp_text_stream_type *stream, size_t *begin, size_t end, bool final,
+    bool print
+) {
+    // Counts or prints the wrapped lines of the text between the given offsets
+    // of the buffer and moves the beginning past them. Unless the text is
+    // final, its last line is left for later.
+    const char *text = stream->data + *begin;
+    struct amp_line_breaker_type breaker = amp_init_line_breaker(
+        text, end - *begin, stream->max_width, stream->rich
+    );
+
+    const char *line;
+    size_t line_size;
+    const char *last_line = nullptr;
+    size_t last_line_size = 0;
+    size_t line_count = 0;
+
+    while (amp_break_line(&breaker, &line, &line_size)) {
+        if (last_line) {
+            if (print) {
+                amp_stream_line(stream, last_line, last_line_size);
+            }
+
+            ++line_count;
+        }
+
+        last_line = line;
+        last_line_size = line_size;
+    }
+
+    if (final) {
+        if (last_line) {
+            if (print) {
+                amp_stream_line(stream, last_line, last_line_size);
+            }
+
+            ++line_count;
+        }
+
+        *begin = end;
+    }
+    else if (last_line) {
+        *begin = (size_t) (last_line - stream->data);
+    }
+
+    return line_count;
+}
+
+static inline void amp_stream_line(
+    struct amp_text_stream_type *stream, const char *line, size_t line_size
+) {
+    struct amp_type *amp = stream->ansmap;
+
+    if (stream->y < 0) {
+        // The line has already been scrolled out of the ansmap, but its style
+        // markers still apply to the lines after it.
+        if (stream->rich) {
+            stream->style = amp_rich_str_seg_style(
+                line, line_size, stream->style
+            );
+        }
+    }
+    else if (stream->rich) {
+        amp_print_rich_line_clip(
+            amp, 0, stream->y, &stream->style, AMP_ALIGN_LEFT, line, line_size
+        );
+    }
+    else {
+        amp_print_line_clip(
+            amp, 0, stream->y, stream->style, AMP_ALIGN_LEFT, line, line_size
+        );
+    }
+
+    ++stream->y;
+}
+
+static inline size_t amp_stream_tail_size(
+    const struct amp_text_stream_type *stream, size_t begin
+) {
+    // Returns the size of the incomplete code point or style marker at the end
+    // of the buffer, which has to wait for the rest of it to arrive.
+    const uint8_t *end = (const uint8_t *) stream->data + stream->size;
+    const size_t size = stream->size - begin;
+    size_t tail_size = 0;
+
+    for (size_t i = 1; i <= 3 && i <= size; ++i) {
+        const uint8_t c = end[-(long) i];
+
+        if ((c & 0xc0) == 0x80) {
+            continue;
+        }
+
+        const size_t cpsz = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+
+        tail_size = cpsz > i ? i : 0;
+        break;
+    }
+
+    if (stream->rich) {
+        size_t braces = 0;
+
+        while (braces < size - tail_size
+        && end[-(long) (tail_size + braces + 1)] == '{') {
+            ++braces;
+        }
+
+        // Whether a brace starts a style marker or stands for itself depends
+        // on where the line was broken, so the trailing braces have to wait.
+        tail_size += braces;
+    }
+
+    return tail_size;
+}
+
+static inline size_t amp_calc_console_size(
+    size_t text_size, uint32_t max_lines, uint32_t max_rows
+) {
+    return (
+        alignof(struct amp_console_line_type) - 1 + text_size +
+        sizeof(struct amp_console_line_type) * (size_t) max_lines +
+        sizeof(struct amp_console_row_type) * (size_t) max_rows
+    );
+}
+
+static inline size_t amp_init_console(
+    struct amp_console_type *console, AMP_STYLE style, bool rich,
+    uint32_t max_lines, uint32_t max_rows, void *data, size_t data_size
+) {
+    const size_t padding = (
+        (
+            alignof(struct amp_console_line_type) -
+            (uintptr_t) data % alignof(struct amp_console_line_type)
+        ) % alignof(struct amp_console_line_type)
+    );
+    const size_t index_size = (
+        padding +
+        sizeof(struct amp_console_line_type) * (size_t) max_lines +
+        sizeof(struct amp_console_row_type) * (size_t) max_rows
+    );
+
+    *console = (struct amp_console_type) {
+        .style = style,
+        .rich = rich
+    };
+
+    // A line takes at least a byte of text for its null byte.
+    if (!data || !max_lines || data_size < index_size + 2) {
+        return 0;
+    }
+
+    console->lines = (struct amp_console_line_type *) (
+        (uint8_t *) data + padding
+    );
+    console->rows = (struct amp_console_row_type *) (
+        console->lines + max_lines
+    );
+    console->text = (char *) (console->rows + max_rows);
+    console->text_size = data_size - index_size;
+    console->max_lines = max_lines;
+    console->max_rows = max_rows;
+
+    // The rows are numbered so that the index can grow backwards by max_rows.
+    console->first_row = max_rows;
+    console->end_row = max_rows;
+
+    return console->text_size;
+}
+
+static inline size_t amp_write_console(
+    struct amp_console_type *console, const char *text, size_t text_size
+) {
+    size_t line_count = 0;
+
+    for (const char *s = text; s < text + text_size && *s;) {
+        size_t line_size;
+        const char *next_line = amp_str_seg_first_line_size(
+            s, (size_t) (text + text_size - s), &line_size
+        );
+
+        amp_console_add_line(console, s, line_size);
+        ++line_count;
+
+        if (next_line <= s) {
+            break;
+        }
+
+        s = next_line;
+    }
+
+    return line_count;
+}
+
+static inline size_t amp_print_console(
+    struct amp_type *amp, long x, long y, uint32_t width, uint32_t height,
+    struct amp_console_type *console, size_t scroll
+) {
+    const char glyph[AMP_CELL_GLYPH_SIZE] = {};
+    const uint8_t mode[AMP_CELL_MODE_SIZE] = {};
+
+    if (width != console->width) {
+        // The lines are wrapped for the new width only when they are needed.
+        console->width = width;
+        console->indexed_line = console->end_line;
+        console->first_row = console->max_rows;
+        console->end_row = console->max_rows;
+
+        amp_console_style_lines(console);
+    }
+
+    amp_fill_mode_rect(amp, x, y, width, height, glyph, mode, mode);
+
+    if (!width) {
+        return 0;
+    }
+
+    amp_console_index_rows(
+        console, scroll < SIZE_MAX - height ? scroll + height : SIZE_MAX
+    );
+
+    const size_t row_count = console->end_row - console->first_row;
+    const size_t shown = row_count < height ? row_count : height;
+
+    if (scroll > row_count - shown) {
+        scroll = row_count - shown;
+    }
+
+    const size_t top = console->end_row - scroll - shown;
+
+    for (size_t i = 0; i < shown; ++i) {
+        const struct amp_console_row_type *row = amp_console_row(
+            console, top + i
+        );
+        AMP_STYLE style = row->style;
+
+        if (console->rich) {
+            amp_print_rich_line_clip(
+                amp, x, y + (long) i, &style, AMP_ALIGN_LEFT,
+                console->text + row->offset, row->size
+            );
+        }
+        else {
+            amp_print_line_clip(
+                amp, x, y + (long) i, style, AMP_ALIGN_LEFT,
+                console->text + row->offset, row->size
+            );
+        }
+    }
+
+    return scroll;
+}
+
+static inline void amp_console_add_line(
+    struct amp_console_type *console, const char *str, size_t size
+) {
+    const AMP_STYLE style = console->style;
+
+    if (!console->max_lines) {
+        if (console->rich) {
+            console->style = amp_rich_str_seg_style(str, size, style);
+        }
+
+        return;
+    }
+
+    if (size >= console->text_size) {
+        // The line is cut short, but not in the middle of a code point.
+        size = console->text_size - 1;
+
+        while (size && ((uint8_t) str[size] & 0xc0) == 0x80) {
+            --size;
+        }
+    }
+
+    size_t offset = console->text_end;
+
+    if (offset + size + 1 > console->text_size) {
+        // The text of a line is never split, so it goes to the beginning of
+        // the buffer. The lines after this position are the oldest ones.
+        while (console->first_line < console->end_line
+        && amp_console_line(console, console->first_line)->offset >= offset) {
+            amp_console_drop_line(console);
+        }
+
+        offset = 0;
+    }
+
+    while (console->first_line < console->end_line) {
+        const struct amp_console_line_type *oldest = amp_console_line(
+            console, console->first_line
+        );
+
+        if (console->end_line - console->first_line < console->max_lines && (
+            oldest->offset >= offset + size + 1 ||
+            oldest->offset + oldest->size + 1 <= offset
+        )) {
+            break;
+        }
+
+        amp_console_drop_line(console);
+    }
+
+    memcpy(console->text + offset, str, size);
+    console->text[offset + size] = '\0';
+    console->text_end = offset + size + 1;
+
+    *amp_console_line(console, console->end_line++) = (
+        (struct amp_console_line_type) {
+            .offset = offset,
+            .size = size,
+            .row = console->end_row,
+            .style = style
+        }
+    );
+
+    if (!console->width || !console->max_rows) {
+        console->indexed_line = console->end_line;
+        console->first_row = console->end_row;
+
+        if (console->rich) {
+            amp_console_wrap_line(
+                console, console->end_line - 1, 0, false, &console->style
+            );
+        }
+
+        return;
+    }
+
+    // The index always covers the latest lines, so the new line extends it.
+    // The style of the next line carries over from the last of the rows, the
+    // same way as it does when the text is printed.
+    console->end_row += amp_console_wrap_line(
+        console, console->end_line - 1, console->end_row, true,
+        &console->style
+    );
+
+    if (console->end_row - console->first_row > console->max_rows) {
+        console->first_row = console->end_row - console->max_rows;
+
+        while (console->indexed_line + 1 < console->end_line
+        && amp_console_line(
+            console, console->indexed_line + 1
+        )->row <= console->first_row) {
+            ++console->indexed_line;
+        }
+    }
+}
+
+static inline void amp_console_drop_line(struct amp_console_type *console) {
+    if (++console->first_line <= console->indexed_line) {
+        return;
+    }
+
+    console->indexed_line = console->first_line;
+
+    const size_t row = (
+        console->indexed_line < console->end_line ? (
+            amp_console_line(console, console->indexed_line)->row
+        ) : console->end_row
+    );
+
+    if (row > console->first_row) {
+        console->first_row = row;
+    }
+}
+
+static inline size_t amp_console_wrap_line(
+    struct amp_console_type *console, size_t line_number, size_t row_number,
+    bool store, AMP_STYLE *end_style
+) {
+    // Counts the rows that the line is wrapped into and, if asked to, stores
+    // them in the index starting from the given row number. Unless the end
+    // style is a null pointer, it receives the style in effect after the line.
+    const struct amp_console_line_type *line = amp_console_line(
+        console, line_number
+    );
+    const char *text = console->text + line->offset;
+    struct amp_line_breaker_type breaker = amp_init_line_breaker(
+        text, line->size, console->width, console->rich
+    );
+
+    const char *row;
+    size_t row_size;
+    size_t row_count = 0;
+    AMP_STYLE style = line->style;
+
+    for (; amp_break_line(&breaker, &row, &row_size); ++row_count) {
+        if (store) {
+            *amp_console_row(console, row_number + row_count) = (
+                (struct amp_console_row_type) {
+                    .offset = (size_t) (row - console->text),
+                    .size = row_size,
+                    .style = style
+                }
+            );
+        }
+
+        if (console->rich && (store || end_style)) {
+            // The style carries over from the printed part of the row, as it
+            // does when the line is printed. A style marker that is split by
+            // the wrapping takes no effect.
+            style = amp_rich_str_seg_style(row, row_size, style);
+        }
+    }
+
+    if (end_style) {
+        *end_style = style;
+    }
+
+    if (row_count) {
+        return row_count;
+    }
+
+    // An empty line still takes a row.
+    if (store) {
+        *amp_console_row(console, row_number) = (
+            (struct amp_console_row_type) {
+                .offset = line->offset,
+                .style = line->style
+            }
+        );
+    }
+
+    return 1;
+}
+
+static inline void amp_console_index_rows(
+    struct amp_console_type *console, size_t row_count
+) {
+    // Wraps the older lines until the index has the given number of rows, or
+    // until there are no more lines or no more room for their rows.
+    while (console->end_row - console->first_row < row_count
+    && console->indexed_line > console->first_line) {
+        if (console->indexed_line < console->end_line && amp_console_line(
+            console, console->indexed_line
+        )->row != console->first_row) {
+            break; // The rows of the oldest wrapped line are not all kept.
+        }
+
+        const size_t line_number = console->indexed_line - 1;
+        const size_t line_rows = amp_console_wrap_line(
+            console, line_number, 0, false, nullptr
+        );
+
+        if (console->end_row - console->first_row + line_rows > (
+            console->max_rows
+        )) {
+            break;
+        }
+
+        console->first_row -= line_rows;
+        amp_console_line(console, line_number)->row = console->first_row;
+        amp_console_wrap_line(
+            console, line_number, console->first_row, true, nullptr
+        );
+        console->indexed_line = line_number;
+    }
+}
+
+static inline void amp_console_style_lines(struct amp_console_type *console) {
+    // Where the lines are wrapped decides which of the style markers take
+    // effect, so the styles at the starts of the lines are derived again for
+    // the new width, beginning from the style of the oldest line kept.
+    if (!console->rich || console->first_line == console->end_line) {
+        return;
+    }
+
+    AMP_STYLE style = amp_console_line(console, console->first_line)->style;
+
+    for (size_t i = console->first_line; i < console->end_line; ++i) {
+        struct amp_console_line_type *line = amp_console_line(console, i);
+
+        line->style = style;
+
+        if (memchr(console->text + line->offset, '{', line->size)) {
+            amp_console_wrap_line(console, i, 0, false, &style);
+        }
+    }
+
+    console->style = style;
+}
+
+static inline struct amp_console_line_type *amp_console_line(
+    const struct amp_console_type *console, size_t line_number
+) {
+    return console->lines + line_number % console->max_lines;
+}
+
+static inline struct amp_console_row_type *amp_console_row(
+    const struct amp_console_type *console, size_t row_number
+) {
+    return console->rows + row_number % console->max_rows;
+}
+
+static inline AMP_STYLE amp_rich_str_seg_style(
+    const char *str, size_t size, AMP_STYLE style
+) {
+    // Returns the style in effect after the style markers of the string have
+    // been applied to the given style, the same way as they are when printed.
+    AMP_STYLE keep = ~(AMP_STYLE) 0;
+    AMP_STYLE set = 0;
+
+    for (const char *s = str; s < str + size && *s;) {
+        const char *next = amp_str_seg_skip_style_sign(
+            s, (size_t) (str + size - s)
+        );
+
+        if (next > str + size) {
+            break;
+        }
+
+        if (s == next) {
+            next = amp_str_seg_skip_any_utf8_symbol(
+                s, (size_t) (str + size - s)
+            );
+
+            if (s == next
+            || amp_utf8_code_point_size(s, (size_t) (str + size - s)) < 0) {
+                break;
+            }
+        }
+        else if (next - s == 1) { // double brace detected
+            ++next;
+        }
+        else {
+            amp_apply_inline_style(
+                &keep, &set, amp_lookup_inline_style(s+1).style
+            );
+        }
+
+        s = next;
+    }
+
+    return (style & keep) | set;
+}
+
+static inline size_t amp_calc_layout_cache_size(
+    uint32_t entry_count, uint32_t max_lines
+) {
+    return (
+        alignof(struct amp_layout_entry_type) - 1 + entry_count * (
+            sizeof(struct amp_layout_entry_type) +
+            sizeof(struct amp_layout_line_type) * (size_t) max_lines
+        ) + sizeof(struct amp_layout_line_type) * (size_t) max_lines
+    );
+}
+
+static inline size_t amp_init_layout_cache(
+    struct amp_layout_cache_type *cache, uint32_t entry_count,
+    uint32_t max_lines, void *data, size_t data_size
+) {
+    const size_t padding = (
+        (
+            alignof(struct amp_layout_entry_type) -
+            (uintptr_t) data % alignof(struct amp_layout_entry_type)
+        ) % alignof(struct amp_layout_entry_type)
+    );
+    const size_t entry_size = (
+        sizeof(struct amp_layout_entry_type) +
+        sizeof(struct amp_layout_line_type) * (size_t) max_lines
+    );
+    const size_t spare_size = (
+        sizeof(struct amp_layout_line_type) * (size_t) max_lines
+    );
+    const size_t capacity = (
+        data && data_size >= padding + spare_size ? (
+            (data_size - padding - spare_size) / entry_size
+        ) : 0
+    );
+
+    *cache = (struct amp_layout_cache_type) {
+        .entry_count = (
+            capacity < entry_count ? (uint32_t) capacity : entry_count
+        ),
+        .max_lines = max_lines
+    };
+
+    if (cache->entry_count) {
+        cache->entries = (struct amp_layout_entry_type *) (
+            (uint8_t *) data + padding
+        );
+        cache->lines = (struct amp_layout_line_type *) (
+            cache->entries + cache->entry_count
+        );
+
+        for (uint32_t i = 0; i < cache->entry_count; ++i) {
+            cache->entries[i] = (struct amp_layout_entry_type) {
+                .lines = i
+            };
+        }
+
+        cache->spare = cache->entry_count;
+    }
+
+    return amp_calc_layout_cache_size(entry_count, max_lines);
+}
+
+static inline void amp_set_layout_cache(
+    struct amp_type *amp, struct amp_layout_cache_type *cache
+) {
+    amp->layout.cache = cache;
+}
+
+static inline struct amp_layout_entry_type *amp_find_layout(
+    struct amp_layout_cache_type *cache,
+    const struct amp_layout_entry_type *key
+) {
+    uint32_t bucket_size;
+    struct amp_layout_entry_type *bucket = amp_layout_bucket(
+        cache, key->hash, &bucket_size
+    );
+
+    for (uint32_t i = 0; i < bucket_size; ++i) {
+        struct amp_layout_entry_type *entry = &bucket[i];
+
+        if (entry->used
+        && entry->hash == key->hash
+        && entry->check == key->check
+        && entry->text_size == key->text_size
+        && entry->max_width == key->max_width
+        && entry->alignment == key->alignment
+        && entry->rich == key->rich) {
+            entry->referenced = true;
+
+            return entry;
+        }
+    }
+
+    return nullptr;
+}
+
+static inline struct amp_layout_entry_type *amp_evict_layout(
+    struct amp_layout_cache_type *cache, uint64_t hash
+) {
+    uint32_t bucket_size;
+    struct amp_layout_entry_type *bucket = amp_layout_bucket(
+        cache, hash, &bucket_size
+    );
+
+    for (;;) {
+        // The clock hand gives each recently used entry a second chance.
+        struct amp_layout_entry_type *entry = &bucket[
+            cache->hand % bucket_size
+        ];
+
+        ++cache->hand;
+
+        if (!entry->used || !entry->referenced) {
+            return entry;
+        }
+
+        entry->referenced = false;
+    }
+}
+
+static inline struct amp_layout_entry_type *amp_layout_bucket(
+    const struct amp_layout_cache_type *cache, uint64_t hash,
+    uint32_t *bucket_size
+) {
+    // The entries are grouped into buckets of AMP_LAYOUT_BUCKET_SIZE, except
+    // for the last bucket, which has the rest of the entries.
+    const uint32_t bucket_count = (
+        (cache->entry_count - 1) / AMP_LAYOUT_BUCKET_SIZE + 1
+    );
+    const uint32_t first = (
+        (uint32_t) (hash % bucket_count) * AMP_LAYOUT_BUCKET_SIZE
+    );
+    const uint32_t rest = cache->entry_count - first;
+
+    *bucket_size = rest < AMP_LAYOUT_BUCKET_SIZE ? rest : (
+        AMP_LAYOUT_BUCKET_SIZE
+    );
+
+    return cache->entries + first;
+}
+
+static inline uint64_t amp_hash_text(
+    const char *str, size_t str_size, uint64_t *check
+) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    uint64_t mix = 0x9e3779b97f4a7c15ULL;
+
+    for (size_t i = 0; i < str_size && str[i]; ++i) {
+        hash ^= (uint8_t) str[i];
+        hash *= 1099511628211ULL;
+
+        // The second hash multiplies by a different odd constant and folds the
+        // high bits back in, so that it rarely collides together with FNV-1a.
+        mix = (mix ^ (uint8_t) str[i]) * 0xff51afd7ed558ccdULL;
+        mix ^= mix >> 29;
+    }
+
+    *check = mix;
+
+    return hash;
+}
+
+static inline struct amp_line_breaker_type amp_init_line_breaker(
+    const char *text_str, size_t text_str_size, uint32_t max_width, bool rich
+) {
+    return (struct amp_line_breaker_type) {
+        .text_end = text_str + text_str_size,
+        .next_line = text_str,
+        .max_width = max_width ? max_width : UINT32_MAX,
+        .rich = rich
+    };
+}
+
+static inline bool amp_break_line(
+    struct amp_line_breaker_type *lb, const char **line_str, size_t *line_size
+) {
+    if (!lb->line) {
+        const char *line = lb->next_line;
+
+        if (lb->last_line || !*line || line >= lb->text_end) {
+            return false;
+        }
+
+        lb->next_line = amp_str_seg_first_line_size(
+            line, (size_t) (lb->text_end - line), &lb->line_size
+        );
+        lb->last_line = lb->next_line <= line;
+        lb->line = line;
+        lb->scan = line;
+        lb->scan_width = 0;
+        lb->scannable = true;
+
+        for (const char *s = line; s < line + lb->line_size;) {
+            // Invalid UTF-8 stops the counting of the code points, which makes
+            // the width of a line something else than the sum of its parts.
+            const int cpsz = amp_utf8_code_point_size(
+                s, (size_t) (line + lb->line_size - s)
+            );
+
+            if (cpsz <= 0) {
+                lb->scannable = false;
+                break;
+            }
+
+            s += cpsz;
+        }
+
+        lb->line_width = (
+            lb->rich ? amp_rich_str_seg_width(line, lb->line_size) :
+            amp_str_seg_width(line, lb->line_size)
+        );
+    }
+
+    const char *line = lb->line;
+    const size_t size = lb->line_size;
+
+    *line_str = line;
+    *line_size = size;
+
+    if (amp_line_breaker_width(lb) <= lb->max_width) {
+        lb->line = nullptr;
+
+        return true;
+    }
+
+    const char *clip_end = (
+        lb->rich ? amp_rich_str_seg_skip_wrap(line, size, lb->max_width) :
+        amp_str_seg_skip_wrap(line, size, lb->max_width)
+    );
+    const size_t clip_size = (size_t) (clip_end - line);
+
+    *line_size = clip_size;
+    lb->line = nullptr;
+
+    if (clip_size < size) {
+        const char *space_end = amp_str_seg_skip_spaces(
+            clip_end, size - clip_size
+        );
+
+        const size_t trail_size = amp_sub_size(
+            size, clip_size + (size_t) (space_end - clip_end)
+        );
+
+        if (trail_size) {
+            // The rest of the line is wrapped onto the following lines.
+            lb->line = space_end;
+            lb->line_size = trail_size;
+        }
+    }
+
+    return true;
+}
+
+static inline size_t amp_line_breaker_width(struct amp_line_breaker_type *lb) {
+    const char *line_end = lb->line + lb->line_size;
+
+    while (lb->scannable && lb->scan < lb->line) {
+        // The scan moves by the same steps as the width calculation does, so
+        // that the width of the rest of the line is known without counting it.
+        const char *s = lb->scan;
+        const char *next = (
+            lb->rich ? amp_str_seg_skip_style_sign(s, (size_t) (line_end - s))
+            : s
+        );
+
+        if (next == s) {
+            next = amp_str_seg_skip_any_utf8_symbol(
+                s, (size_t) (line_end - s)
+            );
+            lb->scan_width += (size_t) amp_utf8_glyph_cells(
+                s, (size_t) (next - s)
+            );
+        }
+        else if (next - s == 1) { // double brace detected
+            ++next;
+            ++lb->scan_width;
+        }
+
+        if (next == s) {
+            break;
+        }
+
+        lb->scan = next;
+    }
+
+    if (lb->scannable && lb->scan == lb->line) {
+        return lb->line_width - lb->scan_width;
+    }
+
+    // The rest of the line has to be measured from scratch.
+    lb->scannable = false;
+
+    return (
+        lb->rich ? amp_rich_str_seg_width(lb->line, lb->line_size) :
+        amp_str_seg_width(lb->line, lb->line_size)
+    );
+}
+
+static inline size_t amp_print_text(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str
+) {
+    return amp_print_text_clip(
+        amp, text_x, text_y, text_style, text_max_width, text_alignment,
+        text_str, strlen(text_str)
+    );
+}
+
+static inline ssize_t amp_snprint_linef(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    AMP_ALIGN text_alignment, char *buf, size_t buf_size, const char *fmt, ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    int ret = vsnprintf(buf, buf_size, fmt, args);
+    va_end(args);
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    if ((size_t) ret >= buf_size) {
+        return (ssize_t) ret;
+    }
+
+    amp_print_line(amp, text_x, text_y, text_style, text_alignment, buf);
+
+    return (ssize_t) ret;
+}
+
+static inline ssize_t amp_snprint_textf(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment,
+    char *buf, size_t buf_size, const char *fmt, ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    int ret = vsnprintf(buf, buf_size, fmt, args);
+    va_end(args);
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    if ((size_t) ret >= buf_size) {
+        return (ssize_t) ret;
+    }
+
+    amp_print_text(
+        amp, text_x, text_y, text_style, text_max_width, text_alignment, buf
+    );
+
+    return (ssize_t) ret;
+}
+
+static inline ssize_t amp_snprint_rich_textf(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment,
+    char *buf, size_t buf_size, const char *fmt, ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    int ret = vsnprintf(buf, buf_size, fmt, args);
+    va_end(args);
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    if ((size_t) ret >= buf_size) {
+        return (ssize_t) ret;
+    }
+
+    amp_print_rich_text(
+        amp, text_x, text_y, text_style, text_max_width, text_alignment, buf
+    );
+
+    return (ssize_t) ret;
+}
+
+static inline ssize_t amp_printf_line(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    AMP_ALIGN text_alignment, const char *fmt, ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    ssize_t ret = amp_vprintf(
+        amp, text_x, text_y, text_style, 0, text_alignment, true, false,
+        fmt, args
+    );
+    va_end(args);
+
+    return ret;
+}
+
+static inline ssize_t amp_printf_text(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *fmt, ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    ssize_t ret = amp_vprintf(
+        amp, text_x, text_y, text_style, text_max_width, text_alignment,
+        false, false, fmt, args
+    );
+    va_end(args);
+
+    return ret;
+}
+
+static inline ssize_t amp_printf_rich_text(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *fmt, ...
+) {
+    va_list args;
+    va_start(args, fmt);
+    ssize_t ret = amp_vprintf(
+        amp, text_x, text_y, text_style, text_max_width, text_alignment,
+        false, true, fmt, args
+    );
+    va_end(args);
+
+    return ret;
+}
+
+static inline ssize_t amp_vprintf(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE text_style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, bool line, bool rich,
+    const char *fmt, va_list args
+) {
+    char buf[AMP_PRINTF_BUF_SIZE];
+    const int ret = vsnprintf(buf, sizeof(buf), fmt, args);
+
+    if (ret < 0) {
+        return -1;
+    }
+
+    // The text that did not fit into the buffer is cut off like by snprintf.
+    const size_t size = (
+        (size_t) ret < sizeof(buf) ? (size_t) ret : amp_sub_size(sizeof(buf), 1)
+    );
+
+    if (line) {
+        amp_print_line_clip(
+            amp, text_x, text_y, text_style, text_alignment, buf, size
+        );
+    }
+    else {
+        amp_print_text_lines(
+            amp, text_x, text_y, &text_style, text_max_width, text_alignment,
+            buf, size, rich
+        );
+    }
+
+    return (ssize_t) ret;
+}
+
+static inline size_t amp_print_rich_text(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE style,
+    uint32_t text_max_width, AMP_ALIGN text_alignment, const char *text_str
+) {
+    return amp_print_rich_text_clip(
+        amp, text_x, text_y, &style, text_max_width, text_alignment,
+        text_str, strlen(text_str)
+    );
+}
+
+static inline size_t amp_measure_text(
+    const char *text_str, uint32_t text_max_width, uint32_t *text_width,
+    size_t *line_offsets, size_t line_offset_count
+) {
+    return amp_measure_text_lines(
+        text_str, text_max_width, text_width, line_offsets, line_offset_count,
+        false
+    );
+}
+
+static inline size_t amp_measure_rich_text(
+    const char *text_str, uint32_t text_max_width, uint32_t *text_width,
+    size_t *line_offsets, size_t line_offset_count
+) {
+    return amp_measure_text_lines(
+        text_str, text_max_width, text_width, line_offsets, line_offset_count,
+        true
+    );
+}
+
+static inline size_t amp_measure_text_lines(
+    const char *text_str, uint32_t text_max_width, uint32_t *text_width,
+    size_t *line_offsets, size_t line_offset_count, bool rich
+) {
+    struct amp_line_breaker_type breaker = amp_init_line_breaker(
+        text_str, strlen(text_str), text_max_width, rich
+    );
+
+    const char *line;
+    size_t line_size;
+    size_t line_count = 0;
+    uint32_t max_line_width = 0;
+
+    for (; amp_break_line(&breaker, &line, &line_size); ++line_count) {
+        if (text_width) {
+            // The lines are measured the same way as they are for alignment.
+            const uint32_t line_width = (uint32_t) (
+                rich ? (
+                    amp_utf8_width(line, line_size) -
+                    amp_str_seg_style_sign_count(line, line_size)
+                ) : amp_utf8_width(line, line_size)
+            );
+
+            if (line_width > max_line_width) {
+                max_line_width = line_width;
+            }
+        }
+
+        if (line_offsets && line_count < line_offset_count) {
+            line_offsets[line_count] = (size_t) (line - text_str);
+        }
+    }
+
+    if (text_width) {
+        *text_width = max_line_width;
+    }
+
+    return line_count;
+}
+
+static inline size_t amp_rich_text_compile(
+    struct amp_rich_text_type *text, uint32_t text_max_width,
+    AMP_ALIGN text_alignment, const char *text_str, void *data,
+    size_t data_size
+) {
+    struct amp_rich_text_type counts = {};
+
+    amp_compile_rich_text(
+        text_max_width, text_alignment, text_str, nullptr, nullptr, &counts
+    );
+
+    const size_t padding = (
+        (
+            alignof(struct amp_rich_text_run_type) -
+            (uintptr_t) data % alignof(struct amp_rich_text_run_type)
+        ) % alignof(struct amp_rich_text_run_type)
+    );
+    const size_t run_data_size = (
+        counts.run_count * sizeof(struct amp_rich_text_run_type)
+    );
+    const size_t glyph_data_size = counts.glyph_count * AMP_CELL_GLYPH_SIZE;
+
+    *text = (struct amp_rich_text_type) {};
+
+    if (data && data_size >= padding
+    && data_size - padding >= run_data_size + glyph_data_size) {
+        struct amp_rich_text_run_type *runs = (
+            (struct amp_rich_text_run_type *) ((uint8_t *) data + padding)
+        );
+
+        amp_compile_rich_text(
+            text_max_width, text_alignment, text_str, runs,
+            (char *) runs + run_data_size, text
+        );
+    }
+
+    return (
+        alignof(struct amp_rich_text_run_type) - 1 + run_data_size +
+        glyph_data_size
+    );
+}
+
+static inline size_t amp_print_compiled(
+    struct amp_type *amp, long text_x, long text_y, AMP_STYLE style,
+    const struct amp_rich_text_type *text
+) {
+    for (size_t i = 0; i < text->run_count; ++i) {
+        const struct amp_rich_text_run_type *run = &text->runs[i];
+        const long y = text_y + (long) run->line;
+
+        if (y < 0 || y >= amp->height) {
+            // The style markers of the lines outside of the ansmap are ignored.
+            continue;
+        }
+
+        const AMP_STYLE run_style = (style & run->keep) | run->set;
+
+        if (!run->size) {
+            style = run_style; // The line ends here.
+            continue;
+        }
+
+        uint8_t set[AMP_CELL_MODE_SIZE];
+        uint8_t keep[AMP_CELL_MODE_SIZE];
+
+        // The glyphs were validated when the text was compiled, so the whole
+        // run is copied into the row with the masks made once for the run.
+        amp_glyph_mode_mask(run_style, set, keep);
+        amp_print_cell_run(
+            amp, text_x + run->x, y,
+            text->glyphs + run->glyph * AMP_CELL_GLYPH_SIZE, run->size, set,
+            keep
+        );
+    }
+
+    return text->line_count;
+}
+
+static inline void amp_compile_rich_text(
+    uint32_t max_width, AMP_ALIGN align, const char *text_str,
+    struct amp_rich_text_run_type *runs, char *glyphs,
+    struct amp_rich_text_type *rich_text
+) {
+    // The lines are parsed the same way as amp_print_rich_line_clip does it,
+    // but the glyphs are stored along with the changes to the style instead of
+    // being printed. Without the buffers, only the runs and glyphs are counted.
+    struct amp_line_breaker_type breaker = amp_init_line_breaker(
+        text_str, strlen(text_str), max_width, true
+    );
+
+    const char *text;
+    size_t text_size;
+    size_t run_count = 0;
+    size_t glyph_count = 0;
+    size_t line = 0;
+
+    for (; amp_break_line(&breaker, &text, &text_size); ++line) {
+        const uint32_t text_width = (uint32_t) (
+            amp_utf8_width(text, text_size) -
+            amp_str_seg_style_sign_count(text, text_size)
+        );
+
+        long x = 0;
+
+        if (align == AMP_ALIGN_RIGHT) {
+            x = (x - text_width) + 1;
+        }
+        else if (align == AMP_ALIGN_CENTER) {
+            x -= text_width / 2;
+        }
+
+        const char *s = text;
+        AMP_STYLE keep = amp_all_styles;
+        AMP_STYLE set = 0;
+        bool run_open = false;
+
+        while (*s && s < text + text_size) {
+            const char *next = amp_str_seg_skip_style_sign(
+                s, text_size - (size_t) (s - text)
+            );
+
+            if (next > text + text_size) {
+                break;
+            }
+
+            int glyph_size = 1;
+
+            if (s == next) { // no style sign detected
+                next = amp_str_seg_skip_any_utf8_symbol(
+                    s, text_size - (size_t) (s - text)
+                );
+
+                if (s == next) {
+                    break;
+                }
+
+                glyph_size = amp_utf8_code_point_size(
+                    s, amp_sub_size(text_size, (size_t) (s - text))
+                );
+
+                if (glyph_size < 0) {
+                    break;
+                }
+            }
+            else if (next - s == 1) { // double brace detected
+                ++next;
+            }
+            else {
+                AMP_STYLE new_keep = keep;
+                AMP_STYLE new_set = set;
+
+                amp_apply_inline_style(
+                    &new_keep, &new_set, amp_lookup_inline_style(s+1).style
+                );
+
+                // A new run begins only if the style changes.
+                run_open = run_open && new_keep == keep && new_set == set;
+                keep = new_keep;
+                set = new_set;
+                s = next;
+                continue;
+            }
+
+            if (!run_open) {
+                if (runs) {
+                    runs[run_count] = (struct amp_rich_text_run_type) {
+                        .line = line,
+                        .x = x,
+                        .glyph = glyph_count,
+                        .keep = keep,
+                        .set = set
+                    };
+                }
+
+                ++run_count;
+                run_open = true;
+            }
+
+            // The tail of a wide glyph is stored as a cell of its own.
+            const int cells = amp_utf8_glyph_cells(s, (size_t) glyph_size);
+
+            if (runs) {
+                char *cell = glyphs + glyph_count * AMP_CELL_GLYPH_SIZE;
+
+                memset(cell, 0, AMP_CELL_GLYPH_SIZE);
+                memcpy(cell, s, (size_t) glyph_size);
+
+                if (glyph_size == 1 && !isprint(*s)) {
+                    // The glyph is stored the way amp_prepare_glyph makes it.
+                    cell[0] = '?';
+                }
+
+                if (cells > 1) {
+                    memcpy(
+                        cell + AMP_CELL_GLYPH_SIZE, amp_glyph_tail,
+                        AMP_CELL_GLYPH_SIZE
+                    );
+                }
+
+                runs[run_count - 1].size += (uint32_t) cells;
+            }
+
+            glyph_count += (size_t) cells;
+            x += cells;
+            s = next;
+        }
+
+        if (runs) {
+            runs[run_count] = (struct amp_rich_text_run_type) {
+                .line = line,
+                .keep = keep,
+                .set = set
+            };
+        }
+
+        ++run_count;
+    }
+
+    *rich_text = (struct amp_rich_text_type) {
+        .runs = runs,
+        .run_count = run_count,
+        .glyphs = glyphs,
+        .glyph_count = glyph_count,
+        .line_count = line
+    };
+}
+
+static inline void amp_apply_inline_style(
+    AMP_STYLE *keep, AMP_STYLE *set, AMP_STYLE new_style
+) {
+    // The change is recorded as the bits of the previous style to keep and the
+    // bits to set, so that it can be applied to any style later on.
+    if (!new_style) {
+        return;
+    }
+
+    if (new_style & AMP_HARD_RESET) {
+        *keep = 0; // Reset foreground, background and decoration.
+        *set = 0;
+        new_style &= ~AMP_HARD_RESET;
+    }
+
+    if (new_style & AMP_SOFT_RESET) {
+        // Reset foreground and decoration. Leave background as is.
+        *keep &= amp_bg_color_styles;
+        *set &= amp_bg_color_styles;
+        new_style &= ~AMP_SOFT_RESET;
+    }
+
+    if (new_style & amp_fg_color_styles) {
+        // New style includes foreground color. Clear the old color.
+        *keep &= ~amp_fg_color_styles;
+        *set &= ~amp_fg_color_styles;
+    }
+
+    if (new_style & amp_bg_color_styles) {
+        // New style includes background color. Clear the old color.
+        *keep &= ~amp_bg_color_styles;
+        *set &= ~amp_bg_color_styles;
+    }
+
+    *set |= new_style;
+}
+
+static inline size_t amp_str_append(
+    char *str_dst, size_t str_dst_size, const char *str_src
+) {
+    const size_t str_src_size = strlen(str_src);
+
+    if (str_src_size >= str_dst_size) {
+        // No space for the terminating zero.
+
+        if (str_dst_size) {
+            *str_dst = '\0';
+        }
+    }
+    else {
+        memcpy(str_dst, str_src, str_src_size + 1);
+    }
+
+    return (
+        // The number of characters that would have been written if
+        // str_dst_size had been sufficiently large, not counting the
+        // terminating null character.
+        str_src_size
+    );
+}
+
+static inline struct amp_mode_code_type amp_mode_to_codes(
+    struct amp_mode_type mode, AMP_PALETTE pal
+) {
+    const struct {
+        uint8_t code;
+        bool    enabled;
+    } styles[] = {
+        { 8, mode.bitset.hidden        },
+        { 2, mode.bitset.faint         },
+        { 3, mode.bitset.italic        },
+        { 4, mode.bitset.underline     },
+        { 5, mode.bitset.blinking      },
+        { 9, mode.bitset.strikethrough }
+    };
+
+    struct amp_mode_code_type codes = {};
+
+    for (size_t i=0; i<sizeof(styles)/sizeof(styles[0]); ++i) {
+        auto const value = styles[i];
+
+        if (!value.enabled) {
+            continue;
+        }
+
+        codes.style.data[codes.style.size++] = value.code;
+    }
+
+    if (pal == AMP_PAL_24BIT) {
+        if (mode.bitset.fg) {
+            codes.color.fg.data[codes.color.fg.size++] = 38;
+            codes.color.fg.data[codes.color.fg.size++] = 2;
+            codes.color.fg.data[codes.color.fg.size++] = mode.fg.r;
+            codes.color.fg.data[codes.color.fg.size++] = mode.fg.g;
+            codes.color.fg.data[codes.color.fg.size++] = mode.fg.b;
+        }
+
+        if (mode.bitset.bg) {
+            codes.color.bg.data[codes.color.bg.size++] = 48;
+            codes.color.bg.data[codes.color.bg.size++] = 2;
+            codes.color.bg.data[codes.color.bg.size++] = mode.bg.r;
+            codes.color.bg.data[codes.color.bg.size++] = mode.bg.g;
+            codes.color.bg.data[codes.color.bg.size++] = mode.bg.b;
+        }
+    }
+    else {
+        if (mode.bitset.bg) {
+            struct amp_color_type bg_color_row = amp_find_color(mode.bg);
+
+            if (bg_color_row.bitset.bright) {
+                struct amp_rgb_type buf = mode.bg;
+                mode.bg = mode.fg;
+                mode.fg = buf;
+                mode.bitset.bg = mode.bitset.fg;
+                mode.bitset.fg = true;
+
+                codes.style.data[codes.style.size++] = 7; // inverse video
+            }
+        }
+
+        if (mode.bitset.fg) {
+            auto fg_color_row = amp_find_color(mode.fg);
+
+            if (fg_color_row.bitset.bright) {
+                codes.style.data[codes.style.size++] = 1; // bold foreground
+            }
+
+            codes.color.fg.data[codes.color.fg.size++] = fg_color_row.code.fg;
+        }
+
+        if (mode.bitset.bg) {
+            struct amp_color_type bg_color_row = amp_find_color(mode.bg);
+
+            codes.color.bg.data[codes.color.bg.size++] = bg_color_row.code.bg;
+        }
+    }
+
+    return codes;
+}
+
+static inline struct amp_mode_code_type amp_mode_code_update(
+    struct amp_mode_code_type next_codes, struct amp_mode_code_type prev_codes
+) {
+    struct amp_mode_code_type codes = {};
+
+    do {
+        const uint8_t n_fg = next_codes.color.fg.size;
+        const uint8_t n_bg = next_codes.color.bg.size;
+
+        if (n_fg) {
+            uint8_t *prev_fg_data = prev_codes.color.fg.data;
+            uint8_t *next_fg_data = next_codes.color.fg.data;
+
+            if (prev_codes.color.fg.size && n_fg != prev_codes.color.fg.size) {
+                // Color palette has changed. Full reset is needed.
+                break;
+            }
+
+            if (n_fg != prev_codes.color.fg.size
+            || memcmp(next_fg_data, prev_fg_data, n_fg)) {
+                memcpy(codes.color.fg.data, next_fg_data, n_fg);
+                codes.color.fg.size = n_fg;
+            }
+        }
+        else if (prev_codes.color.fg.size) {
+            // Foreground color is no longer set. Full reset is needed.
+            break;
+        }
+
+        if (n_bg) {
+            uint8_t *prev_bg_data = prev_codes.color.bg.data;
+            uint8_t *next_bg_data = next_codes.color.bg.data;
+
+            if (prev_codes.color.bg.size && n_bg != prev_codes.color.bg.size) {
+                // Color palette has changed. Full reset is needed.
+                break;
+            }
+
+            if (n_bg != prev_codes.color.bg.size
+            || memcmp(next_bg_data, prev_bg_data, n_bg)) {
+                memcpy(codes.color.bg.data, next_bg_data, n_bg);
+                codes.color.bg.size = n_bg;
+            }
+        }
+        else if (prev_codes.color.bg.size) {
+            // Background color is no longer set. Full reset is needed.
+            break;
+        }
+
+        // First, let's see if any of the style codes has gone missing.
+        bool missing = false;
+
+        for (size_t i=0; i<prev_codes.style.size; ++i) {
+            bool found = false;
+
+            for (size_t j=0; j<next_codes.style.size; ++j) {
+                if (next_codes.style.data[j] == prev_codes.style.data[i]) {
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found) {
+                missing = true;
+                break;
+            }
+        }
+
+        if (missing) {
+            // A style code is no longer present. Full reset is needed.
+            break;
+        }
+
+        for (size_t i=0; i<next_codes.style.size; ++i) {
+            bool found = false;
+
+            for (size_t j=0; j<prev_codes.style.size; ++j) {
+                if (prev_codes.style.data[j] == next_codes.style.data[i]) {
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found) {
+                codes.style.data[codes.style.size++] = next_codes.style.data[i];
+            }
+        }
+
+        return codes;
+    } while (false);
+
+    codes = next_codes;
+    codes.bitset.reset = true;
+
+    return codes;
+}
+
+static inline size_t amp_mode_codes_to_ans(
+    struct amp_mode_code_type codes, char *ans_dst, size_t ans_dst_size
+) {
+    char ans[256];
+    size_t ans_size = 0;
+
+    if (codes.bitset.reset) {
+        ans_size += (
+            ans_size ? amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+            ) : 0
+        );
+
+        ans_size += amp_str_append(
+            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+            amp_number_table[0]
+        );
+    }
+
+    for (size_t i=0; i<codes.style.size; ++i) {
+        ans_size += (
+            ans_size ? amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+            ) : 0
+        );
+
+        ans_size += amp_str_append(
+            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+            amp_number_table[codes.style.data[i]]
+        );
+    }
+
+    for (size_t i=0; i<codes.color.fg.size; ++i) {
+        ans_size += (
+            ans_size ? amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+            ) : 0
+        );
+
+        ans_size += amp_str_append(
+            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+            amp_number_table[codes.color.fg.data[i]]
+        );
+    }
+
+    for (size_t i=0; i<codes.color.bg.size; ++i) {
+        ans_size += (
+            ans_size ? amp_str_append(
+                ans + ans_size, amp_sub_size(sizeof(ans), ans_size), ";"
+            ) : 0
+        );
+
+        ans_size += amp_str_append(
+            ans + ans_size, amp_sub_size(sizeof(ans), ans_size),
+            amp_number_table[codes.color.bg.data[i]]
+        );
+    }
+
+    size_t written = 0;
+
+    if (ans_size) {
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), AMP_ESC "["
+        );
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), ans
+        );
+
+        written += amp_str_append(
+            ans_dst + written, amp_sub_size(ans_dst_size, written), "m"
+        );
+    }
+
+    if (written >= ans_dst_size || !written) {
+        if (ans_dst_size) {
+            *ans_dst = '\0';
+        }
+    }
+
+    return written;
+}
+
+static inline ssize_t amp_stdout(const char *str_src, size_t str_src_size) {
+    size_t n = 0;
+
+    for (; n < str_src_size;) {
+        ssize_t written = write(STDOUT_FILENO, str_src + n, str_src_size - n);
+
+        if (written <= 0) {
+            break;
+        }
+
+        n += (size_t) written;
+    }
+
+    return n == str_src_size ? (ssize_t) n : -1;
+}
+
+static inline ssize_t amp_clip_to_ans(
+    const struct amp_type *amp, long x, long y, uint32_t width,
+    char *ans_dst, size_t ans_dst_size
+) {
+    if ((ans_dst >= (char *) amp->canvas.glyph.data
+      && ans_dst <  (char *) amp->canvas.glyph.data + amp->canvas.glyph.size)
+    ||  (ans_dst >= (char *) amp->canvas.mode.data
+      && ans_dst <  (char *) amp->canvas.mode.data + amp->canvas.mode.size)) {
+        abort(); // Overwriting its own memory is a fatal error.
+    }
+
+    const bool ans_to_stdout = (
+        ans_dst == (char *) amp->buffer + sizeof(amp->buffer)
+    );
+
+    const uint32_t amp_width = amp->width;
+    const long end_x = (
+        width ? (x + width > amp_width ? amp_width : x + width) : amp_width
+    );
+
+    char glyph_data[AMP_CELL_GLYPH_SIZE];
+    char mode_ans[256];
+    struct amp_mode_code_type prev_mode_codes = {};
+    size_t ans_size = 0;
+    bool covered = false;
+
+    for (; x < end_x; ++x) {
+        if (covered) {
+            covered = false; // The wide glyph before covers this cell.
+            continue;
+        }
+
+        auto next_mode_codes = amp_mode_to_codes(
+            amp_get_mode(amp, x, y), amp->palette
+        );
+
+        auto add_mode_codes = amp_mode_code_update(
+            next_mode_codes, prev_mode_codes
+        );
+
+        prev_mode_codes = next_mode_codes;
+
+        const size_t mode_ans_size = amp_mode_codes_to_ans(
+            add_mode_codes, mode_ans, sizeof(mode_ans)
+        );
+
+        if (mode_ans_size >= sizeof(mode_ans)) {
+            abort(); // The mode_ans buffer should fit any mode.
+        }
+        else if (mode_ans_size) {
+            if (ans_to_stdout) {
+                if (amp_stdout(mode_ans, mode_ans_size) < 0) {
+                    return -1;
+                }
+
+                ans_size += mode_ans_size;
+            }
+            else {
+                ans_size += amp_str_append(
+                    ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
+                    mode_ans
+                );
+            }
+        }
+
+        const ssize_t glyph_size = amp_copy_glyph(
+            amp, x, y, (uint8_t *) glyph_data, sizeof(glyph_data)
+        );
+
+        if (glyph_size > 2 && x + 1 < end_x && amp_has_glyph_tail(amp, x, y)) {
+            covered = true;
+        }
+
+        if (glyph_size <= 0
+        ||  glyph_size >= (ssize_t) sizeof(glyph_data)
+        ||  amp_is_glyph_tail(glyph_data) // The wide glyph before is clipped.
+        || (glyph_size == 1 && !isprint((unsigned char) *glyph_data))
+        || (glyph_size > 2 && !covered
+        &&  amp_utf8_glyph_cells(glyph_data, (size_t) glyph_size) > 1)) {
+            // A wide glyph is only drawn along with its tail.
+            const char *space = " ";
+            const size_t space_size = strlen(space);
+
+            if (ans_to_stdout) {
+                if (amp_stdout(space, space_size) < 0) {
+                    return -1;
+                }
+
+                ans_size += space_size;
+            }
+            else {
+                ans_size += amp_str_append(
+                    ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
+                    space
+                );
+            }
+
+            continue;
+        }
+
+        if (ans_to_stdout) {
+            if (amp_stdout(glyph_data, (size_t) glyph_size) < 0) {
+                return -1;
+            }
+
+            ans_size += (size_t) glyph_size;
+        }
+        else {
+            ans_size += amp_str_append(
+                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
+                glyph_data
+            );
+        }
+    }
+
+    if (prev_mode_codes.style.size
+    ||  prev_mode_codes.color.bg.size
+    ||  prev_mode_codes.color.fg.size) {
+        const char *esc_reset = AMP_ESC "[0m";
+        const size_t esc_reset_size = strlen(esc_reset);
+
+        if (ans_to_stdout) {
+            if (amp_stdout(esc_reset, strlen(esc_reset)) < 0) {
+                return -1;
+            }
+
+            ans_size += esc_reset_size;
+        }
+        else {
+            ans_size += amp_str_append(
+                ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
+                esc_reset
+            );
+
+            if (ans_size >= ans_dst_size || !ans_size) {
+                if (ans_dst_size) {
+                    *ans_dst = '\0';
+                }
+            }
+        }
+    }
+
+    return (
+        // The number of characters that would have been written if
+        // ans_dst_size had been sufficiently large, not counting the
+        // terminating null character.
+        ans_size > SSIZE_MAX ? -1 : (ssize_t) ans_size
+    );
+}
+
+static inline ssize_t amp_row_to_ans(
+    const struct amp_type *amp, long y, char *ans_dst, size_t ans_dst_size
+) {
+    return (
+        // The number of characters that would have been written if
+        // ans_dst_size had been sufficiently large, not counting the
+        // terminating null character. Returns -1 on error.
+        amp_clip_to_ans(amp, 0, y, amp->width, ans_dst, ans_dst_size)
+    );
+}
+
+static inline size_t amp_sub_size(size_t a, size_t b) {
+    size_t result;
+    return ckd_sub(&result, a, b) ? 0 : result;
+}
+
+static inline ssize_t amp_to_ans(
+    const struct amp_type *amp, char *ans_dst, size_t ans_dst_size
+) {
+    if (ans_dst == nullptr) {
+        ans_dst = (char *) amp->buffer + sizeof(amp->buffer);
+        ans_dst_size = 0;
+    }
+    else {
+        uint8_t *dst = (uint8_t *) ans_dst;
+
+        if ((dst >= amp->canvas.glyph.data
+          && dst <  amp->canvas.glyph.data + amp->canvas.glyph.size)
+        ||  (dst >= amp->canvas.mode.data
+          && dst <  amp->canvas.mode.data + amp->canvas.mode.size)) {
+            abort(); // Overwriting its own memory is a fatal error.
+        }
+    }
+
+    const bool ans_to_stdout = (
+        ans_dst == (char *) amp->buffer + sizeof(amp->buffer)
+    );
+
+    size_t ans_size = 0;
+
+    for (uint32_t y = 0; y < amp->height; ++y) {
+        ssize_t size = amp_row_to_ans(
+            amp, y, ans_to_stdout ? ans_dst : ans_dst + ans_size,
+            amp_sub_size(ans_dst_size, ans_size)
+        );
+
+        if (size < 0) {
+            return -1;
+        }
+
+        ans_size += (size_t) size;
+
+        if (y + 1 < amp->height) {
+            const char *crlf = "\r\n";
+            const size_t crlf_size = strlen(crlf);
+
+            if (ans_to_stdout) {
+                if (amp_stdout(crlf, crlf_size) < 0) {
+                    return -1;
+                }
+
+                ans_size += crlf_size;
+            }
+            else {
+                ans_size += amp_str_append(
+                    ans_dst + ans_size, amp_sub_size(ans_dst_size, ans_size),
+                    crlf
+                );
+            }
+        }
+    }
+
+    if (!ans_to_stdout) {
+        if (ans_size >= ans_dst_size || !ans_size) {
+            if (ans_dst_size) {
+                *ans_dst = '\0';
+            }
+        }
+    }
+
+    return ans_size > SSIZE_MAX ? -1 : (ssize_t) ans_size;
+}
+
+static inline struct amp_mode_type amp_mode_cell_deserialize(
+    const uint8_t *data, size_t data_size
+) {
+    return (struct amp_mode_type) {
+        .fg = {
+            .r = data_size > 0 ? data[0] : 0,
+            .g = data_size > 1 ? data[1] : 0,
+            .b = data_size > 2 ? data[2] : 0
+        },
+        .bg = {
+            .r = data_size > 3 ? data[3] : 0,
+            .g = data_size > 4 ? data[4] : 0,
+            .b = data_size > 5 ? data[5] : 0
+        },
+        .bitset = {
+            .fg             = data_size > 6 ? data[6] & (1 << 0) : 0,
+            .bg             = data_size > 6 ? data[6] & (1 << 1) : 0,
+            .hidden         = data_size > 6 ? data[6] & (1 << 2) : 0,
+            .faint          = data_size > 6 ? data[6] & (1 << 3) : 0,
+            .italic         = data_size > 6 ? data[6] & (1 << 4) : 0,
+            .underline      = data_size > 6 ? data[6] & (1 << 5) : 0,
+            .blinking       = data_size > 6 ? data[6] & (1 << 6) : 0,
+            .strikethrough  = data_size > 6 ? data[6] & (1 << 7) : 0,
+            .broken         = data_size < AMP_CELL_MODE_SIZE
+        }
+    };
+}
+
+static inline bool amp_mode_cell_serialize(
+    struct amp_mode_type cell, uint8_t *dst, size_t dst_size
+) {
+    if (dst_size < AMP_CELL_MODE_SIZE) {
+        return false;
+    }
+
+    dst[0] = cell.fg.r;
+    dst[1] = cell.fg.g;
+    dst[2] = cell.fg.b;
+    dst[3] = cell.bg.r;
+    dst[4] = cell.bg.g;
+    dst[5] = cell.bg.b;
+    dst[6] = (
+        (cell.bitset.fg             ? (1 << 0) : 0) |
+        (cell.bitset.bg             ? (1 << 1) : 0) |
+        (cell.bitset.hidden         ? (1 << 2) : 0) |
+        (cell.bitset.faint          ? (1 << 3) : 0) |
+        (cell.bitset.italic         ? (1 << 4) : 0) |
+        (cell.bitset.underline      ? (1 << 5) : 0) |
+        (cell.bitset.blinking       ? (1 << 6) : 0) |
+        (cell.bitset.strikethrough  ? (1 << 7) : 0)
+    );
+    dst[7] = 0; // temporarily used when decoding style layers
+
+    return true;
+}
+
+static inline struct amp_color_type amp_find_color(struct amp_rgb_type rgb) {
+    long best_d = LONG_MAX;
+    size_t best_row = 0;
+
+    for (size_t i=0; i<AMP_MAX_COLOR; ++i) {
+        auto const row = amp_color_table[i];
+
+        if (row.index == AMP_COLOR_NONE) {
+            continue;
+        }
+
+        long dr = rgb.r - row.rgb.r;
+        long dg = rgb.g - row.rgb.g;
+        long db = rgb.b - row.rgb.b;
+        long d = 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+
+        if (d < best_d) {
+            best_d = d;
+            best_row = i;
+        }
+    }
+
+    return amp_color_table[best_row];
+}
+
+static inline struct amp_color_type amp_lookup_color(AMP_COLOR index) {
+    return (
+        index < AMP_MAX_COLOR ? (
+            amp_color_table[index]
+        ) : amp_color_table[AMP_COLOR_NONE]
+    );
+}
+
+static inline struct amp_inline_style_type amp_lookup_inline_style(
+    const char *glyph
+) {
+    uint8_t glyph_data[AMP_CELL_GLYPH_SIZE];
+    uint8_t glyph_data_size = 0;
+
+    for (; glyph_data_size < sizeof(glyph_data); ++glyph_data_size) {
+        glyph_data[glyph_data_size] = (uint8_t) glyph[glyph_data_size];
+
+        if (glyph_data[glyph_data_size] == 0) {
+            break;
+        }
+    }
+
+    int code_point_size = amp_utf8_code_point_size(
+        (const char *) glyph_data, glyph_data_size
+    );
+
+    if (code_point_size < 0 || (size_t) code_point_size >= sizeof(glyph_data)) {
+        return amp_inline_style_table[0];
+    }
+
+    constexpr size_t table_size = (
+        sizeof(amp_inline_style_table)/sizeof(amp_inline_style_table[0])
+    );
+
+    glyph_data[code_point_size] = 0;
+    glyph_data_size = (uint8_t) code_point_size;
+
+    if (glyph_data_size == 1) {
+        char index = (char) glyph_data[0];
+
+        if (index < 0 || (size_t) index >= table_size) {
+            return amp_inline_style_table[0];
+        }
+
+        return amp_inline_style_table[(size_t) index];
+    }
+
+    return amp_inline_style_table[0];
+}
+
+static inline struct amp_color_combo_type amp_lookup_color_combo(
+    struct amp_rgb_type rgb
+) {
+    constexpr size_t cube_w = 8;
+    constexpr size_t cluster_w = cube_w;
+    constexpr size_t cluster_h = cube_w;
+    constexpr size_t table_size = (
+        sizeof(amp_color_combo_table)/sizeof(amp_color_combo_table[0])
+    );
+
+    size_t cluster_x = rgb.r / (256 / cube_w);
+    size_t cluster_y = rgb.g / (256 / cube_w);
+    size_t cluster_z = rgb.b / (256 / cube_w);
+
+    const size_t cluster_i = (
+        (cluster_z * cluster_h + cluster_y) * cluster_w + cluster_x
+    );
+
+    return (
+        cluster_i >= table_size ? (
+            (struct amp_color_combo_type) {}
+        ) : amp_color_combo_table[cluster_i]
+    );
+}
+
+static inline struct amp_rgb_type amp_map_rgb(
+    uint8_t r, uint8_t g, uint8_t b
+) {
+    return (struct amp_rgb_type) { .r = r, .g = g, .b = b };
+}
+
+static inline void amp_unmap_rgb(
+    struct amp_rgb_type color, uint8_t * r, uint8_t * g, uint8_t * b
+) {
+    *r = color.r;
+    *g = color.g;
+    *b = color.b;
+}
+
+static inline const char *amp_str_seg_first_line_size(
+    const char *str, size_t str_sz, size_t *line_size
+) {
+    const char *begin = str;
+    const char *found = nullptr;
+    char after_found;
+
+    const char *s = str;
+
+    while (*s && s < str + str_sz) {
+        if (*s == '\n') {
+            found = s;
+            after_found = '\r';
+            break;
+        }
+        else if (*s == '\r') {
+            found = s;
+            after_found = '\n';
+            break;
+        }
+
+        ++s;
+    }
+
+    if (found) {
+        if (*(s + 1) == after_found) {
+            s += 2;
+        }
+        else {
+            s += 1;
+        }
+    }
+
+    if (line_size) {
+        *line_size = found ? (size_t) (found - begin) : (size_t) (s - begin);
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_any_utf8_symbol(
+    const char *str, size_t str_sz
+) {
+    if (!str_sz) {
+        return str;
+    }
+
+    int sz = amp_utf8_code_point_size(str, str_sz);
+
+    if (sz == 0) {
+        return str;
+    }
+    else if (sz < 0) {
+        return str + 1;
+    }
+
+    return str + sz;
+}
+
+static inline const char *amp_str_seg_skip_str(
+    const char *str_seg, size_t str_seg_sz, const char *str
+) {
+    const size_t str_sz = strlen(str);
+    const size_t min_sz = str_seg_sz < str_sz ? str_seg_sz : str_sz;
+
+    if (strncmp(str_seg, str, min_sz) == 0) {
+        return str_seg + str_sz;
+    }
+
+    return str_seg;
+}
+
+static inline size_t amp_str_seg_style_sign_count(
+    const char *str, size_t segment_sz
+) {
+    // return the number of zero-width rich text code symbols embedded in 'str'
+
+    const char *s = str;
+    size_t count = 0;
+
+    while (*s && s < str + segment_sz) {
+        const char *next = amp_str_seg_skip_style_sign(
+            s, segment_sz - (size_t) (s - str)
+        );
+
+        if (next > str + segment_sz) {
+            break;
+        }
+
+        if (s == next) { // no style sign detected
+            next = amp_str_seg_skip_any_utf8_symbol(
+                s, segment_sz - (size_t) (s - str)
+            );
+
+            if (s == next) {
+                break;
+            }
+
+            s = next;
+            continue;
+        }
+        else if (next - s == 1) { // double brace detected
+            ++count; // double braces '{{' count for one style sign
+
+            if (*next != '{') {
+                abort();
+            }
+
+            s = next + 1;
+            continue;
+        }
+
+        size_t diff = (size_t) (next - s);
+
+        count += amp_utf8_width(s, diff);
+
+        s = next;
+    }
+
+    return count;
+}
+
+static inline size_t amp_str_seg_width(const char *str, size_t str_sz) {
+    const char *s = str;
+    size_t width = 0;
+
+    while (*s && s < str + str_sz) {
+        size_t linesz;
+        const char *next_line = amp_str_seg_first_line_size(
+            s, str_sz - (size_t) (s - str), &linesz
+        );
+
+        size_t line_width = amp_utf8_width(s, linesz);
+
+        width = width > line_width ? width : line_width;
+
+        if (next_line <= s) {
+            break;
+        }
+
+        s = next_line;
+    }
+
+    return width;
+}
+
+static inline size_t amp_rich_str_seg_width(const char *str, size_t str_sz) {
+    const char *s = str;
+    size_t width = 0;
+
+    while (*s && s < str + str_sz) {
+        size_t linesz;
+        const char *next_line = amp_str_seg_first_line_size(
+            s, str_sz - (size_t) (s - str), &linesz
+        );
+
+        size_t line_width = (
+            amp_utf8_width(s, linesz) -
+            amp_str_seg_style_sign_count(s, linesz)
+        );
+
+        width = width > line_width ? width : line_width;
+
+        if (next_line <= s) {
+            break;
+        }
+
+        s = next_line;
+    }
+
+    return width;
+}
+
+static inline const char *amp_str_seg_skip_spaces(
+    const char *str, size_t str_sz
+) {
+    const char *s = str;
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_any_utf8_symbol(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        if (next == s) {
+            break;
+        }
+
+        --next;
+
+        if (*next != ' ') {
+            return s;
+        }
+
+        s = next + 1;
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_word(
+    const char *str, size_t str_sz
+) {
+    const char *s = amp_str_seg_skip_spaces(str, str_sz);
+
+    if (s != str) {
+        return str;
+    }
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_any_utf8_symbol(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        if (next == s) {
+            return s;
+        }
+
+        --next;
+
+        if (*next == ' ') {
+            return s;
+        }
+
+        s = next + 1;
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_width(
+    const char *str, size_t str_sz, size_t max_width
+) {
+    const char *s = str;
+    size_t width = 0;
+
+    while (*s && s < str + str_sz) {
+        if (width >= max_width) {
+            break;
+        }
+
+        const char *next = amp_str_seg_skip_any_utf8_symbol(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        if (next == s) {
+            break;
+        }
+
+        const size_t cells = (size_t) amp_utf8_glyph_cells(
+            s, (size_t) (next - s)
+        );
+
+        if (width && width + cells > max_width) {
+            break; // A wide glyph does not fit on the rest of the line.
+        }
+
+        width += cells;
+        s = next;
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_wrap(
+    const char *str, size_t str_sz, size_t wrap_width
+) {
+    const char *s = str;
+    size_t width = 0;
+    size_t max_width = wrap_width;
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_spaces(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        next = amp_str_seg_skip_word(next, str_sz - (size_t) (next - str));
+
+        if (next == s) {
+            break;
+        }
+
+        size_t diff = (size_t) (next - s);
+        size_t add_width = amp_utf8_width(s, diff);
+        size_t next_width = width + add_width;
+
+        if (next_width > max_width) {
+            if (!width) {
+                return amp_str_seg_skip_width(str, str_sz, wrap_width);
+            }
+
+            break;
+        }
+
+        width = next_width;
+        s = next;
+    }
+
+    return s;
+}
+
+static inline const char *amp_rich_str_seg_skip_wrap(
+    const char *str, size_t str_sz, size_t wrap_width
+) {
+    const char *s = str;
+    size_t width = 0;
+    size_t max_width = wrap_width;
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_style_and_spaces(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        next = amp_str_seg_skip_style_and_word(
+            next, str_sz - (size_t) (next - str)
+        );
+
+        const char *after_trailing_style = amp_str_seg_skip_styles(
+            next, str_sz - (size_t) (next - str)
+        );
+
+        if (str + str_sz == after_trailing_style) {
+            next = after_trailing_style;
+        }
+
+        if (next == s) {
+            break;
+        }
+
+        size_t diff = (size_t) (next - s);
+        size_t add_width = amp_utf8_width(s, diff);
+        size_t style_width = amp_str_seg_style_sign_count(s, diff);
+
+        size_t next_width = width + add_width;
+        size_t next_max_width = max_width + style_width;
+
+        if (next_width > next_max_width) {
+            if (!width) {
+                return amp_str_seg_skip_width(str, str_sz, wrap_width);
+            }
+
+            break;
+        }
+
+        width = next_width;
+        max_width = next_max_width;
+        s = next;
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_style_sign(
+    const char *str, size_t str_sz
+) {
+    const char *s = str;
+    bool style = false;
+
+    while (*s && s < str + str_sz) {
+        if (*s == '{' && !style) {
+            style = true;
+        }
+        else if (style) {
+            if (*s == '{') {
+                return s;
+            }
+
+            const char *end = amp_str_seg_skip_any_utf8_symbol(
+                s, str_sz - (size_t) (s - str)
+            );
+
+            return end > s ? end : str;
+        }
+        else break;
+
+        ++s;
+    }
+
+    return str;
+}
+
+static inline const char *amp_str_seg_skip_style_and_spaces(
+    const char *str, size_t str_sz
+) {
+    const char *s = str;
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_style_and_utf8_symbol(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        if (next == s) {
+            return s;
+        }
+
+        --next;
+
+        if (*next != ' ') {
+            return s;
+        }
+
+        s = next + 1;
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_style_and_word(
+    const char *str, size_t str_sz
+) {
+    const char *s = amp_str_seg_skip_style_and_spaces(str, str_sz);
+
+    if (s != str) {
+        return str;
+    }
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_style_and_utf8_symbol(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        if (next == s) {
+            return s;
+        }
+
+        --next;
+
+        if (*next == ' ') {
+            return s;
+        }
+
+        s = next + 1;
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_styles(
+    const char *str, size_t str_sz
+) {
+    const char *s = str;
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_style_sign(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        if (next <= s + 1) {
+            // If we fail to advance or if we advance only by 1, then we must
+            // have reached the end of the style sequence.
+            s = next;
+            break;
+        }
+
+        s = next;
+    }
+
+    return s;
+}
+
+static inline const char *amp_str_seg_skip_style_and_utf8_symbol(
+    const char *str, size_t str_sz
+) {
+    const char *s = str;
+
+    while (*s && s < str + str_sz) {
+        const char *next = amp_str_seg_skip_style_sign(
+            s, str_sz - (size_t) (s - str)
+        );
+
+        if (next == s) {
+            next = amp_str_seg_skip_any_utf8_symbol(
+                next, str_sz - (size_t) (next - str)
+            );
+
+            if (next == s) {
+                break;
+            }
+            else return next;
+        }
+        else if ((next - s) == 1) {
+            const char *after_braces = amp_str_seg_skip_any_utf8_symbol(
+                next, str_sz - (size_t) (next - str)
+            );
+
+            if (after_braces == next) {
+                abort();
+                break;
+            }
+            else if (*next != '{') {
+                abort();
+            }
+
+            return after_braces;
+        }
+
+        s = next;
+    }
+
+    return str;
+}
+
+static inline struct amp_style_flag_type amp_lookup_style_flag(
+    AMP_STYLE style
+) {
+    size_t index = stdc_first_trailing_one_ull(style);
+
+    if (index >= sizeof(amp_style_flag_table)/sizeof(amp_style_flag_table[0])) {
+        return amp_style_flag_table[0];
+    }
+
+    return amp_style_flag_table[index];
+}
+
+static inline ssize_t amp_encode_layer_cell(
+    const struct amp_type *amp, struct amp_style_cache_type *cache, long x,
+    long y, AMP_STYLE style, char *buffer, size_t buffer_size
+) {
+    const bool to_stdout = (
+        buffer == (char *) amp->buffer + sizeof(amp->buffer)
+    );
+
+    size_t written = 0;
+
+    if (style == AMP_STYLE_NONE) {
+        const char *glyph = amp_get_glyph(amp, x, y);
+
+        if (!glyph || *glyph == '\0') {
+            glyph = " ";
+        }
+        else if (amp_is_glyph_tail(glyph)) {
+            // The wide glyph before takes the column of its tail.
+            glyph = amp_has_glyph_tail(amp, x - 1, y) ? "" : " ";
+        }
+        else if (amp_utf8_glyph_cells(glyph, AMP_CELL_GLYPH_SIZE) > 1
+        && !amp_has_glyph_tail(amp, x, y)) {
+            glyph = " ";
+        }
+
+        if (to_stdout) {
+            if (amp_stdout(glyph, strlen(glyph)) < 0) {
+                return -1;
+            }
+
+            written += strlen(glyph);
+        }
+        else {
+            written += amp_str_append(
+                buffer + written, amp_sub_size(buffer_size, written), glyph
+            );
+        }
+
+        return written > SSIZE_MAX ? -1 : (ssize_t) written;
+    }
+
+    const char *glyph = " ";
+    AMP_STYLE cell_style = amp_get_cached_style(amp, cache, x, y);
+    AMP_STYLE matching_styles = cell_style & style;
+    struct amp_style_flag_type flag = {};
+
+    if (matching_styles) {
+        flag = amp_lookup_style_flag(matching_styles);
+        glyph = flag.glyph;
+    }
+
+    if (!glyph || *glyph == '\0') {
+        glyph = " ";
+    }
+
+    if (to_stdout) {
+        if (amp_stdout(glyph, strlen(glyph)) < 0) {
+            return -1;
+        }
+
+        written += strlen(glyph);
+    }
+    else {
+        written += amp_str_append(
+            buffer + written, amp_sub_size(buffer_size, written), glyph
+        );
+    }
+
+    return written > SSIZE_MAX ? -1 : (ssize_t) written;
+}
+
+static inline ssize_t amp_encode_layer_row(
+    const struct amp_type *amp, struct amp_style_cache_type *cache, long y,
+    AMP_STYLE style, char *buffer, size_t buffer_size
+) {
+    const bool to_stdout = (
+        buffer == (char *) amp->buffer + sizeof(amp->buffer)
+    );
+
+    size_t written = 0;
+    const char *left_border = "║";
+    const char *right_border = "║\n";
+    const size_t left_border_size = strlen(left_border);
+    const size_t right_border_size = strlen(right_border);
+
+    if (to_stdout) {
+        if (amp_stdout(left_border, left_border_size) < 0) {
+            return -1;
+        }
+
+        written += left_border_size;
+    }
+    else {
+        written += amp_str_append(
+            buffer + written, amp_sub_size(buffer_size, written), left_border
+        );
+    }
+
+    for (long x=0; x<amp->width; ++x) {
+        ssize_t ret = amp_encode_layer_cell(
+            amp, cache, x, y, style, to_stdout ? buffer : buffer + written,
+            amp_sub_size(buffer_size, written)
+        );
+
+        if (ret < 0) {
+            return -1;
+        }
+
+        written += (size_t) ret;
+    }
+
+    if (to_stdout) {
+        if (amp_stdout(right_border, right_border_size) < 0) {
+            return -1;
+        }
+
+        written += right_border_size;
+    }
+    else {
+        written += amp_str_append(
+            buffer + written, amp_sub_size(buffer_size, written), right_border
+        );
+    }
+
+    return written > SSIZE_MAX ? -1 : (ssize_t) written;
+}
+
+static inline ssize_t amp_encode_layer(
+    const struct amp_type *amp, struct amp_style_cache_type *cache,
+    AMP_SETTINGS settings, AMP_STYLE style, char *buffer, size_t buffer_size
+) {
+    const bool to_stdout = (
+        buffer == (char *) amp->buffer + sizeof(amp->buffer)
+    );
+
+    size_t written = 0;
+
+    if (style != AMP_STYLE_NONE) {
+        const char *border = "═";
+        const char *left_top_corner = "╠";
+        const char *right_top_corner = "╣\n";
+        const size_t left_top_corner_size = strlen(left_top_corner);
+        const size_t right_top_corner_size = strlen(right_top_corner);
+        const size_t border_size = strlen(border);
+
+        if (to_stdout) {
+            if (amp_stdout(left_top_corner, left_top_corner_size) < 0) {
+                return -1;
+            }
 
-    const char *s = str;
+            written += left_top_corner_size;
 
-    while (*s && s < str + str_sz) {
-        if (*s == '\n') {
-            found = s;
-            after_found = '\r';
-            break;
-        }
-        else if (*s == '\r') {
-            found = s;
-            after_found = '\n';
-            break;
-        }
+            for (long x=0; x<amp->width; ++x) {
+                if (amp_stdout(border, border_size) < 0) {
+                    return -1;
+                }
 
-        ++s;
-    }
+                written += border_size;
+            }
 
-    if (found) {
-        if (*(s + 1) == after_found) {
-            s += 2;
+            if (amp_stdout(right_top_corner, right_top_corner_size) < 0) {
+                return -1;
+            }
+
+            written += right_top_corner_size;
         }
         else {
-            s += 1;
+            written += amp_str_append(
+                buffer + written, amp_sub_size(buffer_size, written),
+                left_top_corner
+            );
+
+            for (long x=0; x<amp->width; ++x) {
+                written += amp_str_append(
+                    buffer + written, amp_sub_size(buffer_size, written), border
+                );
+            }
+
+            written += amp_str_append(
+                buffer + written, amp_sub_size(buffer_size, written),
+                right_top_corner
+            );
         }
     }
 
-    if (line_size) {
-        *line_size = found ? (size_t) (found - begin) : (size_t) (s - begin);
-    }
+    long max_height = amp->height;
 
-    return s;
-}
+    if (style != AMP_STYLE_NONE && (settings & AMP_DEFLATE)) {
+        for (long y=amp->height - 1; y >= 0; --y) {
+            // Let's trim trailing empty rows for style layers.
+            bool found = false;
 
-static inline const char *amp_str_seg_skip_any_utf8_symbol(
-    const char *str, size_t str_sz
-) {
-    if (!str_sz) {
-        return str;
-    }
+            for (long x=0; x<amp->width; ++x) {
+                AMP_STYLE cell_style = amp_get_cached_style(amp, cache, x, y);
+                AMP_STYLE matching_styles = cell_style & style;
 
-    int sz = amp_utf8_code_point_size(str, str_sz);
+                if (matching_styles) {
+                    found = true;
+                    break;
+                }
+            }
 
-    if (sz == 0) {
-        return str;
-    }
-    else if (sz < 0) {
-        return str + 1;
+            if (found) {
+                max_height = y + 1;
+                break;
+            }
+        }
     }
 
-    return str + sz;
-}
+    for (long y=0; y<max_height; ++y) {
+        ssize_t ret = amp_encode_layer_row(
+            amp, cache, y, style, to_stdout ? buffer : buffer + written,
+            amp_sub_size(buffer_size, written)
+        );
 
-static inline const char *amp_str_seg_skip_str(
-    const char *str_seg, size_t str_seg_sz, const char *str
-) {
-    const size_t str_sz = strlen(str);
-    const size_t min_sz = str_seg_sz < str_sz ? str_seg_sz : str_sz;
+        if (ret < 0) {
+            return -1;
+        }
 
-    if (strncmp(str_seg, str, min_sz) == 0) {
-        return str_seg + str_sz;
+        written += (size_t) ret;
     }
 
-    return str_seg;
+    return written > SSIZE_MAX ? -1 : (ssize_t) written;
 }
 
-static inline size_t amp_str_seg_style_sign_count(
-    const char *str, size_t segment_sz
+static inline AMP_STYLE amp_styles_to_layer(
+    const struct amp_type *amp, struct amp_style_cache_type *cache,
+    AMP_STYLE whitelist
 ) {
-    // return the number of zero-width rich text code symbols embedded in 'str'
+    if (whitelist == AMP_STYLE_NONE) {
+        return AMP_STYLE_NONE;
+    }
 
-    const char *s = str;
-    size_t count = 0;
+    AMP_STYLE layer_styles = 0;
+    AMP_STYLE blacklist = 0;
 
-    while (*s && s < str + segment_sz) {
-        const char *next = amp_str_seg_skip_style_sign(
-            s, segment_sz - (size_t) (s - str)
-        );
+    for (long y = 0; y < amp->height; ++y) {
+        for (long x = 0; x < amp->width; ++x) {
+            AMP_STYLE style = amp_get_cached_style(amp, cache, x, y);
+            AMP_STYLE match = style & whitelist & ~blacklist;
 
-        if (next > str + segment_sz) {
-            break;
-        }
+            if (!match) {
+                continue;
+            }
 
-        if (s == next) { // no style sign detected
-            next = amp_str_seg_skip_any_utf8_symbol(
-                s, segment_sz - (size_t) (s - str)
-            );
+            layer_styles &= ~match;
 
-            if (s == next) {
-                break;
-            }
+            // Prefer the flag with the greatest value.
+            size_t index = stdc_first_leading_one_ull(match);
 
-            s = next;
-            continue;
-        }
-        else if (next - s == 1) { // double brace detected
-            ++count; // double braces '{{' count for one style sign
+            if (index) {
+                constexpr AMP_STYLE most_significant_bit = 1ULL << 63;
+                AMP_STYLE layer_style = most_significant_bit >> (index - 1);
 
-            if (*next != '{') {
-                abort();
+                layer_styles |= layer_style;
+                blacklist |= (match & ~layer_style);
             }
-
-            s = next + 1;
-            continue;
         }
-
-        size_t diff = (size_t) (next - s);
-
-        count += amp_utf8_code_point_count(s, diff);
-
-        s = next;
     }
 
-    return count;
+    return layer_styles;
 }
 
-static inline size_t amp_str_seg_width(const char *str, size_t str_sz) {
-    const char *s = str;
-    size_t width = 0;
+static inline ssize_t amp_encode(
+    const struct amp_type *amp, AMP_SETTINGS settings,
+    char *buffer, size_t buffer_size
+) {
+    if (buffer == nullptr) {
+        buffer = (char *) amp->buffer + sizeof(amp->buffer);
+        buffer_size = 0;
+    }
+    else {
+        uint8_t *buf = (uint8_t *) buffer;
 
-    while (*s && s < str + str_sz) {
-        size_t linesz;
-        const char *next_line = amp_str_seg_first_line_size(
-            s, str_sz - (size_t) (s - str), &linesz
-        );
+        if ((buf >= amp->canvas.glyph.data
+          && buf <  amp->canvas.glyph.data + amp->canvas.glyph.size)
+        ||  (buf >= amp->canvas.mode.data
+          && buf <  amp->canvas.mode.data + amp->canvas.mode.size)) {
+            abort(); // Overwriting its own memory is a fatal error.
+        }
+    }
 
-        size_t line_width = amp_utf8_code_point_count(s, linesz);
+    const bool to_stdout = (
+        buffer == (char *) amp->buffer + sizeof(amp->buffer)
+    );
 
-        width = width > line_width ? width : line_width;
+    const char *border = "═";
+    const char *left_top_corner = "╔";
+    const char *left_bottom_corner = "╚";
+    const char *right_top_corner = "╗\n";
+    const char *right_bottom_corner = "╝";
+    const size_t left_top_corner_size = strlen(left_top_corner);
+    const size_t right_top_corner_size = strlen(right_top_corner);
+    const size_t left_bottom_corner_size = strlen(left_bottom_corner);
+    const size_t right_bottom_corner_size = strlen(right_bottom_corner);
+    const size_t border_size = strlen(border);
 
-        if (next_line <= s) {
-            break;
+    size_t written = 0;
+
+    if (to_stdout) {
+        if (amp_stdout(left_top_corner, left_top_corner_size) < 0) {
+            return -1;
         }
 
-        s = next_line;
-    }
+        written += left_top_corner_size;
 
-    return width;
-}
+        for (long x=0; x<amp->width; ++x) {
+            if (amp_stdout(border, border_size) < 0) {
+                return -1;
+            }
 
-static inline size_t amp_rich_str_seg_width(const char *str, size_t str_sz) {
-    const char *s = str;
-    size_t width = 0;
+            written += border_size;
+        }
 
-    while (*s && s < str + str_sz) {
-        size_t linesz;
-        const char *next_line = amp_str_seg_first_line_size(
-            s, str_sz - (size_t) (s - str), &linesz
-        );
+        if (amp_stdout(right_top_corner, right_top_corner_size) < 0) {
+            return -1;
+        }
 
-        size_t line_width = (
-            amp_utf8_code_point_count(s, linesz) -
-            amp_str_seg_style_sign_count(s, linesz)
+        written += right_top_corner_size;
+    }
+    else {
+        written += amp_str_append(
+            buffer + written, amp_sub_size(buffer_size, written),
+            left_top_corner
         );
 
-        width = width > line_width ? width : line_width;
-
-        if (next_line <= s) {
-            break;
+        for (long x=0; x<amp->width; ++x) {
+            written += amp_str_append(
+                buffer + written, amp_sub_size(buffer_size, written), border
+            );
         }
 
-        s = next_line;
+        written += amp_str_append(
+            buffer + written, amp_sub_size(buffer_size, written),
+            right_top_corner
+        );
     }
 
-    return width;
-}
+    const AMP_STYLE style_groups[] = {
+        AMP_STYLE_NONE,
+        (settings & AMP_FLATTEN) ? AMP_STYLE_NONE : amp_fg_color_styles,
+        (settings & AMP_FLATTEN) ? AMP_STYLE_NONE : amp_bg_color_styles,
+        ~AMP_STYLE_NONE
+    };
+
+    AMP_STYLE style_pool = ~AMP_STYLE_NONE;
 
-static inline const char *amp_str_seg_skip_spaces(
-    const char *str, size_t str_sz
-) {
-    const char *s = str;
+    // The same styles are looked up for every layer, so they are memoized.
+    struct amp_style_cache_type style_cache = {};
 
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_any_utf8_symbol(
-            s, str_sz - (size_t) (s - str)
-        );
+    for (size_t i=0; i<sizeof(style_groups)/sizeof(style_groups[0]); ++i) {
+        AMP_STYLE layer_style;
+        AMP_STYLE style_group = style_groups[i] & style_pool;
 
-        if (next == s) {
-            break;
-        }
+        do {
+            layer_style = amp_styles_to_layer(amp, &style_cache, style_group);
 
-        --next;
+            if (layer_style || i == 0) {
+                ssize_t ret = amp_encode_layer(
+                    amp, &style_cache, settings, layer_style,
+                    to_stdout ? buffer : buffer + written,
+                    amp_sub_size(buffer_size, written)
+                );
 
-        if (*next != ' ') {
-            return s;
-        }
+                if (ret < 0) {
+                    return -1;
+                }
+                else written += (size_t) ret;
+            }
 
-        s = next + 1;
+            style_group &= ~layer_style;
+            style_pool &= ~layer_style;
+        } while (layer_style);
     }
 
-    return s;
-}
-
-static inline const char *amp_str_seg_skip_word(
-    const char *str, size_t str_sz
-) {
-    const char *s = amp_str_seg_skip_spaces(str, str_sz);
+    if (to_stdout) {
+        if (amp_stdout(left_bottom_corner, left_bottom_corner_size) < 0) {
+            return -1;
+        }
 
-    if (s != str) {
-        return str;
-    }
+        written += left_bottom_corner_size;
 
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_any_utf8_symbol(
-            s, str_sz - (size_t) (s - str)
-        );
+        for (long x=0; x<amp->width; ++x) {
+            if (amp_stdout(border, border_size) < 0) {
+                return -1;
+            }
 
-        if (next == s) {
-            return s;
+            written += border_size;
         }
 
-        --next;
-
-        if (*next == ' ') {
-            return s;
+        if (amp_stdout(right_bottom_corner, right_bottom_corner_size) < 0) {
+            return -1;
         }
 
-        s = next + 1;
+        written += right_bottom_corner_size;
     }
+    else {
+        written += amp_str_append(
+            buffer + written, amp_sub_size(buffer_size, written),
+            left_bottom_corner
+        );
 
-    return s;
-}
-
-static inline const char *amp_str_seg_skip_width(
-    const char *str, size_t str_sz, size_t max_width
-) {
-    const char *s = str;
-    size_t width = 0;
-
-    while (*s && s < str + str_sz) {
-        if (width++ >= max_width) {
-            break;
+        for (long x=0; x<amp->width; ++x) {
+            written += amp_str_append(
+                buffer + written, amp_sub_size(buffer_size, written), border
+            );
         }
 
-        const char *next = amp_str_seg_skip_any_utf8_symbol(
-            s, str_sz - (size_t) (s - str)
+        written += amp_str_append(
+            buffer + written, amp_sub_size(buffer_size, written),
+            right_bottom_corner
         );
+    }
 
-        if (next == s) {
-            break;
+    if (!to_stdout) {
+        if (written >= buffer_size || !written) {
+            if (buffer_size) {
+                *buffer = '\0';
+            }
         }
-
-        s = next;
     }
 
-    return s;
+    return written > SSIZE_MAX ? -1 : (ssize_t) written;
 }
 
-static inline const char *amp_str_seg_skip_wrap(
-    const char *str, size_t str_sz, size_t wrap_width
-) {
-    const char *s = str;
+static inline uint32_t amp_doc_seg_parse_width(const char *str, size_t str_sz) {
     size_t width = 0;
-    size_t max_width = wrap_width;
-
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_spaces(
-            s, str_sz - (size_t) (s - str)
-        );
+    const char *prev_char = str;
+    const char *next_char = amp_str_seg_skip_str(prev_char, str_sz, "╔═");
 
-        next = amp_str_seg_skip_word(next, str_sz - (size_t) (next - str));
+    if (next_char > prev_char) {
+        while (next_char > prev_char) {
+            if (++width > UINT32_MAX) return 0;
 
-        if (next == s) {
-            break;
+            prev_char = next_char;
+            next_char = amp_str_seg_skip_str(
+                prev_char, str_sz - (size_t) (prev_char - str), "═"
+            );
         }
 
-        size_t diff = (size_t) (next - s);
-        size_t add_width = amp_utf8_code_point_count(s, diff);
-        size_t next_width = width + add_width;
-
-        if (next_width > max_width) {
-            if (!width) {
-                return amp_str_seg_skip_width(str, str_sz, wrap_width);
-            }
+        prev_char = next_char;
+        next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "╗"
+        );
 
-            break;
+        if (next_char <= prev_char) {
+            width = 0;
         }
-
-        width = next_width;
-        s = next;
     }
 
-    return s;
+    return (uint32_t) width;
 }
 
-static inline const char *amp_rich_str_seg_skip_wrap(
-    const char *str, size_t str_sz, size_t wrap_width
+static inline size_t amp_doc_parse_size(
+    const void *data, size_t data_size, uint32_t *canvas_w, uint32_t *canvas_h
 ) {
-    const char *s = str;
-    size_t width = 0;
-    size_t max_width = wrap_width;
+    const char *str = (const char *) data;
+    const size_t str_sz = data_size;
 
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_style_and_spaces(
-            s, str_sz - (size_t) (s - str)
-        );
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t layer_height = 0;
 
-        next = amp_str_seg_skip_style_and_word(
-            next, str_sz - (size_t) (next - str)
-        );
+    if (canvas_w) *canvas_w = 0;
+    if (canvas_h) *canvas_h = 0;
 
-        const char *after_trailing_style = amp_str_seg_skip_styles(
-            next, str_sz - (size_t) (next - str)
+    for (const char *s = str; *s && s < str + str_sz;) {
+        const char *next_line = amp_str_seg_first_line_size(
+            s, str_sz - (size_t) (s - str), nullptr
         );
 
-        if (str + str_sz == after_trailing_style) {
-            next = after_trailing_style;
-        }
-
-        if (next == s) {
+        if (next_line <= s) {
             break;
         }
 
-        size_t diff = (size_t) (next - s);
-        size_t add_width = amp_utf8_code_point_count(s, diff);
-        size_t style_width = amp_str_seg_style_sign_count(s, diff);
-
-        size_t next_width = width + add_width;
-        size_t next_max_width = max_width + style_width;
+        if (!width) {
+            width = amp_doc_seg_parse_width(s, str_sz - (size_t) (s - str));
 
-        if (next_width > next_max_width) {
             if (!width) {
-                return amp_str_seg_skip_width(str, str_sz, wrap_width);
-            }
-
-            break;
-        }
-
-        width = next_width;
-        max_width = next_max_width;
-        s = next;
-    }
-
-    return s;
-}
-
-static inline const char *amp_str_seg_skip_style_sign(
-    const char *str, size_t str_sz
-) {
-    const char *s = str;
-    bool style = false;
-
-    while (*s && s < str + str_sz) {
-        if (*s == '{' && !style) {
-            style = true;
-        }
-        else if (style) {
-            if (*s == '{') {
-                return s;
+                return 0; // Invalid or corrupt AMP file detected.
             }
 
-            const char *end = amp_str_seg_skip_any_utf8_symbol(
-                s, str_sz - (size_t) (s - str)
-            );
-
-            return end > s ? end : str;
+            s = next_line;
+            continue;
         }
-        else break;
-
-        ++s;
-    }
-
-    return str;
-}
-
-static inline const char *amp_str_seg_skip_style_and_spaces(
-    const char *str, size_t str_sz
-) {
-    const char *s = str;
 
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_style_and_utf8_symbol(
-            s, str_sz - (size_t) (s - str)
+        const char *prev_char = s;
+        const char *next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "╚"
         );
 
-        if (next == s) {
-            return s;
-        }
+        if (next_char > prev_char) {
+            // Container end detected.
 
-        --next;
+            height = height < layer_height ? layer_height : height;
 
-        if (*next != ' ') {
-            return s;
-        }
+            if (canvas_w) *canvas_w = width;
+            if (canvas_h) *canvas_h = height;
 
-        s = next + 1;
-    }
+            return amp_calc_size(width, height);
+        }
 
-    return s;
-}
+        next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "╠"
+        );
 
-static inline const char *amp_str_seg_skip_style_and_word(
-    const char *str, size_t str_sz
-) {
-    const char *s = amp_str_seg_skip_style_and_spaces(str, str_sz);
+        if (next_char > prev_char) {
+            // Layer end detected.
 
-    if (s != str) {
-        return str;
-    }
+            height = height < layer_height ? layer_height : height;
+            layer_height = 0;
+            s = next_line;
 
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_style_and_utf8_symbol(
-            s, str_sz - (size_t) (s - str)
+            continue;
+        }
+
+        next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "║"
         );
 
-        if (next == s) {
-            return s;
+        if (next_char == prev_char) {
+            return 0; // Invalid or corrupt AMP file detected.
         }
 
-        --next;
-
-        if (*next == ' ') {
-            return s;
+        if (layer_height++ == UINT32_MAX) {
+            return 0; // Excessively tall AMP layer detected.
         }
 
-        s = next + 1;
+        s = next_line;
     }
 
-    return s;
+    return 0;
 }
 
-static inline const char *amp_str_seg_skip_styles(
-    const char *str, size_t str_sz
+static inline size_t amp_decode_glyphs(
+    struct amp_type *amp, const char *str, size_t str_sz
 ) {
-    const char *s = str;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    long y = 0;
 
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_style_sign(
-            s, str_sz - (size_t) (s - str)
+    for (const char *s = str; *s && s < str + str_sz;) {
+        const char *next_line = amp_str_seg_first_line_size(
+            s, str_sz - (size_t) (s - str), nullptr
         );
 
-        if (next <= s + 1) {
-            // If we fail to advance or if we advance only by 1, then we must
-            // have reached the end of the style sequence.
-            s = next;
+        if (next_line <= s) {
             break;
         }
 
-        s = next;
-    }
+        if (!width) {
+            width = amp_doc_seg_parse_width(s, str_sz - (size_t) (s - str));
 
-    return s;
-}
+            if (!width) {
+                return 0; // Invalid or corrupt AMP file detected.
+            }
 
-static inline const char *amp_str_seg_skip_style_and_utf8_symbol(
-    const char *str, size_t str_sz
-) {
-    const char *s = str;
+            s = next_line;
+            continue;
+        }
 
-    while (*s && s < str + str_sz) {
-        const char *next = amp_str_seg_skip_style_sign(
-            s, str_sz - (size_t) (s - str)
+        const char *prev_char = s;
+        const char *next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "╚"
         );
 
-        if (next == s) {
-            next = amp_str_seg_skip_any_utf8_symbol(
-                next, str_sz - (size_t) (next - str)
-            );
-
-            if (next == s) {
-                break;
-            }
-            else return next;
+        if (next_char > prev_char) {
+            // Container end detected.
+            return amp_calc_size(width, height);
         }
-        else if ((next - s) == 1) {
-            const char *after_braces = amp_str_seg_skip_any_utf8_symbol(
-                next, str_sz - (size_t) (next - str)
-            );
 
-            if (after_braces == next) {
-                abort();
-                break;
-            }
-            else if (*next != '{') {
-                abort();
-            }
+        next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "╠"
+        );
 
-            return after_braces;
+        if (next_char > prev_char) {
+            // Layer end detected.
+            return amp_calc_size(width, height);
         }
 
-        s = next;
-    }
-
-    return str;
-}
-
-static inline struct amp_style_flag_type amp_lookup_style_flag(
-    AMP_STYLE style
-) {
-    size_t index = stdc_first_trailing_one_ull(style);
-
-    if (index >= sizeof(amp_style_flag_table)/sizeof(amp_style_flag_table[0])) {
-        return amp_style_flag_table[0];
-    }
+        next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "║"
+        );
 
-    return amp_style_flag_table[index];
-}
+        if (next_char == prev_char) {
+            return 0; // Invalid or corrupt AMP file detected.
+        }
 
-static inline ssize_t amp_encode_layer_cell(
-    const struct amp_type *amp, long x, long y, AMP_STYLE style,
-    char *buffer, size_t buffer_size
-) {
-    const bool to_stdout = (
-        buffer == (char *) amp->buffer + sizeof(amp->buffer)
-    );
+        if (height++ == UINT32_MAX) {
+            return 0; // Excessively tall AMP file detected.
+        }
 
-    size_t written = 0;
+        long x = 0;
 
-    if (style == AMP_STYLE_NONE) {
-        const char *glyph = amp_get_glyph(amp, x, y);
+        while (x < width) {
+            prev_char = next_char;
+            next_char = amp_str_seg_skip_any_utf8_symbol(
+                prev_char, str_sz - (size_t) (prev_char - str)
+            );
 
-        if (!glyph || *glyph == '\0') {
-            glyph = " ";
-        }
+            if (next_char <= prev_char) {
+                return 0; // Invalid or corrupt AMP file detected.
+            }
 
-        if (to_stdout) {
-            if (amp_stdout(glyph, strlen(glyph)) < 0) {
-                return -1;
+            if (amp) {
+                // Let's allow decoding in simulation mode when amp is nullptr.
+                amp_put_glyph(amp, x, y, prev_char);
             }
 
-            written += strlen(glyph);
-        }
-        else {
-            written += amp_str_append(
-                buffer + written, amp_sub_size(buffer_size, written), glyph
+            // A wide glyph takes the column of its tail in the encoded text.
+            x += amp_utf8_glyph_cells(
+                prev_char, (size_t) (next_char - prev_char)
             );
         }
 
-        return written > SSIZE_MAX ? -1 : (ssize_t) written;
-    }
-
-    const char *glyph = " ";
-    AMP_STYLE cell_style = amp_get_style(amp, x, y);
-    AMP_STYLE matching_styles = cell_style & style;
-
-    if (matching_styles) {
-        auto const row = amp_lookup_style_flag(matching_styles);
-        glyph = row.glyph;
+        ++y;
+        s = next_line;
     }
 
-    if (!glyph || *glyph == '\0') {
-        glyph = " ";
-    }
+    return 0;
+}
 
-    if (to_stdout) {
-        if (amp_stdout(glyph, strlen(glyph)) < 0) {
-            return -1;
-        }
+static inline size_t amp_decode_styles(
+    struct amp_type *amp, const char *str, size_t str_sz
+) {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t layer_height = 0;
+    size_t layer = 0;
+    long y = 0;
+    long first_used_x = LONG_MAX;
+    long first_used_y = LONG_MAX;
+    long last_used_x = LONG_MIN;
+    long last_used_y = LONG_MIN;
 
-        written += strlen(glyph);
-    }
-    else {
-        written += amp_str_append(
-            buffer + written, amp_sub_size(buffer_size, written), glyph
+    for (const char *s = str; *s && s < str + str_sz;) {
+        const char *next_line = amp_str_seg_first_line_size(
+            s, str_sz - (size_t) (s - str), nullptr
         );
-    }
 
-    return written > SSIZE_MAX ? -1 : (ssize_t) written;
-}
+        if (next_line <= s) {
+            break;
+        }
 
-static inline ssize_t amp_encode_layer_row(
-    const struct amp_type *amp, long y, AMP_STYLE style, char *buffer,
-    size_t buffer_size
-) {
-    const bool to_stdout = (
-        buffer == (char *) amp->buffer + sizeof(amp->buffer)
-    );
+        if (!width) {
+            width = amp_doc_seg_parse_width(s, str_sz - (size_t) (s - str));
 
-    size_t written = 0;
-    const char *left_border = "║";
-    const char *right_border = "║\n";
-    const size_t left_border_size = strlen(left_border);
-    const size_t right_border_size = strlen(right_border);
+            if (!width) {
+                return 0; // Invalid or corrupt AMP file detected.
+            }
 
-    if (to_stdout) {
-        if (amp_stdout(left_border, left_border_size) < 0) {
-            return -1;
+            s = next_line;
+            continue;
         }
 
-        written += left_border_size;
-    }
-    else {
-        written += amp_str_append(
-            buffer + written, amp_sub_size(buffer_size, written), left_border
+        const char *prev_char = s;
+        const char *next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "╚"
         );
-    }
 
-    for (long x=0; x<amp->width; ++x) {
-        ssize_t ret = amp_encode_layer_cell(
-            amp, x, y, style, to_stdout ? buffer : buffer + written,
-            amp_sub_size(buffer_size, written)
-        );
+        if (next_char > prev_char) {
+            // Container end detected.
+
+            if (amp
+            && first_used_x <= last_used_x
+            && first_used_y <= last_used_y) {
+                for (long y = first_used_y; y <= last_used_y; ++y) {
+                    for (long x = first_used_x; x <= last_used_x; ++x) {
+                        const uint8_t *mode_data = amp_get_mode_data(
+                            amp, x, y
+                        );
+
+                        if (!mode_data) {
+                            continue;
+                        }
 
-        if (ret < 0) {
-            return -1;
-        }
+                        AMP_STYLE style;
+                        memcpy(&style, mode_data, sizeof(style));
+                        amp_put_style(amp, x, y, style);
+                    }
+                }
+            }
 
-        written += (size_t) ret;
-    }
+            height = height < layer_height ? layer_height : height;
 
-    if (to_stdout) {
-        if (amp_stdout(right_border, right_border_size) < 0) {
-            return -1;
+            return amp_calc_size(width, height);
         }
 
-        written += right_border_size;
-    }
-    else {
-        written += amp_str_append(
-            buffer + written, amp_sub_size(buffer_size, written), right_border
+        next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "╠"
         );
-    }
 
-    return written > SSIZE_MAX ? -1 : (ssize_t) written;
-}
-
-static inline ssize_t amp_encode_layer(
-    const struct amp_type *amp, AMP_SETTINGS settings, AMP_STYLE style,
-    char *buffer, size_t buffer_size
-) {
-    const bool to_stdout = (
-        buffer == (char *) amp->buffer + sizeof(amp->buffer)
-    );
+        if (next_char > prev_char) {
+            // Layer end detected.
 
-    size_t written = 0;
+            ++layer;
+            height = height < layer_height ? layer_height : height;
+            layer_height = 0;
+            s = next_line;
+            y = 0;
 
-    if (style != AMP_STYLE_NONE) {
-        const char *border = "═";
-        const char *left_top_corner = "╠";
-        const char *right_top_corner = "╣\n";
-        const size_t left_top_corner_size = strlen(left_top_corner);
-        const size_t right_top_corner_size = strlen(right_top_corner);
-        const size_t border_size = strlen(border);
+            continue;
+        }
 
-        if (to_stdout) {
-            if (amp_stdout(left_top_corner, left_top_corner_size) < 0) {
-                return -1;
-            }
+        next_char = amp_str_seg_skip_str(
+            prev_char, str_sz - (size_t) (prev_char - str), "║"
+        );
 
-            written += left_top_corner_size;
+        if (next_char == prev_char) {
+            return 0; // Invalid or corrupt AMP file detected.
+        }
 
-            for (long x=0; x<amp->width; ++x) {
-                if (amp_stdout(border, border_size) < 0) {
-                    return -1;
-                }
+        if (layer_height++ == UINT32_MAX) {
+            return 0; // Excessively tall AMP layer detected.
+        }
 
-                written += border_size;
-            }
+        if (layer == 0) {
+            // Let's skip the text layer as we are only decoding the styles.
+            s = next_line;
+            continue;
+        }
 
-            if (amp_stdout(right_top_corner, right_top_corner_size) < 0) {
-                return -1;
-            }
+        long x = 0;
 
-            written += right_top_corner_size;
-        }
-        else {
-            written += amp_str_append(
-                buffer + written, amp_sub_size(buffer_size, written),
-                left_top_corner
+        while (x < width) {
+            prev_char = next_char;
+            next_char = amp_str_seg_skip_any_utf8_symbol(
+                prev_char, str_sz - (size_t) (prev_char - str)
             );
 
-            for (long x=0; x<amp->width; ++x) {
-                written += amp_str_append(
-                    buffer + written, amp_sub_size(buffer_size, written), border
-                );
+            if (next_char <= prev_char) {
+                return 0; // Invalid or corrupt AMP file detected.
             }
 
-            written += amp_str_append(
-                buffer + written, amp_sub_size(buffer_size, written),
-                right_top_corner
-            );
-        }
-    }
+            if (amp && *prev_char != ' ') {
+                // Let's allow decoding in simulation mode when amp is nullptr.
 
-    long max_height = amp->height;
+                AMP_STYLE new_style = (
+                    amp_lookup_inline_style(prev_char).style
+                );
 
-    if (style != AMP_STYLE_NONE && (settings & AMP_DEFLATE)) {
-        for (long y=amp->height - 1; y >= 0; --y) {
-            // Let's trim trailing empty rows for style layers.
-            bool found = false;
+                if (new_style != AMP_STYLE_NONE) {
+                    uint8_t *mode_data = amp_get_mutable_mode_data(
+                        amp, x, y
+                    );
 
-            for (long x=0; x<amp->width; ++x) {
-                AMP_STYLE cell_style = amp_get_style(amp, x, y);
-                AMP_STYLE matching_styles = cell_style & style;
+                    if (mode_data) {
+                        AMP_STYLE old_style;
+                        memcpy(&old_style, mode_data, sizeof(old_style));
+                        new_style |= old_style;
+                        memcpy(mode_data, &new_style, sizeof(new_style));
 
-                if (matching_styles) {
-                    found = true;
-                    break;
+                        if (x < first_used_x) first_used_x = x;
+                        if (y < first_used_y) first_used_y = y;
+                        if (x > last_used_x) last_used_x = x;
+                        if (y > last_used_y) last_used_y = y;
+                    }
                 }
             }
 
-            if (found) {
-                max_height = y + 1;
-                break;
-            }
-        }
-    }
-
-    for (long y=0; y<max_height; ++y) {
-        ssize_t ret = amp_encode_layer_row(
-            amp, y, style, to_stdout ? buffer : buffer + written,
-            amp_sub_size(buffer_size, written)
-        );
-
-        if (ret < 0) {
-            return -1;
+            ++x;
         }
 
-        written += (size_t) ret;
+        ++y;
+        s = next_line;
     }
 
-    return written > SSIZE_MAX ? -1 : (ssize_t) written;
+    return 0;
 }
 
-static inline AMP_STYLE amp_styles_to_layer(
-    const struct amp_type *amp, AMP_STYLE whitelist
+static inline size_t amp_decode(
+    struct amp_type *amp, const void *data, size_t data_size
 ) {
-    if (whitelist == AMP_STYLE_NONE) {
-        return AMP_STYLE_NONE;
-    }
-
-    AMP_STYLE layer_styles = 0;
-    AMP_STYLE blacklist = 0;
-
-    for (long y = 0; y < amp->height; ++y) {
-        for (long x = 0; x < amp->width; ++x) {
-            AMP_STYLE style = amp_get_style(amp, x, y);
-            AMP_STYLE match = style & whitelist & ~blacklist;
-
-            if (!match) {
-                continue;
-            }
-
-            layer_styles &= ~match;
+    const char *str = (const char *) data;
+    const size_t str_sz = data_size;
 
-            // Prefer the flag with the greatest value.
-            size_t index = stdc_first_leading_one_ull(match);
+    amp_clear(amp);
 
-            if (index) {
-                constexpr AMP_STYLE most_significant_bit = 1ULL << 63;
-                AMP_STYLE layer_style = most_significant_bit >> (index - 1);
+    size_t decoded_amp_size = amp_decode_styles(amp, str, str_sz);
 
-                layer_styles |= layer_style;
-                blacklist |= (match & ~layer_style);
-            }
-        }
+    if (decoded_amp_size) {
+        amp_decode_glyphs(amp, str, str_sz);
     }
 
-    return layer_styles;
+    return decoded_amp_size;
 }
 
-static inline ssize_t amp_encode(
-    const struct amp_type *amp, AMP_SETTINGS settings,
-    char *buffer, size_t buffer_size
+static inline void amp_draw_ansmap(
+    struct amp_type *amp, long x_on_amp, long y_on_amp,
+    const struct amp_type *sprite
 ) {
-    if (buffer == nullptr) {
-        buffer = (char *) amp->buffer + sizeof(amp->buffer);
-        buffer_size = 0;
+    amp_draw_ansmap_region(
+        amp, x_on_amp, y_on_amp, sprite, 0, 0, sprite->width, sprite->height
+    );
+}
+
+static inline void amp_draw_ansmap_region(
+    struct amp_type *dst, long x_on_dst, long y_on_dst,
+    const struct amp_type *src, long x_on_src, long y_on_src, long region_w,
+    long region_h
+) {
+    // Let's clip the region against the edges of both of the ansmaps at once.
+    if (!amp_clip_span(&x_on_dst, dst->width, &x_on_src, src->width, &region_w)
+    ||  !amp_clip_span(
+            &y_on_dst, dst->height, &y_on_src, src->height, &region_h
+        )) {
+        return;
     }
-    else {
-        uint8_t *buf = (uint8_t *) buffer;
 
-        if ((buf >= amp->canvas.glyph.data
-          && buf <  amp->canvas.glyph.data + amp->canvas.glyph.size)
-        ||  (buf >= amp->canvas.mode.data
-          && buf <  amp->canvas.mode.data + amp->canvas.mode.size)) {
-            abort(); // Overwriting its own memory is a fatal error.
-        }
+    for (long y = 0; y < region_h; ++y) {
+        struct amp_row_type dst_row = {};
+
+        amp_blit_row(
+            dst, y_on_dst + y, &dst_row, (size_t) x_on_dst,
+            amp_read_row(src, y_on_src + y), (size_t) x_on_src,
+            (size_t) region_w
+        );
     }
+}
 
-    const bool to_stdout = (
-        buffer == (char *) amp->buffer + sizeof(amp->buffer)
+static inline size_t amp_sprite_compile(
+    struct amp_sprite_type *sprite, const struct amp_type *src, long x_on_src,
+    long y_on_src, long region_w, long region_h, void *data, size_t data_size
+) {
+    const size_t padding = (
+        (
+            alignof(struct amp_sprite_run_type) -
+            (uintptr_t) data % alignof(struct amp_sprite_run_type)
+        ) % alignof(struct amp_sprite_run_type)
+    );
+    struct amp_sprite_run_type *runs = (
+        data && data_size >= padding ?
+        (struct amp_sprite_run_type *) ((uint8_t *) data + padding) : nullptr
+    );
+    const size_t capacity = (
+        runs ? (data_size - padding) / sizeof(struct amp_sprite_run_type) : 0
+    );
+    size_t run_count = 0;
+
+    // The runs keep the coordinates of their cells on the source ansmap, so
+    // the region is only clipped against the edges of the source ansmap.
+    const long x_begin = x_on_src > 0 ? x_on_src : 0;
+    const long y_begin = y_on_src > 0 ? y_on_src : 0;
+    const long x_end = (
+        region_w > 0 && x_on_src + region_w > x_begin ?
+        x_on_src + region_w : x_begin
+    );
+    const long y_end = (
+        region_h <= 0 ? y_begin :
+        y_on_src + region_h < src->height ? y_on_src + region_h : src->height
     );
 
-    const char *border = "═";
-    const char *left_top_corner = "╔";
-    const char *left_bottom_corner = "╚";
-    const char *right_top_corner = "╗\n";
-    const char *right_bottom_corner = "╝";
-    const size_t left_top_corner_size = strlen(left_top_corner);
-    const size_t right_top_corner_size = strlen(right_top_corner);
-    const size_t left_bottom_corner_size = strlen(left_bottom_corner);
-    const size_t right_bottom_corner_size = strlen(right_bottom_corner);
-    const size_t border_size = strlen(border);
+    for (long y = y_begin; y < y_end; ++y) {
+        const struct amp_row_type row = amp_read_row(src, y);
+        const size_t end = (
+            x_end < (long) row.size ? (size_t) x_end : row.size
+        );
 
-    size_t written = 0;
+        for (size_t x = (size_t) x_begin; row.glyph && x < end;) {
+            const AMP_SPAN span = amp_get_span(row, x);
+            const size_t size = amp_get_span_size(row, x, end - x);
+
+            if (span != AMP_SPAN_TRANSPARENT) {
+                if (run_count < capacity) {
+                    runs[run_count] = (struct amp_sprite_run_type) {
+                        .x = (uint32_t) x,
+                        .y = (uint32_t) y,
+                        .size = (uint32_t) size,
+                        .span = span
+                    };
+                }
 
-    if (to_stdout) {
-        if (amp_stdout(left_top_corner, left_top_corner_size) < 0) {
-            return -1;
+                ++run_count;
+            }
+
+            x += size;
         }
+    }
 
-        written += left_top_corner_size;
+    *sprite = (struct amp_sprite_type) {
+        .ansmap = src,
+        .runs = runs,
+        .run_count = run_count <= capacity ? run_count : 0,
+        .x = x_on_src,
+        .y = y_on_src
+    };
 
-        for (long x=0; x<amp->width; ++x) {
-            if (amp_stdout(border, border_size) < 0) {
-                return -1;
-            }
+    return (
+        alignof(struct amp_sprite_run_type) - 1 +
+        run_count * sizeof(struct amp_sprite_run_type)
+    );
+}
 
-            written += border_size;
+static inline void amp_draw_sprite(
+    struct amp_type *dst, long x_on_dst, long y_on_dst,
+    const struct amp_sprite_type *sprite
+) {
+    struct amp_row_type src_row = {};
+    struct amp_row_type dst_row = {};
+    long row_y = -1;
+
+    for (size_t i = 0; i < sprite->run_count; ++i) {
+        const struct amp_sprite_run_type *run = &sprite->runs[i];
+        long x = x_on_dst + ((long) run->x - sprite->x);
+        long y = y_on_dst + ((long) run->y - sprite->y);
+        long src_x = run->x;
+        long size = run->size;
+
+        if (y < 0) {
+            continue;
         }
 
-        if (amp_stdout(right_top_corner, right_top_corner_size) < 0) {
-            return -1;
+        if (y >= dst->height) {
+            break; // The runs are ordered by their rows.
         }
 
-        written += right_top_corner_size;
-    }
-    else {
-        written += amp_str_append(
-            buffer + written, amp_sub_size(buffer_size, written),
-            left_top_corner
-        );
+        if (y != row_y) {
+            src_row = amp_read_row(sprite->ansmap, run->y);
+            dst_row = amp_write_row(dst, y);
+            row_y = y;
+        }
 
-        for (long x=0; x<amp->width; ++x) {
-            written += amp_str_append(
-                buffer + written, amp_sub_size(buffer_size, written), border
-            );
+        if (!src_row.glyph
+        || !amp_clip_span(&x, dst_row.size, &src_x, src_row.size, &size)) {
+            continue;
         }
 
-        written += amp_str_append(
-            buffer + written, amp_sub_size(buffer_size, written),
-            right_top_corner
+        amp_blit_span(
+            dst_row, (size_t) x, src_row, (size_t) src_x, (size_t) size,
+            run->span
         );
     }
+}
 
-    const AMP_STYLE style_groups[] = {
-        AMP_STYLE_NONE,
-        (settings & AMP_FLATTEN) ? AMP_STYLE_NONE : amp_fg_color_styles,
-        (settings & AMP_FLATTEN) ? AMP_STYLE_NONE : amp_bg_color_styles,
-        ~AMP_STYLE_NONE
-    };
-
-    AMP_STYLE style_pool = ~AMP_STYLE_NONE;
+static inline void amp_draw_tilemap(
+    struct amp_type *dst, long camera_x, long camera_y,
+    const struct amp_tilemap_type *tilemap
+) {
+    const long tile_w = tilemap->tile_width;
+    const long tile_h = tilemap->tile_height;
+    long y_on_dst = 0;
+    long x_on_dst = 0;
+    long map_y = camera_y;
+    long map_x = camera_x;
+    long map_w = dst->width;
+    long map_h = dst->height;
+
+    // The size of the tilemap in cells may not fit in 32 bits. The cells
+    // beyond that are cut off, the same as they would be on an ansmap.
+    const uint64_t full_w = (uint64_t) tilemap->width * tilemap->tile_width;
+    const uint64_t full_h = (uint64_t) tilemap->height * tilemap->tile_height;
+
+    // Let's clip the visible part of the tilemap against the canvas once.
+    if (!tile_w || !tile_h || !tilemap->depth
+    ||  !amp_clip_span(
+            &x_on_dst, dst->width,
+            &map_x, full_w < UINT32_MAX ? (uint32_t) full_w : UINT32_MAX, &map_w
+        )
+    ||  !amp_clip_span(
+            &y_on_dst, dst->height,
+            &map_y, full_h < UINT32_MAX ? (uint32_t) full_h : UINT32_MAX, &map_h
+        )) {
+        return;
+    }
 
-    for (size_t i=0; i<sizeof(style_groups)/sizeof(style_groups[0]); ++i) {
-        AMP_STYLE layer_style;
-        AMP_STYLE style_group = style_groups[i] & style_pool;
+    for (long y = 0; y < map_h; ++y) {
+        const uint32_t tile_y = (uint32_t) ((map_y + y) / tile_h);
+        const uint32_t row = (uint32_t) ((map_y + y) % tile_h);
+        struct amp_row_type dst_row = {};
 
-        do {
-            layer_style = amp_styles_to_layer(amp, style_group);
+        for (long x = 0; x < map_w;) {
+            const uint32_t tile_x = (uint32_t) ((map_x + x) / tile_w);
+            const uint32_t col = (uint32_t) ((map_x + x) % tile_w);
+            const size_t size = (
+                (size_t) (tile_w - col < map_w - x ? tile_w - col : map_w - x)
+            );
+            uint32_t layer = tilemap->depth - 1;
 
-            if (layer_style || i == 0) {
-                ssize_t ret = amp_encode_layer(
-                    amp, settings, layer_style,
-                    to_stdout ? buffer : buffer + written,
-                    amp_sub_size(buffer_size, written)
+            // The layers below a fully opaque row of a tile are not visible.
+            for (; layer > 0; --layer) {
+                uint32_t src_x = 0;
+                const struct amp_row_type src_row = amp_get_tile_row(
+                    tilemap, layer, tile_x, tile_y, row, &src_x
                 );
 
-                if (ret < 0) {
-                    return -1;
+                if (src_row.glyph
+                && src_x + col + size <= src_row.size
+                && amp_get_span(src_row, src_x + col) == AMP_SPAN_OPAQUE
+                && amp_get_span_size(src_row, src_x + col, size) == size) {
+                    break;
                 }
-                else written += (size_t) ret;
             }
 
-            style_group &= ~layer_style;
-            style_pool &= ~layer_style;
-        } while (layer_style);
-    }
+            for (; layer < tilemap->depth; ++layer) {
+                uint32_t src_x = 0;
+                const struct amp_row_type src_row = amp_get_tile_row(
+                    tilemap, layer, tile_x, tile_y, row, &src_x
+                );
 
-    if (to_stdout) {
-        if (amp_stdout(left_bottom_corner, left_bottom_corner_size) < 0) {
-            return -1;
+                amp_blit_row(
+                    dst, y_on_dst + y, &dst_row, (size_t) (x_on_dst + x),
+                    src_row, src_x + col, size
+                );
+            }
+
+            x += (long) size;
         }
+    }
+}
 
-        written += left_bottom_corner_size;
+static inline void amp_init_compositor(
+    struct amp_compositor_type *compositor, struct amp_type *canvas,
+    struct amp_layer_type *layers, size_t layer_count
+) {
+    *compositor = (struct amp_compositor_type) {
+        .canvas = canvas,
+        .layers = layers,
+        .layer_count = layer_count
+    };
 
-        for (long x=0; x<amp->width; ++x) {
-            if (amp_stdout(border, border_size) < 0) {
-                return -1;
-            }
+    amp_damage_compositor(compositor, 0, 0, canvas->width, canvas->height);
+}
 
-            written += border_size;
-        }
+static inline void amp_damage_compositor(
+    struct amp_compositor_type *compositor, long x, long y, uint32_t w,
+    uint32_t h
+) {
+    amp_damage_rect(
+        compositor, (struct amp_rect_type) { .x = x, .y = y, .w = w, .h = h }
+    );
+}
 
-        if (amp_stdout(right_bottom_corner, right_bottom_corner_size) < 0) {
-            return -1;
-        }
+static inline void amp_damage_layer(
+    struct amp_compositor_type *compositor, size_t index
+) {
+    const struct amp_layer_type *layer = &compositor->layers[index];
 
-        written += right_bottom_corner_size;
+    if (!layer->visible || !layer->ansmap) {
+        return;
     }
-    else {
-        written += amp_str_append(
-            buffer + written, amp_sub_size(buffer_size, written),
-            left_bottom_corner
-        );
 
-        for (long x=0; x<amp->width; ++x) {
-            written += amp_str_append(
-                buffer + written, amp_sub_size(buffer_size, written), border
-            );
-        }
+    amp_damage_compositor(
+        compositor, layer->x, layer->y,
+        layer->ansmap->width, layer->ansmap->height
+    );
+}
 
-        written += amp_str_append(
-            buffer + written, amp_sub_size(buffer_size, written),
-            right_bottom_corner
-        );
+static inline void amp_move_layer(
+    struct amp_compositor_type *compositor, size_t index, long x, long y
+) {
+    struct amp_layer_type *layer = &compositor->layers[index];
+
+    if (layer->x == x && layer->y == y) {
+        return;
     }
 
-    if (!to_stdout) {
-        if (written >= buffer_size || !written) {
-            if (buffer_size) {
-                *buffer = '\0';
-            }
-        }
+    amp_damage_layer(compositor, index);
+    layer->x = x;
+    layer->y = y;
+    amp_damage_layer(compositor, index);
+}
+
+static inline void amp_show_layer(
+    struct amp_compositor_type *compositor, size_t index, bool visible
+) {
+    struct amp_layer_type *layer = &compositor->layers[index];
+
+    if (layer->visible == visible) {
+        return;
     }
 
-    return written > SSIZE_MAX ? -1 : (ssize_t) written;
+    layer->visible = true;
+    amp_damage_layer(compositor, index);
+    layer->visible = visible;
 }
 
-static inline uint32_t amp_doc_seg_parse_width(const char *str, size_t str_sz) {
-    size_t width = 0;
-    const char *prev_char = str;
-    const char *next_char = amp_str_seg_skip_str(prev_char, str_sz, "╔═");
+static inline void amp_compose(struct amp_compositor_type *compositor) {
+    for (size_t i = 0; i < compositor->damage_count; ++i) {
+        amp_compose_rect(compositor, compositor->damage[i]);
+    }
 
-    if (next_char > prev_char) {
-        while (next_char > prev_char) {
-            if (++width > UINT32_MAX) return 0;
+    compositor->damage_count = 0;
+}
 
-            prev_char = next_char;
-            next_char = amp_str_seg_skip_str(
-                prev_char, str_sz - (size_t) (prev_char - str), "═"
-            );
+static inline void amp_damage_rect(
+    struct amp_compositor_type *compositor, struct amp_rect_type rect
+) {
+    const struct amp_type *canvas = compositor->canvas;
+    long x = rect.x;
+    long y = rect.y;
+
+    if (!amp_clip_span(&x, canvas->width, &rect.x, canvas->width, &rect.w)
+    ||  !amp_clip_span(&y, canvas->height, &rect.y, canvas->height, &rect.h)) {
+        return;
+    }
+
+    // Overlapping and adjacent areas are merged into their bounding box, which
+    // may then overlap with some other area, so the merging is repeated.
+    for (size_t i = 0; i < compositor->damage_count;) {
+        const struct amp_rect_type other = compositor->damage[i];
+
+        if (compositor->damage_count < AMP_DAMAGE_MAX
+        && (other.x > rect.x + rect.w || rect.x > other.x + other.w
+        ||  other.y > rect.y + rect.h || rect.y > other.y + other.h)) {
+            ++i;
+            continue;
         }
 
-        prev_char = next_char;
-        next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "╗"
+        const long x1 = rect.x < other.x ? rect.x : other.x;
+        const long y1 = rect.y < other.y ? rect.y : other.y;
+        const long x2 = (
+            rect.x + rect.w > other.x + other.w ?
+            rect.x + rect.w : other.x + other.w
+        );
+        const long y2 = (
+            rect.y + rect.h > other.y + other.h ?
+            rect.y + rect.h : other.y + other.h
         );
 
-        if (next_char <= prev_char) {
-            width = 0;
-        }
+        rect = (struct amp_rect_type) {
+            .x = x1,
+            .y = y1,
+            .w = x2 - x1,
+            .h = y2 - y1
+        };
+
+        compositor->damage[i] = compositor->damage[--compositor->damage_count];
+        i = 0;
     }
 
-    return (uint32_t) width;
+    compositor->damage[compositor->damage_count++] = rect;
 }
 
-static inline size_t amp_doc_parse_size(
-    const void *data, size_t data_size, uint32_t *canvas_w, uint32_t *canvas_h
+static inline void amp_compose_rect(
+    struct amp_compositor_type *compositor, struct amp_rect_type rect
 ) {
-    const char *str = (const char *) data;
-    const size_t str_sz = data_size;
+    const struct amp_layer_type *layers = compositor->layers;
 
-    uint32_t width = 0;
-    uint32_t height = 0;
-    uint32_t layer_height = 0;
+    for (long y = rect.y; y < rect.y + rect.h; ++y) {
+        const struct amp_row_type dst_row = amp_write_row(
+            compositor->canvas, y
+        );
 
-    if (canvas_w) *canvas_w = 0;
-    if (canvas_h) *canvas_h = 0;
+        for (long x = rect.x; x < rect.x + rect.w; ++x) {
+            size_t base = compositor->layer_count;
+            bool covered = false;
 
-    for (const char *s = str; *s && s < str + str_sz;) {
-        const char *next_line = amp_str_seg_first_line_size(
-            s, str_sz - (size_t) (s - str), nullptr
-        );
+            if ((size_t) x >= dst_row.size) {
+                break;
+            }
 
-        if (next_line <= s) {
-            break;
-        }
+            // Let's find the topmost opaque cell, since it hides the layers
+            // below it.
+            while (base > 0 && !covered) {
+                const struct amp_layer_type *layer = &layers[--base];
 
-        if (!width) {
-            width = amp_doc_seg_parse_width(s, str_sz - (size_t) (s - str));
+                if (!layer->visible || !layer->ansmap
+                ||  y < layer->y || x < layer->x) {
+                    continue;
+                }
 
-            if (!width) {
-                return 0; // Invalid or corrupt AMP file detected.
+                const struct amp_row_type src_row = amp_read_row(
+                    layer->ansmap, y - layer->y
+                );
+                const size_t src_x = (size_t) (x - layer->x);
+
+                covered = (
+                    src_row.glyph && src_x < src_row.size &&
+                    amp_get_span(src_row, src_x) == AMP_SPAN_OPAQUE
+                );
             }
 
-            s = next_line;
-            continue;
-        }
+            if (!covered) {
+                memset(
+                    dst_row.glyph + (size_t) x * AMP_CELL_GLYPH_SIZE, 0,
+                    AMP_CELL_GLYPH_SIZE
+                );
 
-        const char *prev_char = s;
-        const char *next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "╚"
-        );
+                memset(
+                    dst_row.mode + (size_t) x * AMP_CELL_MODE_SIZE, 0,
+                    AMP_CELL_MODE_SIZE
+                );
+            }
 
-        if (next_char > prev_char) {
-            // Container end detected.
+            for (size_t i = base; i < compositor->layer_count; ++i) {
+                const struct amp_layer_type *layer = &layers[i];
 
-            height = height < layer_height ? layer_height : height;
+                if (!layer->visible || !layer->ansmap
+                ||  y < layer->y || x < layer->x) {
+                    continue;
+                }
 
-            if (canvas_w) *canvas_w = width;
-            if (canvas_h) *canvas_h = height;
+                const struct amp_row_type src_row = amp_read_row(
+                    layer->ansmap, y - layer->y
+                );
+                const size_t src_x = (size_t) (x - layer->x);
 
-            return amp_calc_size(width, height);
+                if (!src_row.glyph || src_x >= src_row.size) {
+                    continue;
+                }
+
+                amp_blit_span(
+                    dst_row, (size_t) x, src_row, src_x, 1,
+                    amp_get_span(src_row, src_x)
+                );
+            }
         }
+    }
+}
 
-        next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "╠"
-        );
+static inline size_t amp_calc_command_buffer_size(size_t count) {
+    return (
+        alignof(struct amp_command_type) - 1 +
+        count * sizeof(struct amp_command_type)
+    );
+}
 
-        if (next_char > prev_char) {
-            // Layer end detected.
+static inline size_t amp_init_command_buffer(
+    struct amp_command_buffer_type *buffer, void *data, size_t data_size
+) {
+    const size_t padding = (
+        data ? (
+            (
+                alignof(struct amp_command_type) -
+                (uintptr_t) data % alignof(struct amp_command_type)
+            ) % alignof(struct amp_command_type)
+        ) : 0
+    );
 
-            height = height < layer_height ? layer_height : height;
-            layer_height = 0;
-            s = next_line;
+    *buffer = (struct amp_command_buffer_type) {};
 
-            continue;
-        }
+    if (!data || data_size < padding) {
+        return 0;
+    }
 
-        next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "║"
-        );
+    buffer->commands = (struct amp_command_type *) (
+        (uint8_t *) data + padding
+    );
+    buffer->capacity = (data_size - padding) / sizeof(struct amp_command_type);
 
-        if (next_char == prev_char) {
-            return 0; // Invalid or corrupt AMP file detected.
-        }
+    return buffer->capacity;
+}
 
-        if (layer_height++ == UINT32_MAX) {
-            return 0; // Excessively tall AMP layer detected.
-        }
+static inline bool amp_record_glyph(
+    struct amp_command_buffer_type *buffer, long x, long y, AMP_STYLE style,
+    const char *glyph_str
+) {
+    char glyph[AMP_CELL_GLYPH_SIZE] = {};
 
-        s = next_line;
+    if (!amp_prepare_glyph(glyph_str, glyph)) {
+        return true; // Invalid glyphs are not printed anyway.
     }
 
-    return 0;
+    struct amp_command_type *command = amp_record_command(buffer, 1);
+
+    if (!command) {
+        return false;
+    }
+
+    command->type = AMP_COMMAND_GLYPH;
+    command->x = x;
+    command->y = y;
+    command->style = style;
+    memcpy(command->glyph, glyph, sizeof(glyph));
+
+    return true;
 }
 
-static inline size_t amp_decode_glyphs(
-    struct amp_type *amp, const char *str, size_t str_sz
+static inline bool amp_record_style(
+    struct amp_command_buffer_type *buffer, long x, long y, AMP_STYLE style
 ) {
-    uint32_t width = 0;
-    uint32_t height = 0;
-    long y = 0;
+    struct amp_command_type *command = amp_record_command(buffer, 1);
 
-    for (const char *s = str; *s && s < str + str_sz;) {
-        const char *next_line = amp_str_seg_first_line_size(
-            s, str_sz - (size_t) (s - str), nullptr
-        );
+    if (!command) {
+        return false;
+    }
+
+    command->type = AMP_COMMAND_STYLE;
+    command->x = x;
+    command->y = y;
+    command->style = style;
+
+    return true;
+}
+
+static inline bool amp_record_fill(
+    struct amp_command_buffer_type *buffer, long x, long y, uint32_t w,
+    uint32_t h, AMP_STYLE style, const char *glyph_str
+) {
+    char glyph[AMP_CELL_GLYPH_SIZE] = {};
+
+    if (!amp_prepare_glyph(glyph_str, glyph) || !w || !h) {
+        return true; // Nothing would be filled anyway.
+    }
+
+    struct amp_command_type *command = amp_record_command(buffer, h);
+
+    if (!command) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < h; ++i) {
+        command[i].type = AMP_COMMAND_FILL;
+        command[i].x = x;
+        command[i].y = y + i;
+        command[i].width = w;
+        command[i].style = style;
+        memcpy(command[i].glyph, glyph, sizeof(glyph));
+    }
+
+    return true;
+}
+
+static inline bool amp_record_ansmap_region(
+    struct amp_command_buffer_type *buffer, long x, long y,
+    const struct amp_type *src, long src_x, long src_y, uint32_t w, uint32_t h
+) {
+    if (!w || !h) {
+        return true;
+    }
 
-        if (next_line <= s) {
-            break;
-        }
+    struct amp_command_type *command = amp_record_command(buffer, h);
 
-        if (!width) {
-            width = amp_doc_seg_parse_width(s, str_sz - (size_t) (s - str));
+    if (!command) {
+        return false;
+    }
 
-            if (!width) {
-                return 0; // Invalid or corrupt AMP file detected.
-            }
+    for (uint32_t i = 0; i < h; ++i) {
+        command[i].type = AMP_COMMAND_ANSMAP;
+        command[i].src = src;
+        command[i].x = x;
+        command[i].y = y + i;
+        command[i].src_x = src_x;
+        command[i].src_y = src_y + i;
+        command[i].width = w;
+    }
 
-            s = next_line;
-            continue;
-        }
+    return true;
+}
 
-        const char *prev_char = s;
-        const char *next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "╚"
-        );
+static inline void amp_apply_commands(
+    struct amp_type *amp, struct amp_command_buffer_type *buffers, size_t count
+) {
+    // The commands are sorted by rows, keeping the order of recording within
+    // each row, so that every row is visited only once.
+    for (size_t i = 0; i < count; ++i) {
+        struct amp_command_buffer_type *buffer = &buffers[i];
+
+        for (size_t j = 1; j < buffer->count; ++j) {
+            if (amp_compare_commands(
+                &buffer->commands[j - 1], &buffer->commands[j]
+            ) > 0) {
+                qsort(
+                    buffer->commands, buffer->count,
+                    sizeof(struct amp_command_type), amp_compare_commands
+                );
 
-        if (next_char > prev_char) {
-            // Container end detected.
-            return amp_calc_size(width, height);
+                break;
+            }
         }
 
-        next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "╠"
-        );
+        buffer->next = 0;
+    }
 
-        if (next_char > prev_char) {
-            // Layer end detected.
-            return amp_calc_size(width, height);
-        }
+    // Let's merge the sorted command buffers row by row.
+    for (;;) {
+        bool found = false;
+        long y = 0;
 
-        next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "║"
-        );
+        for (size_t i = 0; i < count; ++i) {
+            const struct amp_command_buffer_type *buffer = &buffers[i];
 
-        if (next_char == prev_char) {
-            return 0; // Invalid or corrupt AMP file detected.
+            if (buffer->next < buffer->count
+            && (!found || buffer->commands[buffer->next].y < y)) {
+                y = buffer->commands[buffer->next].y;
+                found = true;
+            }
         }
 
-        if (height++ == UINT32_MAX) {
-            return 0; // Excessively tall AMP file detected.
+        if (!found) {
+            break;
         }
 
-        long x = 0;
+        for (size_t i = 0; i < count; ++i) {
+            struct amp_command_buffer_type *buffer = &buffers[i];
 
-        while (x < width) {
-            prev_char = next_char;
-            next_char = amp_str_seg_skip_any_utf8_symbol(
-                prev_char, str_sz - (size_t) (prev_char - str)
-            );
+            for (; buffer->next < buffer->count; ++buffer->next) {
+                const struct amp_command_type *command = &buffer->commands[
+                    buffer->next
+                ];
 
-            if (next_char <= prev_char) {
-                return 0; // Invalid or corrupt AMP file detected.
-            }
+                if (command->y != y) {
+                    break;
+                }
 
-            if (amp) {
-                // Let's allow decoding in simulation mode when amp is nullptr.
-                amp_put_glyph(amp, x, y, prev_char);
+                amp_apply_command(amp, command);
             }
-
-            ++x;
         }
-
-        ++y;
-        s = next_line;
     }
 
-    return 0;
+    for (size_t i = 0; i < count; ++i) {
+        buffers[i].count = 0;
+        buffers[i].next = 0;
+    }
 }
 
-static inline size_t amp_decode_styles(
-    struct amp_type *amp, const char *str, size_t str_sz
+static inline struct amp_command_type *amp_record_command(
+    struct amp_command_buffer_type *buffer, size_t row_count
 ) {
-    uint32_t width = 0;
-    uint32_t height = 0;
-    uint32_t layer_height = 0;
-    size_t layer = 0;
-    long y = 0;
-    long first_used_x = LONG_MAX;
-    long first_used_y = LONG_MAX;
-    long last_used_x = LONG_MIN;
-    long last_used_y = LONG_MIN;
-
-    if (amp) {
-        memset(amp->canvas.mode.data, 0, amp->canvas.mode.size);
+    if (row_count > buffer->capacity - buffer->count) {
+        return nullptr;
     }
 
-    for (const char *s = str; *s && s < str + str_sz;) {
-        const char *next_line = amp_str_seg_first_line_size(
-            s, str_sz - (size_t) (s - str), nullptr
-        );
+    struct amp_command_type *command = &buffer->commands[buffer->count];
 
-        if (next_line <= s) {
-            break;
-        }
+    for (size_t i = 0; i < row_count; ++i) {
+        command[i] = (struct amp_command_type) {
+            .order = buffer->count + i
+        };
+    }
 
-        if (!width) {
-            width = amp_doc_seg_parse_width(s, str_sz - (size_t) (s - str));
+    buffer->count += row_count;
 
-            if (!width) {
-                return 0; // Invalid or corrupt AMP file detected.
-            }
+    return command;
+}
 
-            s = next_line;
-            continue;
-        }
+static inline int amp_compare_commands(const void *a, const void *b) {
+    const struct amp_command_type *first = a;
+    const struct amp_command_type *second = b;
 
-        const char *prev_char = s;
-        const char *next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "╚"
-        );
+    if (first->y != second->y) {
+        return first->y < second->y ? -1 : 1;
+    }
 
-        if (next_char > prev_char) {
-            // Container end detected.
+    return (
+        first->order < second->order ? -1 : first->order > second->order
+    );
+}
 
-            if (amp
-            && first_used_x <= last_used_x
-            && first_used_y <= last_used_y) {
-                for (long y = first_used_y; y <= last_used_y; ++y) {
-                    for (long x = first_used_x; x <= last_used_x; ++x) {
-                        uint8_t *mode_data = amp_get_mode_data(amp, x, y);
+static inline void amp_apply_command(
+    struct amp_type *amp, const struct amp_command_type *command
+) {
+    switch (command->type) {
+        case AMP_COMMAND_GLYPH: {
+            amp_print_glyph(
+                amp, command->x, command->y, command->style, command->glyph
+            );
 
-                        if (!mode_data) {
-                            continue;
-                        }
+            return;
+        }
+        case AMP_COMMAND_STYLE: {
+            amp_put_style(amp, command->x, command->y, command->style);
 
-                        AMP_STYLE style;
-                        memcpy(&style, mode_data, sizeof(style));
-                        amp_put_style(amp, x, y, style);
-                    }
-                }
-            }
+            return;
+        }
+        case AMP_COMMAND_FILL: {
+            amp_fill_rect(
+                amp, command->x, command->y, command->width, 1,
+                command->style, command->glyph
+            );
 
-            height = height < layer_height ? layer_height : height;
+            return;
+        }
+        case AMP_COMMAND_ANSMAP: {
+            amp_draw_ansmap_region(
+                amp, command->x, command->y, command->src, command->src_x,
+                command->src_y, command->width, 1
+            );
 
-            return amp_calc_size(width, height);
+            return;
         }
+    }
+}
 
-        next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "╠"
-        );
+static inline struct amp_row_type amp_get_tile_row(
+    const struct amp_tilemap_type *tilemap, uint32_t layer, uint32_t x,
+    uint32_t y, uint32_t row, uint32_t *x_on_tileset
+) {
+    const size_t index = (
+        ((size_t) layer * tilemap->height + y) * tilemap->width + x
+    );
+    const uint32_t tile = tilemap->tiles[index];
+    const uint32_t step_x = tilemap->tile_width + tilemap->tile_spacing;
+    const uint32_t step_y = tilemap->tile_height + tilemap->tile_spacing;
+    const uint32_t columns = (
+        (tilemap->tileset->width + tilemap->tile_spacing) / step_x
+    );
 
-        if (next_char > prev_char) {
-            // Layer end detected.
+    if (!tile || !columns) {
+        return (struct amp_row_type) {};
+    }
 
-            ++layer;
-            height = height < layer_height ? layer_height : height;
-            layer_height = 0;
-            s = next_line;
-            y = 0;
+    *x_on_tileset = (tile - 1) % columns * step_x;
 
-            continue;
-        }
+    return amp_read_row(
+        tilemap->tileset, (long) ((tile - 1) / columns * step_y + row)
+    );
+}
 
-        next_char = amp_str_seg_skip_str(
-            prev_char, str_sz - (size_t) (prev_char - str), "║"
-        );
+static inline void amp_blit_row(
+    struct amp_type *dst, long dst_y, struct amp_row_type *dst_row,
+    size_t dst_x, struct amp_row_type src_row, size_t src_x, size_t size
+) {
+    if (!src_row.glyph) {
+        return; // All cells on an empty row are transparent.
+    }
 
-        if (next_char == prev_char) {
-            return 0; // Invalid or corrupt AMP file detected.
+    for (size_t x = 0; x < size;) {
+        if (src_x + x >= src_row.size) {
+            break;
         }
 
-        if (layer_height++ == UINT32_MAX) {
-            return 0; // Excessively tall AMP layer detected.
-        }
+        const AMP_SPAN span = amp_get_span(src_row, src_x + x);
+        size_t span_size = amp_get_span_size(src_row, src_x + x, size - x);
 
-        if (layer == 0) {
-            // Let's skip the text layer as we are only decoding the styles.
-            s = next_line;
+        if (span == AMP_SPAN_TRANSPARENT) {
+            x += span_size;
             continue;
         }
 
-        long x = 0;
+        if (!dst_row->glyph) {
+            // The destination row is not made writable before it is needed.
+            *dst_row = amp_write_row(dst, dst_y);
+        }
 
-        while (x < width) {
-            prev_char = next_char;
-            next_char = amp_str_seg_skip_any_utf8_symbol(
-                prev_char, str_sz - (size_t) (prev_char - str)
-            );
+        if (dst_x + x >= dst_row->size) {
+            break;
+        }
 
-            if (next_char <= prev_char) {
-                return 0; // Invalid or corrupt AMP file detected.
-            }
+        if (span_size > dst_row->size - (dst_x + x)) {
+            span_size = dst_row->size - (dst_x + x);
+        }
 
-            if (amp && *prev_char != ' ') {
-                // Let's allow decoding in simulation mode when amp is nullptr.
+        amp_blit_span(
+            *dst_row, dst_x + x, src_row, src_x + x, span_size, span
+        );
 
-                AMP_STYLE new_style = (
-                    amp_lookup_inline_style(prev_char).style
-                );
+        x += span_size;
+    }
+}
 
-                if (new_style != AMP_STYLE_NONE) {
-                    uint8_t *mode_data = amp_get_mode_data(amp, x, y);
+static inline AMP_SPAN amp_get_span(struct amp_row_type row, size_t x) {
+    const uint8_t *glyph = row.glyph + x * AMP_CELL_GLYPH_SIZE;
+    const uint8_t *mode = row.mode + x * AMP_CELL_MODE_SIZE;
 
-                    if (mode_data) {
-                        AMP_STYLE old_style;
-                        memcpy(&old_style, mode_data, sizeof(old_style));
-                        new_style |= old_style;
-                        memcpy(mode_data, &new_style, sizeof(new_style));
+    if (mode[6] & (1 << 1)) { // has background color
+        // The glyphs of the destination are not overwritten by empty glyphs.
+        return *glyph == '\0' ? AMP_SPAN_BACKDROP : AMP_SPAN_OPAQUE;
+    }
 
-                        if (x < first_used_x) first_used_x = x;
-                        if (y < first_used_y) first_used_y = y;
-                        if (x > last_used_x) last_used_x = x;
-                        if (y > last_used_y) last_used_y = y;
-                    }
-                }
-            }
+    if (*glyph == '\0' || *glyph == ' ') {
+        return AMP_SPAN_TRANSPARENT;
+    }
 
-            ++x;
-        }
+    return AMP_SPAN_INHERIT;
+}
 
-        ++y;
-        s = next_line;
+static inline size_t amp_get_span_size(
+    struct amp_row_type row, size_t x, size_t max_size
+) {
+    const AMP_SPAN span = amp_get_span(row, x);
+    size_t size = 1;
+
+    while (size < max_size && x + size < row.size
+    && amp_get_span(row, x + size) == span) {
+        ++size;
     }
 
-    return 0;
+    return size;
 }
 
-static inline size_t amp_decode(
-    struct amp_type *amp, const void *data, size_t data_size
+static inline void amp_blit_span(
+    struct amp_row_type dst_row, size_t dst_x,
+    struct amp_row_type src_row, size_t src_x, size_t size, AMP_SPAN span
 ) {
-    const char *str = (const char *) data;
-    const size_t str_sz = data_size;
+    uint8_t *dst_glyph = dst_row.glyph + dst_x * AMP_CELL_GLYPH_SIZE;
+    uint8_t *dst_mode = dst_row.mode + dst_x * AMP_CELL_MODE_SIZE;
+    const uint8_t *src_glyph = src_row.glyph + src_x * AMP_CELL_GLYPH_SIZE;
+    const uint8_t *src_mode = src_row.mode + src_x * AMP_CELL_MODE_SIZE;
 
-    amp_clear(amp);
+    switch (span) {
+        case AMP_SPAN_TRANSPARENT: {
+            return;
+        }
+        case AMP_SPAN_OPAQUE: {
+            memmove(dst_glyph, src_glyph, size * AMP_CELL_GLYPH_SIZE);
+            [[fallthrough]];
+        }
+        case AMP_SPAN_BACKDROP: {
+            memmove(dst_mode, src_mode, size * AMP_CELL_MODE_SIZE);
+            return;
+        }
+        case AMP_SPAN_INHERIT: {
+            break;
+        }
+    }
 
-    size_t decoded_amp_size = amp_decode_styles(amp, str, str_sz);
+    for (size_t i = 0; i < size; ++i) {
+        // The cell has no background, so it inherits the background color of
+        // the cell below it.
+        uint8_t *mode = dst_mode + i * AMP_CELL_MODE_SIZE;
+        uint8_t new_mode[AMP_CELL_MODE_SIZE];
 
-    if (decoded_amp_size) {
-        amp_decode_glyphs(amp, str, str_sz);
+        memcpy(new_mode, src_mode + i * AMP_CELL_MODE_SIZE, sizeof(new_mode));
+
+        if (mode[6] & (1 << 1)) {
+            memcpy(new_mode + 3, mode + 3, 3);
+            new_mode[6] |= (1 << 1);
+        }
+
+        memcpy(mode, new_mode, sizeof(new_mode));
     }
 
-    return decoded_amp_size;
+    memmove(dst_glyph, src_glyph, size * AMP_CELL_GLYPH_SIZE);
 }
 
-static inline void amp_draw_ansmap(
-    struct amp_type *amp, long x_on_amp, long y_on_amp,
-    const struct amp_type *sprite
+static inline bool amp_clip_span(
+    long *dst_pos, uint32_t dst_size, long *src_pos, uint32_t src_size,
+    long *length
 ) {
-    amp_draw_ansmap_region(
-        amp, x_on_amp, y_on_amp, sprite, 0, 0, sprite->width, sprite->height
-    );
-}
+    if (*length <= 0) {
+        return false;
+    }
 
-static inline void amp_draw_ansmap_region(
-    struct amp_type *dst, long x_on_dst, long y_on_dst,
-    const struct amp_type *src, long x_on_src, long y_on_src, long region_w,
-    long region_h
-) {
-    for (long dy=0; dy<region_h; ++dy) {
-        if (y_on_dst + dy >= dst->height) {
-            break;
-        }
+    long skip = 0;
 
-        for (long dx=0; dx<region_w; ++dx) {
-            if (x_on_dst + dx >= dst->width) {
-                break;
-            }
+    if (*dst_pos < 0) {
+        skip = *dst_pos > -*length ? -*dst_pos : *length;
+    }
 
-            auto new_mode = amp_get_mode(
-                src, x_on_src + dx, y_on_src + dy
-            );
+    if (*src_pos < 0) {
+        const long src_skip = *src_pos > -*length ? -*src_pos : *length;
 
-            const char *glyph = amp_get_glyph(src, x_on_src + dx, y_on_src+dy);
+        skip = skip < src_skip ? src_skip : skip;
+    }
 
-            if (new_mode.bitset.bg == false) {
-                if (!glyph || *glyph == '\0' || *glyph == ' ') {
-                    continue;
-                }
+    *dst_pos += skip;
+    *src_pos += skip;
+    *length -= skip;
 
-                auto const dst_mode = amp_get_mode(
-                    dst, x_on_dst + dx, y_on_dst + dy
-                );
+    if (*length <= 0 || *dst_pos >= dst_size || *src_pos >= src_size) {
+        return false;
+    }
 
-                if (dst_mode.bitset.bg) {
-                    new_mode.bitset.bg = true;
-                    new_mode.bg = dst_mode.bg;
-                }
-            }
+    if (*length > dst_size - *dst_pos) {
+        *length = dst_size - *dst_pos;
+    }
 
-            amp_set_mode(dst, x_on_dst + dx, y_on_dst + dy, new_mode);
-            amp_put_glyph(dst, x_on_dst + dx, y_on_dst + dy, glyph);
-        }
+    if (*length > src_size - *src_pos) {
+        *length = src_size - *src_pos;
     }
+
+    return true;
 }
 
 #endif
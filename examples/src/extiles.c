@@ -88,7 +88,7 @@ static void draw_dungeon(
     constexpr uint8_t dungeon_h = 6;
     constexpr uint8_t dungeon_d = 2;
 
-    static const uint8_t dungeon[dungeon_d][dungeon_h][dungeon_w] = {
+    static const uint16_t dungeon[dungeon_d][dungeon_h][dungeon_w] = {
         {
             { 4, 4, 4, 4, 5, 5, 4, 4, 4, 4 },
             { 4, 4, 5, 5, 5, 5, 5, 4, 4, 4 },
@@ -107,29 +107,16 @@ static void draw_dungeon(
         }
     };
 
-    for (long d=0; d<dungeon_d; ++d) {
-        for (long y=0; y<dungeon_h; ++y) {
-            for (long x=0; x<dungeon_w; ++x) {
-                uint8_t tile_index = dungeon[d][y][x];
-
-                if (!tile_index) {
-                    continue;
-                }
-
-                tile_index--;
-
-                uint8_t tile_w = 8;
-                uint8_t tile_h = 4;
-                long tile_from_x = tile_w * tile_index + tile_index;
-                long tile_from_y = 0;
-                long tile_to_x = tile_w * x;
-                long tile_to_y = tile_h * y;
-
-                amp_draw_ansmap_region(
-                    canvas, tile_to_x, tile_to_y,
-                    tiles, tile_from_x, tile_from_y, tile_w, tile_h
-                );
-            }
+    amp_draw_tilemap(
+        canvas, 0, 0, &(struct amp_tilemap_type) {
+            .tileset = tiles,
+            .tile_width = 8,
+            .tile_height = 4,
+            .tile_spacing = 1,
+            .tiles = &dungeon[0][0][0],
+            .width = dungeon_w,
+            .height = dungeon_h,
+            .depth = dungeon_d
         }
-    }
+    );
 }